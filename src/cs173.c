@@ -11,8 +11,20 @@
  */
 
 #include "limits.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "cs173.h"
+#include "cs173_cache.h"
+#include "cs173_codec.h"
 #include "cs173_gtl.h"
+#include "cs173_handle.h"
+#include "cs173_interp.h"
+#include "cs173_simd.h"
 #include "proj_api.h"
 
 
@@ -36,6 +48,8 @@ cs173_model_t *cs173_velocity_model;
 projPJ cs173_latlon;
 /** Proj.4 UTM projection holder. */
 projPJ cs173_utm;
+/** Proj.4 WGS84 UTM projection holder used to place query points in the model. */
+projPJ cs173_geo_utm;
 
 /** The cosine of the rotation angle used to rotate the box and point around the bottom-left corner. */
 double cs173_cos_rotation_angle = 0;
@@ -46,6 +60,90 @@ double cs173_sin_rotation_angle = 0;
 double cs173_total_height_m = 0;
 /** The width of this model's region, in meters. */
 double cs173_total_width_m = 0;
+
+/** The handle opened by cs173_init, behind the legacy API. */
+cs173_model_handle *cs173_default_handle = NULL;
+
+/** Bytes of model data currently held in memory, across all open handles. */
+static size_t cs173_memory_used = 0;
+/** Guards cs173_memory_used while handles are opened and closed. */
+static pthread_mutex_t cs173_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cs173_close_field(void *data, int status, size_t size);
+static void cs173_setup_batch_kernel(cs173_model_handle *handle);
+static int cs173_read_model(cs173_configuration_t *config, const char *directory, cs173_model_t *model);
+static int cs173_find_model(cs173_configuration_t *config, const char *directory, cs173_model_t *model);
+static void cs173_find_layout(cs173_configuration_t *config, const char *directory, cs173_model_t *model);
+static int cs173_load_model(cs173_configuration_t *config, const char *directory, cs173_model_t *model, int fields);
+static int cs173_setup_gtl(cs173_model_handle *handle);
+static double cs173_vs_to_density(cs173_configuration_t *config, double vs);
+static int cs173_read_mask(cs173_configuration_t *config, int fields, int gtl);
+static int cs173_query_points(cs173_model_handle *handle, cs173_point_t *points, cs173_properties_t *data, int numpoints,
+                              int fields, const double *projected_e, const double *projected_n);
+static int cs173_query_sorted(cs173_model_handle *handle, cs173_point_t *points, cs173_properties_t *data, int numpoints,
+                              int fields);
+static void cs173_query_chunk(void *arg, int start, int end);
+static void cs173_sort_chunk(void *arg, int start, int end);
+static int cs173_stencil_cell(cs173_model_handle *handle, double utm_e, double utm_n, double depth, int *cell);
+static void cs173_prefetch_stencils(cs173_model_handle *handle, const cs173_point_t *points, const double *utm_e,
+                                    const double *utm_n, int count, int read, cs173_stats_t *stats);
+static inline long cs173_location(cs173_model_t *model, int x, int y, int z);
+static void cs173_derive_q(cs173_properties_t *data);
+static void cs173_mask_fields(cs173_properties_t *data, int fields);
+static void cs173_mesh_rows(void *arg, int start, int end);
+static void cs173_read_sample(cs173_model_t *model, long location, cs173_properties_t *data, int fields);
+static void cs173_release_thread_state(cs173_model_handle *handle);
+static inline unsigned long long cs173_clock_ns();
+static void cs173_add_stats(cs173_stats_t *to, cs173_stats_t *from);
+static void cs173_report_stats(cs173_model_handle *handle);
+static void cs173_setup_vs30_raster(cs173_model_handle *handle);
+static int too_big(cs173_configuration_t *config, size_t size);
+static size_t cs173_memory_room(cs173_configuration_t *config);
+static cs173_cache_t *cs173_create_cache(cs173_configuration_t *config, long megabytes, size_t page_size,
+                                         size_t *charge);
+static void cs173_destroy_cache(cs173_cache_t *cache, size_t charge);
+
+/** A query split across the handle's worker pool. */
+typedef struct cs173_query_job_t {
+	/** The model handle */
+	cs173_model_handle *handle;
+	/** The points being queried */
+	cs173_point_t *points;
+	/** The data being returned */
+	cs173_properties_t *data;
+	/** The CS173_FIELD_* bits of the fields asked for */
+	int fields;
+	/** UTM eastings of the points, already projected, or NULL */
+	double *utm_e;
+	/** UTM northings of the points, already projected, or NULL */
+	double *utm_n;
+	/** The location within the model files of each point's stencil, for sorting */
+	uint64_t *key;
+	/** Set to FAIL if any chunk fails */
+	int result;
+} cs173_query_job_t;
+
+/**
+ * Returns the size in bytes of the bricked voxel file for the model's brick grid.
+ */
+static size_t cs173_bricked_size(cs173_model_t *model) {
+	return (size_t)model->brick_nx * model->brick_ny * model->brick_nz * CS173_BRICK_VOXELS * 3 * sizeof(float);
+}
+
+/**
+ * Returns the size in bytes of the quantized voxels of the model's brick grid, which the
+ * quantized file holds ahead of the offset and scale of each brick.
+ */
+static size_t cs173_quantized_size(cs173_model_t *model) {
+	return (size_t)model->brick_nx * model->brick_ny * model->brick_nz * CS173_BRICK_VOXELS * 3 * sizeof(uint16_t);
+}
+
+/**
+ * Returns the size in bytes of the offsets and scales that follow the quantized voxels.
+ */
+static size_t cs173_brick_range_size(cs173_model_t *model) {
+	return (size_t)model->brick_nx * model->brick_ny * model->brick_nz * 6 * sizeof(float);
+}
 /**
  * Initializes the CS173 plugin model within the UCVM framework. In order to initialize
  * the model, we must provide the UCVM install path and optionally a place in memory
@@ -56,58 +154,112 @@ double cs173_total_width_m = 0;
  * @return Success or failure, if initialization was successful.
  */
 int cs173_init(const char *dir, const char *label) {
-	int tempVal = 0;
+	cs173_model_handle *handle = cs173_open(dir, label);
+
+	if (handle == NULL)
+		return FAIL;
+
+	// The legacy API and globals all refer to this handle.
+	cs173_default_handle = handle;
+	cs173_configuration = handle->config;
+	cs173_velocity_model = handle->model;
+	sprintf(cs173_iteration_directory, "%s", handle->iteration_directory);
+	cs173_latlon = handle->latlon;
+	cs173_utm = handle->utm;
+	cs173_geo_utm = handle->geo_utm;
+	cs173_cos_rotation_angle = handle->cos_rotation_angle;
+	cs173_sin_rotation_angle = handle->sin_rotation_angle;
+	cs173_total_height_m = handle->total_height_m;
+	cs173_total_width_m = handle->total_width_m;
+	cs173_vs30_map = handle->vs30_map;
+	sprintf(cs173_vs30_etree_file, "%s", handle->vs30_etree_file);
+	cs173_aeqd = handle->aeqd;
+	cs173_cos_vs30_rotation_angle = handle->cos_vs30_rotation_angle;
+	cs173_sin_vs30_rotation_angle = handle->sin_vs30_rotation_angle;
+
+	// Let everyone know that we are initialized and ready for business.
+	cs173_is_initialized = 1;
+
+	return SUCCESS;
+}
+
+/**
+ * Opens the CS173 model within the UCVM framework and returns a handle to it. Unless init =
+ * eager, the model fields and the Vs30 map are set up by the first query that needs them,
+ * under the handle's lock and published only once complete, so the handle may be queried from
+ * any number of threads at once with cs173_query_h.
+ *
+ * @param dir The directory in which UCVM has been installed.
+ * @param label A unique identifier for the velocity model.
+ * @return The model handle, or NULL if the model could not be opened.
+ */
+cs173_model_handle *cs173_open(const char *dir, const char *label) {
+	cs173_model_handle *handle = calloc(1, sizeof(cs173_model_handle));
+	cs173_configuration_t *config = NULL;
+	int threads = 0;
 	char configbuf[512];
 	double north_height_m = 0, east_width_m = 0, rotation_angle = 0;
 
+	if (handle == NULL) return NULL;
+	if (pthread_key_create(&handle->thread_key, NULL) != 0) {
+		free(handle);
+		return NULL;
+	}
+	pthread_mutex_init(&handle->thread_lock, NULL);
+	pthread_mutex_init(&handle->vs30_lock, NULL);
+	pthread_mutex_init(&handle->load_lock, NULL);
+
 	// Initialize variables.
-	cs173_configuration = calloc(1, sizeof(cs173_configuration_t));
-	cs173_velocity_model = calloc(1, sizeof(cs173_model_t));
-        cs173_vs30_map = calloc(1, sizeof(cs173_vs30_map_config_t));
+	config = handle->config = calloc(1, sizeof(cs173_configuration_t));
+	handle->model = calloc(1, sizeof(cs173_model_t));
+	handle->vs30_map = calloc(1, sizeof(cs173_vs30_map_config_t));
+	if (config == NULL || handle->model == NULL || handle->vs30_map == NULL) {
+		cs173_close(handle);
+		return NULL;
+	}
 
 	// Configuration file location.
 	sprintf(configbuf, "%s/model/%s/data/config", dir, label);
 
-        // Set up model directories.
-        sprintf(cs173_vs30_etree_file, "%s/model/ucvm/ucvm.e", dir);
+	// Set up model directories.
+	sprintf(handle->vs30_etree_file, "%s/model/ucvm/ucvm.e", dir);
 
 	// Read the cs173_configuration file.
-	if (cs173_read_configuration(configbuf, cs173_configuration) != SUCCESS)
-		return FAIL;
+	if (cs173_read_configuration(configbuf, config) != SUCCESS) {
+		cs173_close(handle);
+		return NULL;
+	}
 
 	// Set up the iteration directory.
-	sprintf(cs173_iteration_directory, "%s/model/%s/data/%s/", dir, label, cs173_configuration->model_dir);
-
-	// Can we allocate the model, or parts of it, to memory. If so, we do.
-	tempVal = cs173_try_reading_model(cs173_velocity_model);
+	sprintf(handle->iteration_directory, "%s/model/%s/data/%s/", dir, label, config->model_dir);
 
-	if (tempVal == SUCCESS) {
-		fprintf(stderr, "WARNING: Could not load model into memory. Reading the model from the\n");
-		fprintf(stderr, "hard disk may result in slow performance.\n");
-	} else if (tempVal == FAIL) {
+	// See which model files there are. They are opened, read into memory or mapped as the
+	// queries come to need them, unless the configuration asks for all of it up front.
+	if (cs173_find_model(config, handle->iteration_directory, handle->model) != SUCCESS) {
 		cs173_print_error("No model file was found to read from.");
-		return FAIL;
+		cs173_close(handle);
+		return NULL;
 	}
 
-        if (cs173_read_vs30_map(cs173_vs30_etree_file, cs173_vs30_map) != SUCCESS) {
-                cs173_print_error("Could not read the Vs30 map data from UCVM.");
-                return FAIL;
-        }
-
 	// We need to convert the point from lat, lon to UTM, let's set it up.
-	if (!(cs173_latlon = pj_init_plus("+proj=latlong +datum=WGS84"))) {
+	if (!(handle->latlon = pj_init_plus("+proj=latlong +datum=WGS84"))) {
 		cs173_print_error("Could not set up latitude and longitude projection.");
-		return FAIL;
+		cs173_close(handle);
+		return NULL;
 	}
-	if (!(cs173_utm = pj_init_plus("+proj=utm +zone=11 +ellps=clrk66 +datum=NAD27 +units=m +no_defs"))) {
+	if (!(handle->utm = pj_init_plus("+proj=utm +zone=11 +ellps=clrk66 +datum=NAD27 +units=m +no_defs"))) {
 		cs173_print_error("Could not set up UTM projection.");
-		return FAIL;
+		cs173_close(handle);
+		return NULL;
 	}
 
-        if (!(cs173_aeqd = pj_init_plus(cs173_vs30_map->projection))) {
-                cs173_print_error("Could not set up AEQD projection.");
-                return FAIL;
-        }
+	// The query points are projected with this one, so build it once here rather than per point.
+	sprintf(handle->geo_utm_definition, "+proj=utm +zone=%d +ellps=WGS84", config->utm_zone);
+	if (!(handle->geo_utm = pj_init_plus(handle->geo_utm_definition))) {
+		cs173_print_error("Could not set up query point UTM projection.");
+		cs173_close(handle);
+		return NULL;
+	}
 
 	// In order to simplify our calculations in the query, we want to rotate the box so that the bottom-left
 	// corner is at (0m,0m). Our box's height is total_height_m and total_width_m. We then rotate the
@@ -115,37 +267,398 @@ int cs173_init(const char *dir, const char *label) {
 	// the X and Y axis determines which grid points we use for the interpolation routine.
 
 	// Calculate the rotation angle of the box.
-	north_height_m = cs173_configuration->top_left_corner_n - cs173_configuration->bottom_left_corner_n;
-	east_width_m = cs173_configuration->top_left_corner_e - cs173_configuration->bottom_left_corner_e;
+	north_height_m = config->top_left_corner_n - config->bottom_left_corner_n;
+	east_width_m = config->top_left_corner_e - config->bottom_left_corner_e;
 
 	// Rotation angle. Cos, sin, and tan are expensive computationally, so calculate once.
 	rotation_angle = atan(east_width_m / north_height_m);
 
-	cs173_cos_rotation_angle = cos(rotation_angle);
-	cs173_sin_rotation_angle = sin(rotation_angle);
+	handle->cos_rotation_angle = cos(rotation_angle);
+	handle->sin_rotation_angle = sin(rotation_angle);
+
+	handle->total_height_m = sqrt(pow(config->top_left_corner_n - config->bottom_left_corner_n, 2.0f) +
+						  pow(config->top_left_corner_e - config->bottom_left_corner_e, 2.0f));
+	handle->total_width_m  = sqrt(pow(config->top_right_corner_n - config->top_left_corner_n, 2.0f) +
+						  pow(config->top_right_corner_e - config->top_left_corner_e, 2.0f));
 
-	cs173_total_height_m = sqrt(pow(cs173_configuration->top_left_corner_n - cs173_configuration->bottom_left_corner_n, 2.0f) +
-						  pow(cs173_configuration->top_left_corner_e - cs173_configuration->bottom_left_corner_e, 2.0f));
-	cs173_total_width_m  = sqrt(pow(cs173_configuration->top_right_corner_n - cs173_configuration->top_left_corner_n, 2.0f) +
-						  pow(cs173_configuration->top_right_corner_e - cs173_configuration->top_left_corner_e, 2.0f));
+	if (config->eager_init) {
+		if (cs173_load_fields(handle, CS173_FIELD_ALL) != SUCCESS) {
+			cs173_close(handle);
+			return NULL;
+		}
+		if (cs173_ensure_gtl(handle) != SUCCESS) {
+			cs173_close(handle);
+			return NULL;
+		}
+	}
 
-        // Get the cos and sin for the Vs30 map rotation.
-        cs173_cos_vs30_rotation_angle = cos(cs173_vs30_map->rotation * DEG_TO_RAD);
-        cs173_sin_vs30_rotation_angle = sin(cs173_vs30_map->rotation * DEG_TO_RAD);
+	// Split large queries across a pool of workers, if asked to.
+	threads = config->query_threads;
+	if (getenv("CS173_QUERY_THREADS") != NULL)
+		threads = (strcmp(getenv("CS173_QUERY_THREADS"), "auto") == 0) ? -1 : atoi(getenv("CS173_QUERY_THREADS"));
+	if (threads < 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > 1) handle->pool = cs173_pool_create(threads);
 
-	// Let everyone know that we are initialized and ready for business.
-	cs173_is_initialized = 1;
+	return handle;
+}
+
+/**
+ * Opens the given fields of a handle's model, if they are not open yet. Safe to call from
+ * several threads at once: the first caller opens the fields while the others wait, and
+ * once they are open the check costs one atomic load. A field that could not be opened is not
+ * tried again, and every later call that asks for it fails too.
+ *
+ * @param handle The model handle.
+ * @param fields The CS173_FIELD_* bits of the fields to open.
+ * @return SUCCESS, or FAIL if any of the fields was found but could not be opened.
+ */
+int cs173_load_fields(cs173_model_handle *handle, int fields) {
+	cs173_model_t *model = handle->model;
+	int ret = SUCCESS;
+
+	fields &= model->present;
+	if ((__atomic_load_n(&model->ready, __ATOMIC_ACQUIRE) & fields) == fields)
+		return (model->broken & fields) ? FAIL : SUCCESS;
+
+	pthread_mutex_lock(&handle->load_lock);
+	// The voxel files hold vp, vs and rho together, so they are opened for all three at once.
+	if (model->layout != CS173_LAYOUT_PLANAR && (fields & CS173_FIELD_VOXEL))
+		fields |= CS173_FIELD_VOXEL & model->present;
+	fields &= ~model->ready;
+	if (fields != 0) {
+		ret = cs173_load_model(handle->config, handle->iteration_directory, model, fields);
+		// Fields may be opened a few at a time, but one warning per handle is enough.
+		if (ret == SUCCESS && !model->disk_warned) {
+			fprintf(stderr, "WARNING: Could not load model into memory. Reading the model from the\n");
+			fprintf(stderr, "hard disk may result in slow performance.\n");
+			model->disk_warned = 1;
+		}
+
+		// Pick the SIMD kernel for the interior points, if the CPU and the model storage allow it.
+		if (fields & CS173_FIELD_VOXEL)
+			cs173_setup_batch_kernel(handle);
+
+		__atomic_store_n(&model->ready, model->ready | fields, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&handle->load_lock);
+
+	return (model->broken & fields) ? FAIL : SUCCESS;
+}
+
+/**
+ * Sets up a handle's Vs30 map and projection, if they are not set up yet. Safe to call from
+ * several threads at once. A map that could not be set up is not tried again.
+ *
+ * @param handle The model handle.
+ * @return SUCCESS, or FAIL if the Vs30 map could not be set up.
+ */
+int cs173_ensure_gtl(cs173_model_handle *handle) {
+	int state = 0;
+
+	if (handle == NULL) return FAIL;
+
+	state = __atomic_load_n(&handle->gtl_state, __ATOMIC_ACQUIRE);
+	if (state == 0) {
+		pthread_mutex_lock(&handle->load_lock);
+		state = handle->gtl_state;
+		if (state == 0) {
+			state = (cs173_setup_gtl(handle) == SUCCESS) ? 1 : -1;
+			__atomic_store_n(&handle->gtl_state, state, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&handle->load_lock);
+	}
+
+	return (state == 1) ? SUCCESS : FAIL;
+}
+
+/**
+ * Sets up the GTL of a handle, and the calling thread's projection to the Vs30 map, if they
+ * are not set up yet.
+ *
+ * @param handle The model handle.
+ * @param thread The calling thread's state.
+ * @return SUCCESS, or FAIL if the Vs30 map or the projection could not be set up.
+ */
+int cs173_thread_gtl(cs173_model_handle *handle, cs173_thread_t *thread) {
+	if (cs173_ensure_gtl(handle) != SUCCESS) return FAIL;
+	if (thread->aeqd == NULL)
+		thread->aeqd = pj_init_plus_ctx(thread->ctx, handle->vs30_map->projection);
+
+	return (thread->aeqd != NULL) ? SUCCESS : FAIL;
+}
+
+/**
+ * Reads the Vs30 map of a handle and works out the constants the GTL needs.
+ *
+ * @param handle The model handle.
+ * @return SUCCESS or FAIL.
+ */
+static int cs173_setup_gtl(cs173_model_handle *handle) {
+	if (cs173_read_vs30_map(handle->vs30_etree_file, handle->vs30_map) != SUCCESS) {
+		cs173_print_error("Could not read the Vs30 map data from UCVM.");
+		return FAIL;
+	}
+
+	if (!(handle->aeqd = pj_init_plus(handle->vs30_map->projection))) {
+		cs173_print_error("Could not set up AEQD projection.");
+		return FAIL;
+	}
+
+	// The Vs30 map origin never moves, so project it once here rather than for every GTL point.
+	handle->vs30_map->origin_e = handle->vs30_map->origin_point.longitude * DEG_TO_RAD;
+	handle->vs30_map->origin_n = handle->vs30_map->origin_point.latitude * DEG_TO_RAD;
+	pj_transform(handle->latlon, handle->aeqd, 1, 1, &handle->vs30_map->origin_e, &handle->vs30_map->origin_n, NULL);
+
+	// Get the cos and sin for the Vs30 map rotation.
+	handle->cos_vs30_rotation_angle = cos(handle->vs30_map->rotation * DEG_TO_RAD);
+	handle->sin_vs30_rotation_angle = sin(handle->vs30_map->rotation * DEG_TO_RAD);
+
+	// Pull the Vs30 map under the model into memory, if asked to.
+	if (handle->config->gtl == 1 && handle->config->vs30_raster)
+		cs173_setup_vs30_raster(handle);
+
+	// The legacy globals of a default handle opened lazily were copied before this ran.
+	if (handle == cs173_default_handle) {
+		cs173_aeqd = handle->aeqd;
+		cs173_cos_vs30_rotation_angle = handle->cos_vs30_rotation_angle;
+		cs173_sin_vs30_rotation_angle = handle->sin_vs30_rotation_angle;
+	}
 
 	return SUCCESS;
 }
 
-#define PROJ_GEO_IPJ "+proj=latlong +datum=WGS84"
-#define PROJ_GEO_OPJ "+proj=utm +zone=11 +ellps=WGS84"
-static int to_utm(double *lon, double *lat) {
-	projPJ ipj= pj_init_plus(PROJ_GEO_IPJ);
-	projPJ opj = pj_init_plus(PROJ_GEO_OPJ);
-	int p = pj_transform(ipj, opj, 1, 1, lon, lat, NULL );
-	return p;
+/**
+ * Works out which samples of the Vs30 map lie under the model's box and reads them into an
+ * in-memory raster. Falls back to searching the e-tree, with a warning, if the raster would
+ * not fit the memory budget.
+ *
+ * @param handle The model handle being opened.
+ */
+static void cs173_setup_vs30_raster(cs173_model_handle *handle) {
+	cs173_configuration_t *config = handle->config;
+	cs173_vs30_map_config_t *map = handle->vs30_map;
+	double corner_e[4] = { config->bottom_left_corner_e, config->bottom_right_corner_e,
+	                       config->top_left_corner_e, config->top_right_corner_e };
+	double corner_n[4] = { config->bottom_left_corner_n, config->bottom_right_corner_n,
+	                       config->top_left_corner_n, config->top_right_corner_n };
+	double x[4], y[4], x_min = 0, x_max = 0, y_min = 0, y_max = 0, margin = 0;
+	long x0 = 0, x1 = 0, y0 = 0, y1 = 0, last_x = 0, last_y = 0;
+	size_t size = 0;
+	int i = 0, fits = 0;
+	char cache[512];
+
+	// Corners to the map frame, the same way query points get there.
+	pj_transform(handle->geo_utm, handle->latlon, 4, 1, corner_e, corner_n, NULL);
+	pj_transform(handle->latlon, handle->aeqd, 4, 1, corner_e, corner_n, NULL);
+	for (i = 0; i < 4; i++) {
+		x[i] = handle->cos_vs30_rotation_angle * (corner_e[i] - map->origin_e) -
+		       handle->sin_vs30_rotation_angle * (corner_n[i] - map->origin_n);
+		y[i] = handle->sin_vs30_rotation_angle * (corner_e[i] - map->origin_e) +
+		       handle->cos_vs30_rotation_angle * (corner_n[i] - map->origin_n);
+		if (i == 0 || x[i] < x_min) x_min = x[i];
+		if (i == 0 || x[i] > x_max) x_max = x[i];
+		if (i == 0 || y[i] < y_min) y_min = y[i];
+		if (i == 0 || y[i] > y_max) y_max = y[i];
+	}
+
+	// The box edges are straight in UTM but bow slightly in the map projection, so pad the footprint.
+	// Lookups that still fall outside go to the e-tree.
+	margin = 0.02 * ((x_max - x_min > y_max - y_min) ? x_max - x_min : y_max - y_min) + 2 * map->edge_size;
+	last_x = (long)floor(map->x_dimension / map->edge_size) + 1;
+	last_y = (long)floor(map->y_dimension / map->edge_size) + 1;
+	x0 = (long)floor((x_min - margin) / map->edge_size);
+	y0 = (long)floor((y_min - margin) / map->edge_size);
+	x1 = (long)floor((x_max + margin) / map->edge_size) + 1;
+	y1 = (long)floor((y_max + margin) / map->edge_size) + 1;
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > last_x) x1 = last_x;
+	if (y1 > last_y) y1 = last_y;
+	if (x1 <= x0 || y1 <= y0) return;
+
+	// A raster cached by an earlier run for this same e-tree and footprint spares the e-tree altogether.
+	if (strcmp(config->vs30_cache, "off") == 0)
+		cache[0] = '\0';
+	else if (config->vs30_cache[0] != '\0')
+		sprintf(cache, "%s", config->vs30_cache);
+	else
+		sprintf(cache, "%s%s", handle->iteration_directory, CS173_VS30_CACHE_FILE);
+	if (cache[0] != '\0' && cs173_load_vs30_raster(map, cache, x0, y0, x1 - x0 + 1, y1 - y0 + 1) == SUCCESS)
+		return;
+
+	size = (size_t)(x1 - x0 + 1) * (y1 - y0 + 1) * sizeof(float);
+	pthread_mutex_lock(&cs173_memory_lock);
+	fits = !too_big(config, size);
+	if (fits) cs173_memory_used += size;
+	pthread_mutex_unlock(&cs173_memory_lock);
+
+	if (!fits || cs173_rasterize_vs30_map(map, x0, y0, x1 - x0 + 1, y1 - y0 + 1) != SUCCESS) {
+		if (fits) {
+			pthread_mutex_lock(&cs173_memory_lock);
+			cs173_memory_used -= size;
+			pthread_mutex_unlock(&cs173_memory_lock);
+		}
+		fprintf(stderr, "WARNING: Could not read the Vs30 map into memory. GTL queries will\n");
+		fprintf(stderr, "search the Vs30 e-tree instead.\n");
+		return;
+	}
+
+	// Failing to write the cache, say to a read-only install, only costs the next run time.
+	if (cache[0] != '\0')
+		cs173_save_vs30_raster(map, cache);
+}
+
+/**
+ * Frees one thread state and its projections.
+ *
+ * @param thread The thread state.
+ */
+static void cs173_free_thread(cs173_thread_t *thread) {
+	if (thread->latlon) pj_free(thread->latlon);
+	if (thread->geo_utm) pj_free(thread->geo_utm);
+	if (thread->aeqd) pj_free(thread->aeqd);
+	if (thread->ctx) pj_ctx_free(thread->ctx);
+	free(thread);
+}
+
+/**
+ * Frees the calling thread's state for a handle, for threads that exit long before the handle
+ * is closed.
+ *
+ * @param handle The model handle.
+ */
+static void cs173_release_thread_state(cs173_model_handle *handle) {
+	cs173_thread_t *thread = pthread_getspecific(handle->thread_key), **link = NULL;
+
+	if (thread == NULL) return;
+
+	pthread_mutex_lock(&handle->thread_lock);
+	for (link = &handle->threads; *link != NULL; link = &(*link)->next) {
+		if (*link != thread) continue;
+		*link = thread->next;
+		break;
+	}
+	cs173_add_stats(&handle->retired_stats, &thread->stats);
+	pthread_mutex_unlock(&handle->thread_lock);
+
+	pthread_setspecific(handle->thread_key, NULL);
+	cs173_free_thread(thread);
+}
+
+/**
+ * Returns the calling thread's state for a handle. Proj.4 projections may not be used by two
+ * threads at once, so each thread gets its own, built on its own context the first time it
+ * queries the handle and kept until the handle is closed.
+ *
+ * @param handle The model handle.
+ * @return The thread state, or NULL if the projections could not be set up.
+ */
+cs173_thread_t *cs173_thread_state(cs173_model_handle *handle) {
+	cs173_thread_t *thread = pthread_getspecific(handle->thread_key);
+
+	if (thread != NULL) return thread;
+
+	thread = calloc(1, sizeof(cs173_thread_t));
+	if (thread == NULL) return NULL;
+	// The Vs30 map projection waits for the thread's first GTL point, in cs173_thread_gtl.
+	if (!(thread->ctx = pj_ctx_alloc()) ||
+	    !(thread->latlon = pj_init_plus_ctx(thread->ctx, "+proj=latlong +datum=WGS84")) ||
+	    !(thread->geo_utm = pj_init_plus_ctx(thread->ctx, handle->geo_utm_definition)) ||
+	    pthread_setspecific(handle->thread_key, thread) != 0) {
+		cs173_free_thread(thread);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&handle->thread_lock);
+	thread->next = handle->threads;
+	handle->threads = thread;
+	pthread_mutex_unlock(&handle->thread_lock);
+
+	return thread;
+}
+
+/**
+ * Gathers the model constants for the batch query kernel and picks the kernel. The kernels
+ * gather straight from memory, so they only serve the fields that are in memory or mapped:
+ * the interleaved voxels, or any of the planar fields. As more fields are opened this is
+ * called again and only adds them, so queries already running on the kernel are unaffected.
+ *
+ * @param handle The model handle being opened.
+ */
+static void cs173_setup_batch_kernel(cs173_model_handle *handle) {
+	cs173_configuration_t *config = handle->config;
+	cs173_model_t *model = handle->model;
+	cs173_batch_params_t *p = &handle->batch_params;
+	int *statuses[3] = { &model->vp_status, &model->vs_status, &model->rho_status };
+	void **planar[3] = { &model->vp, &model->vs, &model->rho };
+	double width = 1;
+	int i = 0, fields = 0;
+
+	if (model->layout == CS173_LAYOUT_INTERLEAVED && model->voxels_status >= 2) {
+		width = 3;
+		for (i = 0; i < 3; i++) p->field[i] = (float *)model->voxels + i;
+		fields = CS173_FIELD_VOXEL;
+	} else if (model->layout == CS173_LAYOUT_PLANAR) {
+		for (i = 0; i < 3; i++) {
+			if (*statuses[i] < 2) continue;
+			p->field[i] = (float *)*planar[i];
+			fields |= 1 << i;
+		}
+	}
+	if (fields == 0) return;
+
+	// The constants never change, so they are set before the kernel is first published.
+	if (handle->batch_kernel == NULL) {
+		p->corner_e = config->bottom_left_corner_e;
+		p->corner_n = config->bottom_left_corner_n;
+		p->cos_rotation = handle->cos_rotation_angle;
+		p->sin_rotation = handle->sin_rotation_angle;
+		p->width_m = handle->total_width_m;
+		p->height_m = handle->total_height_m;
+		p->nx1 = config->nx - 1;
+		p->ny1 = config->ny - 1;
+		p->x_interval = (config->nx > 1) ? handle->total_width_m / (config->nx - 1) : handle->total_width_m;
+		p->y_interval = (config->ny > 1) ? handle->total_height_m / (config->ny - 1) : handle->total_height_m;
+		p->depth_interval = config->depth_interval;
+		p->z_top = config->depth / config->depth_interval - 1;
+		p->gtl_depth = config->gtl == 1 ? config->depth_interval : -1;
+		p->origin = width * model->strides.origin;
+		p->dx = width * model->strides.dx;
+		p->dy = width * model->strides.dy;
+		p->dz = width * model->strides.dz;
+		for (i = 0; i < 8; i++) p->delta[i] = (long long)width * model->corner_delta[i];
+	}
+
+	__atomic_store_n(&handle->batch_fields, handle->batch_fields | fields, __ATOMIC_RELEASE);
+	if (handle->batch_kernel == NULL)
+		__atomic_store_n(&handle->batch_kernel, cs173_select_batch_kernel(config->simd), __ATOMIC_RELEASE);
+}
+
+/**
+ * Converts arrays of WGS84 longitudes and latitudes in degrees to UTM in place.
+ */
+static int cs173_project_lonlat(projPJ latlon, projPJ utm, double *x, double *y, int count) {
+	int i = 0;
+
+	for (i = 0; i < count; i++) {
+		x[i] *= DEG_TO_RAD;
+		y[i] *= DEG_TO_RAD;
+	}
+
+	return pj_transform(latlon, utm, count, 1, x, y, NULL);
+}
+
+/**
+ * Converts arrays of WGS84 longitudes and latitudes to UTM eastings and northings in place,
+ * using the projections set up in cs173_init. All points go through Proj.4 in one call.
+ *
+ * @param x Longitudes in degrees on input, eastings in meters on output.
+ * @param y Latitudes in degrees on input, northings in meters on output.
+ * @param count The number of points in the arrays.
+ * @return The pj_transform return code, zero on success.
+ */
+int cs173_lonlat_to_utm(double *x, double *y, int count) {
+	return cs173_project_lonlat(cs173_latlon, cs173_geo_utm, x, y, count);
 }
 
 /**
@@ -157,210 +670,1772 @@ static int to_utm(double *lon, double *lat) {
  * @return SUCCESS or FAIL.
  */
 int cs173_query(cs173_point_t *points, cs173_properties_t *data, int numpoints) {
-	int i = 0;
-	double point_utm_e = 0, point_utm_n = 0;
-	double temp_e = 0, temp_n = 0; // holding either in deg or utm
-	int load_x_coord = 0, load_y_coord = 0, load_z_coord = 0;
-	double x_percent = 0, y_percent = 0, z_percent = 0;
-	cs173_properties_t surrounding_points[8];
+	return cs173_query_h(cs173_default_handle, points, data, numpoints);
+}
 
-//MEI, original->	int zone = 10;
-	int zone = cs173_configuration->utm_zone;
-	int longlat2utm = 0;
+/**
+ * Queries CS173 at the given points for some of the material properties only. See
+ * cs173_query_fields_h.
+ *
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned.
+ * @param numpoints The total number of points to query.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_query_fields(cs173_point_t *points, cs173_properties_t *data, int numpoints, int fields) {
+	return cs173_query_fields_h(cs173_default_handle, points, data, numpoints, fields);
+}
 
-	for (i = 0; i < numpoints; i++) {
+/**
+ * Queries an opened model at the given points and returns the data that it finds. Safe to call
+ * from several threads at once on the same handle. If the handle has a worker pool, queries of
+ * more than one batch are split across it; the calling thread works too and returns once all
+ * points are done.
+ *
+ * @param handle The model handle from cs173_open.
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param numpoints The total number of points to query.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_query_h(cs173_model_handle *handle, cs173_point_t *points, cs173_properties_t *data, int numpoints) {
+	return cs173_query_fields_h(handle, points, data, numpoints, CS173_FIELD_ALL);
+}
 
-		// We need to be below the surface to service this query.
-		if (points[i].depth < 0) {
-			data[i].vp = -1;
-			data[i].vs = -1;
-			data[i].rho = -1;
-			data[i].qp = -1;
-			data[i].qs = -1;
-			continue;
-		}
+/**
+ * Queries an opened model at the given points for some of the material properties only. Only
+ * the model fields those properties are made from are opened, read and interpolated: Qp and
+ * Qs come from Vs, and in the GTL the density comes from Vs or Vp. Properties not asked for
+ * are returned as -1. Safe to call from several threads at once on the same handle.
+ *
+ * @param handle The model handle from cs173_open.
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned.
+ * @param numpoints The total number of points to query.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_query_fields_h(cs173_model_handle *handle, cs173_point_t *points, cs173_properties_t *data, int numpoints,
+                         int fields) {
+	cs173_query_job_t job;
 
-		temp_e = points[i].longitude; // * DEG_TO_RAD;
-		temp_n = points[i].latitude; // * DEG_TO_RAD;
+	if (handle == NULL)
+		return FAIL;
 
-/****
-		// Still need to use utm_geo
-		utm_geo_(&temp_e, &temp_n, &point_utm_e, &point_utm_n, &zone, &longlat2utm);
-***/
-                temp_e *= DEG_TO_RAD;
-                temp_n *= DEG_TO_RAD;
+	// Open the fields on the first query, before any worker needs them.
+	if (cs173_load_fields(handle, cs173_read_mask(handle->config, fields, 0) | cs173_read_mask(handle->config, fields, 1)) != SUCCESS)
+		return FAIL;
 
-                to_utm(&temp_e, &temp_n); // rewritten with utm
+	// Points read from disk are better served in file order than in the caller's.
+	if (cs173_query_sorted(handle, points, data, numpoints, fields) == SUCCESS)
+		return SUCCESS;
 
-                point_utm_e = temp_e;
-                point_utm_n = temp_n;
+	if (handle->pool != NULL && numpoints > CS173_PROJECTION_BATCH) {
+		memset(&job, 0, sizeof(job));
+		job.handle = handle;
+		job.points = points;
+		job.data = data;
+		job.fields = fields;
+		job.result = SUCCESS;
+		// A pool already busy with another caller's query leaves this one to the calling thread.
+		if (cs173_pool_run(handle->pool, cs173_query_chunk, &job, numpoints, CS173_PROJECTION_BATCH) == SUCCESS)
+			return __atomic_load_n(&job.result, __ATOMIC_RELAXED);
+	}
 
-		// Point within rectangle.
-		point_utm_n -= cs173_configuration->bottom_left_corner_n;
-		point_utm_e -= cs173_configuration->bottom_left_corner_e;
+	return cs173_query_points(handle, points, data, numpoints, fields, NULL, NULL);
+}
 
-		temp_e = point_utm_e;
-		temp_n = point_utm_n;
+/**
+ * Returns the model fields that must be read to produce the given properties.
+ *
+ * @param config The model configuration.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ * @param gtl Whether the point is in the GTL, where vp and vs come from the anchor and the
+ * density is derived from them.
+ * @return The CS173_FIELD_* bits of the fields to read.
+ */
+static int cs173_read_mask(cs173_configuration_t *config, int fields, int gtl) {
+	int read = fields & CS173_FIELD_VOXEL;
 
-		// We need to rotate that point, the number of degrees we calculated above.
-		point_utm_e = cs173_cos_rotation_angle * temp_e - cs173_sin_rotation_angle * temp_n;
-		point_utm_n = cs173_sin_rotation_angle * temp_e + cs173_cos_rotation_angle * temp_n;
+	if (fields & (CS173_FIELD_QP | CS173_FIELD_QS))
+		read |= CS173_FIELD_VS;
+	if (gtl && config->gtl == 1 && (fields & CS173_FIELD_RHO))
+		read = (read & ~CS173_FIELD_RHO) | ((strcmp(config->density, "vs") == 0) ? CS173_FIELD_VS : CS173_FIELD_VP);
 
-		// Which point base point does that correspond to?
-		load_x_coord = floor(point_utm_e / cs173_total_width_m * (cs173_configuration->nx - 1));
-		load_y_coord = floor(point_utm_n / cs173_total_height_m * (cs173_configuration->ny - 1));
+	return read;
+}
 
-		// And on the Z-axis?
-		load_z_coord = (cs173_configuration->depth / cs173_configuration->depth_interval - 1) -
-					   floor(points[i].depth / cs173_configuration->depth_interval);
+/**
+ * Queries one chunk of a query split across the worker pool.
+ *
+ * @param arg The cs173_query_job_t.
+ * @param start The first point of the chunk.
+ * @param end One past the last point of the chunk.
+ */
+static void cs173_query_chunk(void *arg, int start, int end) {
+	cs173_query_job_t *job = (cs173_query_job_t *)arg;
 
-		// Are we outside the model's X and Y boundaries?
-		if (load_x_coord > cs173_configuration->nx - 2 || load_y_coord > cs173_configuration->ny - 2 || load_x_coord < 0 || load_y_coord < 0) {
-			data[i].vp = -1;
-			data[i].vs = -1;
-			data[i].rho = -1;
-			data[i].qp = -1;
-			data[i].qs = -1;
-			continue;
-		}
+	if (cs173_query_points(job->handle, &job->points[start], &job->data[start], end - start, job->fields,
+	                       job->utm_e ? &job->utm_e[start] : NULL, job->utm_n ? &job->utm_n[start] : NULL) != SUCCESS)
+		__atomic_store_n(&job->result, FAIL, __ATOMIC_RELAXED);
+}
 
-		// Get the X, Y, and Z percentages for the bilinear or trilinear interpolation below.
-		double x_interval=(cs173_configuration->nx > 1) ?
-                     cs173_total_width_m / (cs173_configuration->nx-1):cs173_total_width_m;
-                double y_interval=(cs173_configuration->ny > 1) ?
-                     cs173_total_height_m / (cs173_configuration->ny-1):cs173_total_height_m;
+/**
+ * Returns whether a query for the given fields would read any of them from disk, directly or
+ * through a mapping, rather than from memory.
+ *
+ * @param model The model.
+ * @param read The CS173_FIELD_* bits of the fields to read.
+ */
+static int cs173_reads_disk(cs173_model_t *model, int read) {
+	int statuses[3] = { model->vp_status, model->vs_status, model->rho_status };
+	int i = 0;
 
-                x_percent = fmod(point_utm_e, x_interval) / x_interval;
-                y_percent = fmod(point_utm_n, y_interval) / y_interval;
-                z_percent = fmod(points[i].depth, cs173_configuration->depth_interval) / cs173_configuration->depth_interval;
+	if (model->layout != CS173_LAYOUT_PLANAR)
+		return (read & CS173_FIELD_VOXEL) && (model->voxels_status == 1 || model->voxels_status == 3);
+	for (i = 0; i < 3; i++)
+		if ((read & (1 << i)) && (statuses[i] == 1 || statuses[i] == 3)) return 1;
 
-		if (load_z_coord < 1) {
-			// We're below the model boundaries. Bilinearly interpolate the bottom plane and use that value.
-			data[i].vp = -1;
-			data[i].vs = -1;
-			data[i].rho = -1;
-			data[i].qp = -1;
-			data[i].qs = -1;
-			continue;
-		} else {
-                    if ((points[i].depth < cs173_configuration->depth_interval) && 
-                                                       (cs173_configuration->gtl == 1)) {
-                           cs173_get_vs30_based_gtl(&(points[i]), &(data[i]));
-                           if(strcmp(cs173_configuration->density,"vs") == 0) {
-                               data[i].rho=cs173_calculate_density(data[i].vs);
-                               } else {
-                                  data[i].rho=cs173_nafe_drake_rho(data[i].vp);
-                           }
+	return 0;
+}
 
-                      } else {
-			// Read all the surrounding point properties.
-			cs173_read_properties(load_x_coord,     load_y_coord,     load_z_coord,     &(surrounding_points[0]));	// Orgin.
-			cs173_read_properties(load_x_coord + 1, load_y_coord,     load_z_coord,     &(surrounding_points[1]));	// Orgin + 1x
-			cs173_read_properties(load_x_coord,     load_y_coord + 1, load_z_coord,     &(surrounding_points[2]));	// Orgin + 1y
-			cs173_read_properties(load_x_coord + 1, load_y_coord + 1, load_z_coord,     &(surrounding_points[3]));	// Orgin + x + y, forms top plane.
-			cs173_read_properties(load_x_coord,     load_y_coord,     load_z_coord - 1, &(surrounding_points[4]));	// Bottom plane origin
-			cs173_read_properties(load_x_coord + 1, load_y_coord,     load_z_coord - 1, &(surrounding_points[5]));	// +1x
-			cs173_read_properties(load_x_coord,     load_y_coord + 1, load_z_coord - 1, &(surrounding_points[6]));	// +1y
-			cs173_read_properties(load_x_coord + 1, load_y_coord + 1, load_z_coord - 1, &(surrounding_points[7]));	// +x +y, forms bottom plane.
-
-			cs173_trilinear_interpolation(x_percent, y_percent, z_percent, surrounding_points, &(data[i]));
-                   }
-		}
+/**
+ * Queries the points in the order their stencils lie in the model files, so a model read from
+ * disk is swept through rather than sought about in at random. The points are projected and
+ * given the location of their stencil, radix sorted on it, queried in that order from their
+ * projected coordinates, and their data put back in the caller's order. Both the projection
+ * and the query are split across the handle's worker pool, if it has one.
+ *
+ * @param handle The model handle.
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned.
+ * @param numpoints The total number of points to query.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ * @return SUCCESS if the points were queried, FAIL if the query is not worth sorting (or
+ * could not be) and is left to the caller.
+ */
+static int cs173_query_sorted(cs173_model_handle *handle, cs173_point_t *points, cs173_properties_t *data, int numpoints,
+                              int fields) {
+	cs173_configuration_t *config = handle->config;
+	cs173_query_job_t job;
+	cs173_point_t *sorted_points = NULL;
+	cs173_properties_t *sorted_data = NULL;
+	double *utm_e = NULL, *utm_n = NULL, *sorted_e = NULL, *sorted_n = NULL;
+	uint64_t *key = NULL, *key_tmp = NULL, *key_swap = NULL, max_key = 0;
+	int *order = NULL, *order_tmp = NULL, *order_swap = NULL;
+	size_t count[1 << CS173_SORT_DIGIT_BITS];
+	char *buffer = NULL;
+	int i = 0, shift = 0, ret = SUCCESS;
+	size_t digit = 0, sum = 0, n = numpoints;
+
+	if (config->query_order == CS173_ORDER_GIVEN || numpoints <= CS173_PROJECTION_BATCH)
+		return FAIL;
+	if (config->query_order == CS173_ORDER_AUTO &&
+	    (numpoints < CS173_SORT_MIN_POINTS ||
+	     !cs173_reads_disk(handle->model, cs173_read_mask(config, fields, 0) | cs173_read_mask(config, fields, 1))))
+		return FAIL;
 
-		// Calculate Qp and Qs.
-		if (data[i].vs < 1500)
-			data[i].qs = data[i].vs * 0.02;
-		else
-			data[i].qs = data[i].vs * 0.10;
+	buffer = malloc(n * (sizeof(cs173_point_t) + sizeof(cs173_properties_t) + 2 * sizeof(uint64_t) +
+	                     4 * sizeof(double) + 2 * sizeof(int)));
+	if (buffer == NULL) return FAIL;
+	sorted_data = (cs173_properties_t *)buffer;
+	key = (uint64_t *)(sorted_data + n);
+	key_tmp = key + n;
+	utm_e = (double *)(key_tmp + n);
+	utm_n = utm_e + n;
+	sorted_e = utm_n + n;
+	sorted_n = sorted_e + n;
+	sorted_points = (cs173_point_t *)(sorted_n + n);
+	order = (int *)(sorted_points + n);
+	order_tmp = order + n;
+
+	// Project every point and find its stencil.
+	memset(&job, 0, sizeof(job));
+	job.handle = handle;
+	job.points = points;
+	job.fields = fields;
+	job.utm_e = utm_e;
+	job.utm_n = utm_n;
+	job.key = key;
+	job.result = SUCCESS;
+	if (handle->pool == NULL || cs173_pool_run(handle->pool, cs173_sort_chunk, &job, numpoints, CS173_PROJECTION_BATCH) != SUCCESS)
+		cs173_sort_chunk(&job, 0, numpoints);
+	if (job.result != SUCCESS) {
+		free(buffer);
+		return FAIL;
+	}
+
+	// Least significant digit first radix sort of the point indices on their stencil location.
+	for (i = 0; i < numpoints; i++) {
+		order[i] = i;
+		if (key[i] > max_key) max_key = key[i];
+	}
+	for (shift = 0; shift < 64 && (max_key >> shift) != 0; shift += CS173_SORT_DIGIT_BITS) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < numpoints; i++)
+			count[(key[i] >> shift) & ((1 << CS173_SORT_DIGIT_BITS) - 1)]++;
+		for (digit = 0, sum = 0; digit < (1 << CS173_SORT_DIGIT_BITS); digit++) {
+			size_t c = count[digit];
+			count[digit] = sum;
+			sum += c;
+		}
+		for (i = 0; i < numpoints; i++) {
+			digit = (key[i] >> shift) & ((1 << CS173_SORT_DIGIT_BITS) - 1);
+			key_tmp[count[digit]] = key[i];
+			order_tmp[count[digit]++] = order[i];
+		}
+		key_swap = key; key = key_tmp; key_tmp = key_swap;
+		order_swap = order; order = order_tmp; order_tmp = order_swap;
+	}
 
-		data[i].qp = data[i].qs * 1.5;
+	for (i = 0; i < numpoints; i++) {
+		sorted_points[i] = points[order[i]];
+		sorted_e[i] = utm_e[order[i]];
+		sorted_n[i] = utm_n[order[i]];
 	}
 
-	return SUCCESS;
+	memset(&job, 0, sizeof(job));
+	job.handle = handle;
+	job.points = sorted_points;
+	job.data = sorted_data;
+	job.fields = fields;
+	job.utm_e = sorted_e;
+	job.utm_n = sorted_n;
+	job.result = SUCCESS;
+	if (handle->pool == NULL || cs173_pool_run(handle->pool, cs173_query_chunk, &job, numpoints, CS173_PROJECTION_BATCH) != SUCCESS)
+		cs173_query_chunk(&job, 0, numpoints);
+	ret = job.result;
+
+	for (i = 0; i < numpoints; i++)
+		data[order[i]] = sorted_data[i];
+
+	free(buffer);
+	return (ret == SUCCESS) ? SUCCESS : FAIL;
 }
 
 /**
- * Retrieves the material properties (whatever is available) for the given data point, expressed
- * in x, y, and z co-ordinates.
+ * Projects one chunk of the points of a sorted query and works out where in the model files
+ * each point's stencil lies. Points that read nothing get location 0.
  *
- * @param x The x coordinate of the data point.
- * @param y The y coordinate of the data point.
- * @param z The z coordinate of the data point.
- * @param data The properties struct to which the material properties will be written.
+ * @param arg The cs173_query_job_t.
+ * @param start The first point of the chunk.
+ * @param end One past the last point of the chunk.
  */
-void cs173_read_properties(int x, int y, int z, cs173_properties_t *data) {
-	// Set everything to -1 to indicate not found.
-	data->vp = -1;
-	data->vs = -1;
-	data->rho = -1;
-	data->qp = -1;
-	data->qs = -1;
+static void cs173_sort_chunk(void *arg, int start, int end) {
+	cs173_query_job_t *job = (cs173_query_job_t *)arg;
+	cs173_model_handle *handle = job->handle;
+	cs173_thread_t *thread = cs173_thread_state(handle);
+	int i = 0, cell[3];
+
+	if (thread == NULL) {
+		__atomic_store_n(&job->result, FAIL, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (i = start; i < end; i++) {
+		job->utm_e[i] = job->points[i].longitude;
+		job->utm_n[i] = job->points[i].latitude;
+	}
+	cs173_project_lonlat(thread->latlon, thread->geo_utm, &job->utm_e[start], &job->utm_n[start], end - start);
+
+	for (i = start; i < end; i++) {
+		job->key[i] = 0;
+		if (cs173_stencil_cell(handle, job->utm_e[i], job->utm_n[i], job->points[i].depth, cell) == SUCCESS)
+			job->key[i] = cs173_location(handle->model, cell[0], cell[1], cell[2]);
+	}
+}
+
+/**
+ * Finds the grid cell whose stencil a point reads: the same cell cs173_query_points will find,
+ * one layer down in the GTL.
+ *
+ * @param handle The model handle.
+ * @param utm_e The point's UTM easting.
+ * @param utm_n The point's UTM northing.
+ * @param depth The point's depth.
+ * @param cell Set to the x, y and z of the stencil's origin corner.
+ * @return SUCCESS, or FAIL if the point reads nothing from the model files.
+ */
+static int cs173_stencil_cell(cs173_model_handle *handle, double utm_e, double utm_n, double depth, int *cell) {
+	cs173_configuration_t *config = handle->config;
+	double e = utm_e - config->bottom_left_corner_e, n = utm_n - config->bottom_left_corner_n, x = 0, y = 0;
+	int load_x = 0, load_y = 0, load_z = 0;
+
+	if (depth < 0) return FAIL;
+	x = handle->cos_rotation_angle * e - handle->sin_rotation_angle * n;
+	y = handle->sin_rotation_angle * e + handle->cos_rotation_angle * n;
+	load_x = floor(x / handle->total_width_m * (config->nx - 1));
+	load_y = floor(y / handle->total_height_m * (config->ny - 1));
+	load_z = (config->depth / config->depth_interval - 1) - floor(depth / config->depth_interval);
+	if (depth < config->depth_interval && config->gtl == 1) load_z--;
+	if (load_x > config->nx - 2 || load_y > config->ny - 2 || load_x < 0 || load_y < 0 || load_z < 1) return FAIL;
+
+	cell[0] = load_x;
+	cell[1] = load_y;
+	cell[2] = load_z;
+	return SUCCESS;
+}
+
+/**
+ * Sorts file offsets in ascending order, for qsort.
+ */
+static int cs173_compare_offsets(const void *a, const void *b) {
+	off_t x = *(const off_t *)a, y = *(const off_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Asks the system to read ahead every page of the model files that a batch of points will
+ * read from disk, before any of them is read. The system then has all of the batch's reads in
+ * flight at once, rather than one at a time as the points are interpolated, and the reads that
+ * follow find the pages in memory. Pages the page cache already holds are skipped, and runs of
+ * neighbouring pages are asked for in one go. For the compressed layout the pages are bricks,
+ * and the packed bytes of those not yet unpacked are asked for.
+ *
+ * @param handle The model handle.
+ * @param points The batch's points.
+ * @param utm_e The points' UTM eastings.
+ * @param utm_n The points' UTM northings.
+ * @param count The number of points, at most CS173_PROJECTION_BATCH.
+ * @param read The CS173_FIELD_* bits of the fields the points read.
+ * @param stats Counts the read-ahead requests.
+ */
+static void cs173_prefetch_stencils(cs173_model_handle *handle, const cs173_point_t *points, const double *utm_e,
+                                    const double *utm_n, int count, int read, cs173_stats_t *stats) {
+	cs173_model_t *model = handle->model;
+	void *files[4] = { model->vp, model->vs, model->rho, model->voxels };
+	int statuses[4] = { model->vp_status, model->vs_status, model->rho_status, model->voxels_status };
+	int compressed = (model->layout == CS173_LAYOUT_COMPRESSED);
+	cs173_cache_t *cache = compressed ? model->brick_cache : model->cache;
+	size_t page_size = compressed ? CS173_UNPACKED_BRICK_SIZE : (cache != NULL) ? CS173_CACHE_PAGE_SIZE :
+	                   CS173_PREFETCH_PAGE_SIZE;
+	size_t sample = 0;
+	off_t pages[8 * CS173_PROJECTION_BATCH], page = 0, start = 0, length = 0;
+	int cell[3], f = 0, i = 0, c = 0, n = 0, first = 0, last = 0, fd = -1, id = -1, located = 0;
+
+	for (f = 0; f < 4; f++) {
+		if (statuses[f] != 1) continue;
+		if (f < 3 && (model->layout != CS173_LAYOUT_PLANAR || !(read & (1 << f)))) continue;
+		if (f == 3 && (model->layout == CS173_LAYOUT_PLANAR || !(read & CS173_FIELD_VOXEL))) continue;
+
+		// The planar files share a layout, so their pages are worked out once.
+		if (!located) {
+			sample = (f < 3) ? sizeof(float) : (model->layout == CS173_LAYOUT_QUANTIZED) ? 3 * sizeof(uint16_t) :
+			         3 * sizeof(float);
+			for (i = 0; i < count; i++) {
+				if (cs173_stencil_cell(handle, utm_e[i], utm_n[i], points[i].depth, cell) != SUCCESS) continue;
+				for (c = 0; c < 8; c++) {
+					page = (off_t)cs173_location(model, cell[0] + (c & 1), cell[1] + ((c >> 1) & 1), cell[2] - (c >> 2)) *
+					       sample / page_size;
+					// Neighbouring corners mostly share a page.
+					if (n == 0 || pages[n - 1] != page) pages[n++] = page;
+				}
+			}
+			qsort(pages, n, sizeof(off_t), cs173_compare_offsets);
+			located = 1;
+		}
+
+		// The compressed layout's pages are its unpacked bricks, cached in a cache of their own under id 0.
+		fd = fileno((FILE *)files[f]);
+		id = compressed ? 0 : fd;
+		for (i = 0; i < n; i = c) {
+			for (c = i + 1; c < n && pages[c] <= pages[c - 1] + 1; c++);
+			// Ask for the run pages[i] .. pages[c - 1], less what the page cache holds at its ends.
+			first = i;
+			last = c - 1;
+			while (first <= last && cache != NULL && cs173_cache_holds(cache, id, pages[first] * page_size))
+				first++;
+			while (last > first && cache != NULL && cs173_cache_holds(cache, id, pages[last] * page_size))
+				last--;
+			if (first > last) continue;
+			if (compressed) {
+				start = model->brick_offsets[pages[first]];
+				length = model->brick_offsets[pages[last] + 1] - start;
+			} else {
+				start = pages[first] * page_size;
+				length = (pages[last] - pages[first] + 1) * page_size;
+			}
+			posix_fadvise(fd, start, length, POSIX_FADV_WILLNEED);
+			stats->prefetches++;
+		}
+	}
+}
+
+/**
+ * Queries the points in the calling thread.
+ *
+ * @param handle The model handle.
+ * @param points The points at which the queries will be made.
+ * @param data The data that will be returned (Vp, Vs, density, Qs, and/or Qp).
+ * @param numpoints The total number of points to query.
+ * @param fields The CS173_FIELD_* bits of the properties wanted; the others are returned as -1.
+ * @param projected_e The points' UTM eastings if already projected, or NULL.
+ * @param projected_n The points' UTM northings if already projected, or NULL.
+ * @return SUCCESS or FAIL.
+ */
+static int cs173_query_points(cs173_model_handle *handle, cs173_point_t *points, cs173_properties_t *data, int numpoints,
+                              int fields, const double *projected_e, const double *projected_n) {
+	int i = 0, start = 0, end = 0;
+	double point_utm_e = 0, point_utm_n = 0;
+	double temp_e = 0, temp_n = 0; // holding either in deg or utm
+	int load_x_coord = 0, load_y_coord = 0, load_z_coord = 0;
+	double x_percent = 0, y_percent = 0, z_percent = 0;
+	cs173_properties_t surrounding_points[8];
+	double utm_e[CS173_PROJECTION_BATCH], utm_n[CS173_PROJECTION_BATCH];
+	unsigned char done[CS173_PROJECTION_BATCH];
+	int gtl[CS173_PROJECTION_BATCH], gtl_count = 0, k = 0;
+	int read = 0, gtl_read = 0, timed = 0, prefetch = 0;
+	cs173_batch_kernel_t batch_kernel = NULL;
+	cs173_configuration_t *config = NULL;
+	cs173_model_t *model = NULL;
+	cs173_thread_t *thread = NULL;
+	cs173_stats_t stats;
+	unsigned long long clock = 0;
+
+	if ((thread = cs173_thread_state(handle)) == NULL)
+		return FAIL;
+	config = handle->config;
+	model = handle->model;
+	memset(&stats, 0, sizeof(stats));
+	stats.points = numpoints;
+	timed = (config->stats == CS173_STATS_TIMERS);
+	read = cs173_read_mask(config, fields, 0);
+	gtl_read = cs173_read_mask(config, fields, 1);
+	prefetch = config->prefetch && cs173_reads_disk(model, read | gtl_read);
+
+	// The SIMD kernel only helps if it can gather every field to be read that the model has.
+	batch_kernel = __atomic_load_n(&handle->batch_kernel, __ATOMIC_ACQUIRE);
+	if ((read & model->present & ~__atomic_load_n(&handle->batch_fields, __ATOMIC_ACQUIRE)) != 0)
+		batch_kernel = NULL;
+
+	for (start = 0; start < numpoints; start += CS173_PROJECTION_BATCH) {
+	    end = (numpoints - start < CS173_PROJECTION_BATCH) ? numpoints : start + CS173_PROJECTION_BATCH;
+
+	    // Project the whole batch to UTM in one go, unless that is done already.
+	    if (timed) clock = cs173_clock_ns();
+	    if (projected_e != NULL) {
+		memcpy(utm_e, &projected_e[start], (end - start) * sizeof(double));
+		memcpy(utm_n, &projected_n[start], (end - start) * sizeof(double));
+	    } else {
+		for (i = start; i < end; i++) {
+			utm_e[i - start] = points[i].longitude;
+			utm_n[i - start] = points[i].latitude;
+		}
+		cs173_project_lonlat(thread->latlon, thread->geo_utm, utm_e, utm_n, end - start);
+	    }
+	    if (timed) stats.project_ns += cs173_clock_ns() - clock, clock = cs173_clock_ns();
+
+	    // The SIMD kernel serves what it can of the interior; the rest goes point by point.
+	    memset(done, 0, end - start);
+	    gtl_count = 0;
+	    if (batch_kernel != NULL)
+		batch_kernel(&handle->batch_params, &points[start], utm_e, utm_n, &data[start], end - start, read, done);
+
+	    // Have the system fetch every page the batch reads from disk before reading any of them.
+	    if (prefetch)
+		cs173_prefetch_stencils(handle, &points[start], utm_e, utm_n, end - start, read | gtl_read, &stats);
+
+	    for (i = start; i < end; i++) {
+		if (done[i - start]) {
+			stats.batch_points++;
+			continue;
+		}
+
+		// We need to be below the surface to service this query.
+		if (points[i].depth < 0) {
+			data[i].vp = -1;
+			data[i].vs = -1;
+			data[i].rho = -1;
+			data[i].qp = -1;
+			data[i].qs = -1;
+			stats.outside_points++;
+			continue;
+		}
+
+                point_utm_e = utm_e[i - start];
+                point_utm_n = utm_n[i - start];
+
+		// Point within rectangle.
+		point_utm_n -= config->bottom_left_corner_n;
+		point_utm_e -= config->bottom_left_corner_e;
+
+		temp_e = point_utm_e;
+		temp_n = point_utm_n;
+
+		// We need to rotate that point, the number of degrees we calculated above.
+		point_utm_e = handle->cos_rotation_angle * temp_e - handle->sin_rotation_angle * temp_n;
+		point_utm_n = handle->sin_rotation_angle * temp_e + handle->cos_rotation_angle * temp_n;
+
+		// Which point base point does that correspond to?
+		load_x_coord = floor(point_utm_e / handle->total_width_m * (config->nx - 1));
+		load_y_coord = floor(point_utm_n / handle->total_height_m * (config->ny - 1));
+
+		// And on the Z-axis?
+		load_z_coord = (config->depth / config->depth_interval - 1) -
+					   floor(points[i].depth / config->depth_interval);
+
+		// Are we outside the model's X and Y boundaries?
+		if (load_x_coord > config->nx - 2 || load_y_coord > config->ny - 2 || load_x_coord < 0 || load_y_coord < 0) {
+			data[i].vp = -1;
+			data[i].vs = -1;
+			data[i].rho = -1;
+			data[i].qp = -1;
+			data[i].qs = -1;
+			stats.outside_points++;
+			continue;
+		}
+
+		// Get the X, Y, and Z percentages for the bilinear or trilinear interpolation below.
+		double x_interval=(config->nx > 1) ?
+                     handle->total_width_m / (config->nx-1):handle->total_width_m;
+                double y_interval=(config->ny > 1) ?
+                     handle->total_height_m / (config->ny-1):handle->total_height_m;
+
+                x_percent = fmod(point_utm_e, x_interval) / x_interval;
+                y_percent = fmod(point_utm_n, y_interval) / y_interval;
+                z_percent = fmod(points[i].depth, config->depth_interval) / config->depth_interval;
+
+		if (load_z_coord < 1) {
+			// We're below the model boundaries. Bilinearly interpolate the bottom plane and use that value.
+			data[i].vp = -1;
+			data[i].vs = -1;
+			data[i].rho = -1;
+			data[i].qp = -1;
+			data[i].qs = -1;
+			stats.outside_points++;
+			continue;
+		} else {
+                    if ((points[i].depth < config->depth_interval) &&
+                                                       (config->gtl == 1)) {
+			// The GTL anchors to the model at depth_interval: the same cell one layer down,
+			// on the grid plane, so the indices and fractions above carry over.
+			if (load_z_coord - 1 < 1) {
+				data[i].vp = -1;
+				data[i].vs = -1;
+				data[i].rho = -1;
+			} else {
+				model->read_stencil(model, load_x_coord, load_y_coord, load_z_coord - 1, surrounding_points, gtl_read);
+				cs173_interp_trilinear(x_percent, y_percent, 0, surrounding_points, &(data[i]), gtl_read);
+			}
+			gtl[gtl_count++] = i - start;
+			continue;
+                      } else {
+			// Read all the surrounding point properties.
+			model->read_stencil(model, load_x_coord, load_y_coord, load_z_coord, surrounding_points, read);
+
+			cs173_interp_trilinear(x_percent, y_percent, z_percent, surrounding_points, &(data[i]), read);
+                   }
+		}
+
+		cs173_derive_q(&(data[i]));
+	    }
+
+	    if (timed) stats.model_ns += cs173_clock_ns() - clock, clock = cs173_clock_ns();
+
+	    // Blend the Vs30 map into the anchors of the near-surface points, all in one go.
+	    stats.gtl_points += gtl_count;
+	    if (gtl_count > 0) {
+		cs173_apply_vs30_gtl(handle, thread, &points[start], &data[start], gtl, gtl_count);
+		for (k = 0; k < gtl_count; k++) {
+			i = start + gtl[k];
+			if (strcmp(config->density, "vs") == 0)
+				data[i].rho = cs173_vs_to_density(config, data[i].vs);
+			else
+				data[i].rho = cs173_nafe_drake_rho(data[i].vp);
+			cs173_derive_q(&(data[i]));
+		}
+	    }
+	    if (timed) stats.gtl_ns += cs173_clock_ns() - clock;
+
+	    // Fields read only to derive others, or derived anyway, are not handed back.
+	    if ((fields & CS173_FIELD_ALL) != CS173_FIELD_ALL)
+		for (i = start; i < end; i++) cs173_mask_fields(&data[i], fields);
+	}
+
+	if (config->stats != CS173_STATS_OFF)
+		cs173_add_stats(&thread->stats, &stats);
+
+	return SUCCESS;
+}
+
+/** Where one column of a mesh falls in the model grid. */
+typedef struct cs173_mesh_column_t {
+	/** Grid x index of the cell, or -1 if the column is outside the model */
+	int x;
+	/** Grid y index of the cell */
+	int y;
+	/** X percentage within the cell */
+	double x_percent;
+	/** Y percentage within the cell */
+	double y_percent;
+} cs173_mesh_column_t;
+
+/** One plane of a mesh split across the worker pool by rows. */
+typedef struct cs173_mesh_job_t {
+	/** The model handle */
+	cs173_model_handle *handle;
+	/** The columns of the mesh */
+	const cs173_mesh_column_t *columns;
+	/** Number of columns per row */
+	int nx;
+	/** Grid z index of the plane's cells */
+	int z;
+	/** Z percentage of the plane within its cells */
+	double z_percent;
+	/** The CS173_FIELD_* bits of the fields to read */
+	int read;
+	/** The CS173_FIELD_* bits of the properties wanted */
+	int fields;
+	/** The plane's data */
+	cs173_properties_t *data;
+} cs173_mesh_job_t;
+
+/**
+ * Extracts CS173 on a regular mesh. See cs173_extract_mesh_h.
+ *
+ * @param mesh The mesh.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ * @param data Room for nx * ny * nz properties, or NULL to write to fp.
+ * @param fp The file the mesh is written to if data is NULL.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_extract_mesh(const cs173_mesh_t *mesh, int fields, cs173_properties_t *data, FILE *fp) {
+	return cs173_extract_mesh_h(cs173_default_handle, mesh, fields, data, fp);
+}
+
+/**
+ * Extracts an opened model on a regular mesh, one depth plane at a time. Only the mesh origin
+ * is projected; every other point is placed in UTM directly. Where each column of the mesh
+ * falls in the model grid is worked out once for all planes, and points of a row that fall in
+ * the same model cell share one read of its corners. Planes within the GTL go through the
+ * regular query, for their Vs30. Points outside the model are -1, as are properties not asked
+ * for.
+ *
+ * The properties are written to data in mesh order, or, if data is NULL, streamed to fp plane
+ * by plane: for each point, each property asked for as a 32-bit float, in vp, vs, rho, qp,
+ * qs order.
+ *
+ * @param handle The model handle from cs173_open.
+ * @param mesh The mesh.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ * @param data Room for nx * ny * nz properties, or NULL to write to fp.
+ * @param fp The file the mesh is written to if data is NULL.
+ * @return SUCCESS, or FAIL if the mesh is empty, memory runs out or the file cannot be written.
+ */
+int cs173_extract_mesh_h(cs173_model_handle *handle, const cs173_mesh_t *mesh, int fields, cs173_properties_t *data,
+                         FILE *fp) {
+	cs173_configuration_t *config = NULL;
+	cs173_thread_t *thread = NULL;
+	cs173_mesh_column_t *columns = NULL;
+	cs173_mesh_job_t job;
+	cs173_properties_t *plane = NULL;
+	cs173_point_t *gtl_points = NULL;
+	float *record = NULL;
+	double origin_e = 0, origin_n = 0, cosr = 0, sinr = 0, e = 0, n = 0, x = 0, y = 0, depth = 0;
+	double x_interval = 0, y_interval = 0;
+	size_t count = 0, c = 0, r = 0, piece = 0;
+	int i = 0, j = 0, k = 0, f = 0, z = 0, width = 0, ret = SUCCESS;
+
+	if (handle == NULL || mesh == NULL || mesh->nx <= 0 || mesh->ny <= 0 || mesh->nz <= 0 || (data == NULL && fp == NULL))
+		return FAIL;
+	if ((thread = cs173_thread_state(handle)) == NULL)
+		return FAIL;
+	config = handle->config;
+	if (cs173_load_fields(handle, cs173_read_mask(config, fields, 0) | cs173_read_mask(config, fields, 1)) != SUCCESS)
+		return FAIL;
+	count = (size_t)mesh->nx * mesh->ny;
+	for (f = 0; f < 5; f++)
+		if (fields & (1 << f)) width++;
+
+	columns = malloc(count * sizeof(cs173_mesh_column_t));
+	if (data == NULL) {
+		plane = malloc(count * sizeof(cs173_properties_t));
+		record = malloc(count * (width > 0 ? width : 1) * sizeof(float));
+	}
+	if (columns == NULL || (data == NULL && (plane == NULL || record == NULL))) {
+		free(columns);
+		free(plane);
+		free(record);
+		return FAIL;
+	}
+
+	// Place every column in the model grid, the same way cs173_query places a point.
+	origin_e = mesh->longitude;
+	origin_n = mesh->latitude;
+	cs173_project_lonlat(thread->latlon, thread->geo_utm, &origin_e, &origin_n, 1);
+	cosr = cos(mesh->rotation * DEG_TO_RAD);
+	sinr = sin(mesh->rotation * DEG_TO_RAD);
+	x_interval = (config->nx > 1) ? handle->total_width_m / (config->nx - 1) : handle->total_width_m;
+	y_interval = (config->ny > 1) ? handle->total_height_m / (config->ny - 1) : handle->total_height_m;
+	for (j = 0; j < mesh->ny; j++) {
+		for (i = 0; i < mesh->nx; i++) {
+			c = (size_t)j * mesh->nx + i;
+			e = origin_e + i * mesh->dx * cosr - j * mesh->dy * sinr - config->bottom_left_corner_e;
+			n = origin_n + i * mesh->dx * sinr + j * mesh->dy * cosr - config->bottom_left_corner_n;
+			x = handle->cos_rotation_angle * e - handle->sin_rotation_angle * n;
+			y = handle->sin_rotation_angle * e + handle->cos_rotation_angle * n;
+			columns[c].x = floor(x / handle->total_width_m * (config->nx - 1));
+			columns[c].y = floor(y / handle->total_height_m * (config->ny - 1));
+			columns[c].x_percent = fmod(x, x_interval) / x_interval;
+			columns[c].y_percent = fmod(y, y_interval) / y_interval;
+			if (columns[c].x > config->nx - 2 || columns[c].y > config->ny - 2 || columns[c].x < 0 || columns[c].y < 0)
+				columns[c].x = -1;
+		}
+	}
+
+	for (k = 0; k < mesh->nz && ret == SUCCESS; k++) {
+		cs173_properties_t *out = (data != NULL) ? &data[(size_t)k * count] : plane;
+
+		depth = mesh->depth + k * mesh->dz;
+		z = (config->depth / config->depth_interval - 1) - floor(depth / config->depth_interval);
+
+		if (depth >= 0 && depth < config->depth_interval && config->gtl == 1) {
+			// The GTL needs each point's Vs30, so these planes take the regular query.
+			if (gtl_points == NULL) {
+				double *lon = NULL, *lat = NULL;
+				if ((gtl_points = malloc(count * sizeof(cs173_point_t))) == NULL ||
+				    (lon = malloc(2 * count * sizeof(double))) == NULL) {
+					ret = FAIL;
+					break;
+				}
+				lat = lon + count;
+				for (j = 0; j < mesh->ny; j++) {
+					for (i = 0; i < mesh->nx; i++) {
+						c = (size_t)j * mesh->nx + i;
+						lon[c] = origin_e + i * mesh->dx * cosr - j * mesh->dy * sinr;
+						lat[c] = origin_n + i * mesh->dx * sinr + j * mesh->dy * cosr;
+					}
+				}
+				pj_transform(thread->geo_utm, thread->latlon, count, 1, lon, lat, NULL);
+				for (c = 0; c < count; c++) {
+					gtl_points[c].longitude = lon[c] * RAD_TO_DEG;
+					gtl_points[c].latitude = lat[c] * RAD_TO_DEG;
+				}
+				free(lon);
+			}
+			for (c = 0; c < count; c++) gtl_points[c].depth = depth;
+			// The query takes an int count, so a plane with more points goes in pieces.
+			for (c = 0; c < count && ret == SUCCESS; c += piece) {
+				piece = (count - c < INT_MAX) ? count - c : INT_MAX;
+				ret = cs173_query_fields_h(handle, &gtl_points[c], &out[c], (int)piece, fields);
+			}
+		} else if (depth < 0 || z < 1) {
+			// Above the surface or below the model.
+			for (c = 0; c < count; c++) {
+				out[c].vp = -1;
+				out[c].vs = -1;
+				out[c].rho = -1;
+				out[c].qp = -1;
+				out[c].qs = -1;
+			}
+		} else {
+			job.handle = handle;
+			job.columns = columns;
+			job.nx = mesh->nx;
+			job.z = z;
+			job.z_percent = fmod(depth, config->depth_interval) / config->depth_interval;
+			job.read = cs173_read_mask(config, fields, 0);
+			job.fields = fields;
+			job.data = out;
+			if (handle->pool == NULL || mesh->ny < 2 ||
+			    cs173_pool_run(handle->pool, cs173_mesh_rows, &job, mesh->ny,
+			                   mesh->nx >= CS173_PROJECTION_BATCH ? 1 : CS173_PROJECTION_BATCH / mesh->nx) != SUCCESS)
+				cs173_mesh_rows(&job, 0, mesh->ny);
+		}
+
+		if (data == NULL && ret == SUCCESS) {
+			for (c = 0, r = 0; c < count; c++) {
+				double *value = &plane[c].vp;
+				for (f = 0; f < 5; f++)
+					if (fields & (1 << f)) record[r++] = value[f];
+			}
+			if (fwrite(record, sizeof(float), r, fp) != r) ret = FAIL;
+		}
+	}
+
+	free(columns);
+	free(plane);
+	free(record);
+	free(gtl_points);
+	return ret;
+}
+
+/**
+ * Reads the four corners of a stencil on one of its x faces: the corners at x, 0, 2, 4 and 6,
+ * if side is 0, or the corners at x + 1, 1, 3, 5 and 7, if side is 1.
+ *
+ * @param model The model.
+ * @param x The x coordinate of the stencil's origin corner.
+ * @param y The y coordinate of the stencil's origin corner.
+ * @param z The z coordinate of the stencil's origin corner.
+ * @param side Which face to read.
+ * @param eight_points The stencil, whose corners on that face are read.
+ * @param fields The CS173_FIELD_* bits of the fields to read.
+ */
+static void cs173_read_stencil_face(cs173_model_t *model, int x, int y, int z, int side, cs173_properties_t *eight_points,
+                                    int fields) {
+	int i = 0;
+
+	for (i = side; i < 8; i += 2)
+		cs173_read_sample(model, cs173_location(model, x + side, y + ((i >> 1) & 1), z - (i >> 2)), &eight_points[i],
+		                  fields);
+}
+
+/**
+ * Interpolates rows [start, end) of one plane of a mesh. Consecutive points in the same model
+ * cell reuse the corners read for the first of them, and a point in the cell next to it along
+ * x reuses the face the two cells share, reading only the other four corners.
+ *
+ * @param arg The cs173_mesh_job_t.
+ * @param start The first row.
+ * @param end One past the last row.
+ */
+static void cs173_mesh_rows(void *arg, int start, int end) {
+	cs173_mesh_job_t *job = (cs173_mesh_job_t *)arg;
+	cs173_model_t *model = job->handle->model;
+	const cs173_mesh_column_t *column = NULL;
+	cs173_properties_t surrounding_points[8], *out = NULL;
+	size_t c = 0;
+	int last_x = -1, last_y = -1, side = 0, i = 0;
+
+	for (c = (size_t)start * job->nx; c < (size_t)end * job->nx; c++) {
+		column = &job->columns[c];
+		out = &job->data[c];
+
+		if (column->x < 0) {
+			out->vp = -1;
+			out->vs = -1;
+			out->rho = -1;
+			out->qp = -1;
+			out->qs = -1;
+			continue;
+		}
+
+		if (column->y == last_y && (column->x == last_x + 1 || column->x == last_x - 1)) {
+			// Stepping to x + 1, the old +x face becomes the -x face; stepping to x - 1, the other way.
+			side = (column->x > last_x);
+			for (i = 0; i < 8; i += 2)
+				surrounding_points[i + 1 - side] = surrounding_points[i + side];
+			cs173_read_stencil_face(model, column->x, column->y, job->z, side, surrounding_points, job->read);
+			last_x = column->x;
+		} else if (column->x != last_x || column->y != last_y) {
+			model->read_stencil(model, column->x, column->y, job->z, surrounding_points, job->read);
+			last_x = column->x;
+			last_y = column->y;
+		}
+		cs173_interp_trilinear(column->x_percent, column->y_percent, job->z_percent, surrounding_points, out, job->read);
+		cs173_derive_q(out);
+		if ((job->fields & CS173_FIELD_ALL) != CS173_FIELD_ALL)
+			cs173_mask_fields(out, job->fields);
+	}
+}
+
+/** One horizontal layer of a profile's column, interpolated at the column. */
+typedef struct cs173_profile_layer_t {
+	/** Grid z index of the layer, or -1 if none is held */
+	int z;
+	/** Vp, vs and rho of the layer at the column */
+	cs173_properties_t value;
+} cs173_profile_layer_t;
+
+/**
+ * Returns the value of a grid layer at a profile's column, reading its four corners only if
+ * neither of the two layers held is the one wanted. Walking down the column, each layer is
+ * read once and serves as the bottom of one cell and the top of the next.
+ */
+static const cs173_properties_t *cs173_profile_layer(cs173_model_t *model, cs173_profile_layer_t layers[2], int *next,
+                                                     int x, int y, int z, double x_percent, double y_percent,
+                                                     int read) {
+	cs173_properties_t corners[4];
+	cs173_profile_layer_t *layer = NULL;
+	int i = 0;
+
+	// The layer used last is never the one replaced, so a cell's top and bottom are both held.
+	for (i = 0; i < 2; i++) {
+		if (layers[i].z != z) continue;
+		*next = 1 - i;
+		return &layers[i].value;
+	}
+
+	layer = &layers[*next];
+	*next = 1 - *next;
+	for (i = 0; i < 4; i++)
+		cs173_read_sample(model, cs173_location(model, x + (i & 1), y + ((i >> 1) & 1), z), &corners[i], read);
+	cs173_interp_bilinear(x_percent, y_percent, corners, &layer->value);
+	layer->z = z;
+
+	return &layer->value;
+}
+
+/**
+ * Queries CS173 down one vertical column. See cs173_query_profile_h.
+ *
+ * @param longitude The longitude of the column.
+ * @param latitude The latitude of the column.
+ * @param depths The depths at which the queries will be made.
+ * @param data The data that will be returned.
+ * @param numdepths The number of depths.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_query_profile(double longitude, double latitude, const double *depths, cs173_properties_t *data,
+                        int numdepths, int fields) {
+	return cs173_query_profile_h(cs173_default_handle, longitude, latitude, depths, data, numdepths, fields);
+}
+
+/**
+ * Queries an opened model down one vertical column, giving the same results as querying each
+ * depth at that longitude and latitude. The column is projected, rotated and placed in the
+ * grid once. Each grid layer the depths fall between is interpolated at the column once, so
+ * depths given in order read each layer once. Within the GTL the Vs30 value and the anchor
+ * are looked up once for the whole column. Safe to call from several threads at once.
+ *
+ * @param handle The model handle from cs173_open.
+ * @param longitude The longitude of the column.
+ * @param latitude The latitude of the column.
+ * @param depths The depths at which the queries will be made.
+ * @param data The data that will be returned.
+ * @param numdepths The number of depths.
+ * @param fields The CS173_FIELD_* bits of the properties wanted; the others are returned as -1.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_query_profile_h(cs173_model_handle *handle, double longitude, double latitude, const double *depths,
+                          cs173_properties_t *data, int numdepths, int fields) {
+	cs173_configuration_t *config = NULL;
+	cs173_model_t *model = NULL;
+	cs173_thread_t *thread = NULL;
+	cs173_profile_layer_t layers[2];
+	const cs173_properties_t *top = NULL, *bottom = NULL;
+	cs173_properties_t anchor;
+	double e = longitude, n = latitude, temp_e = 0, temp_n = 0;
+	double x_interval = 0, y_interval = 0, x_percent = 0, y_percent = 0, z_percent = 0, vs30 = -1;
+	int read = 0, have_anchor = 0, next = 0;
+	int x = 0, y = 0, z = 0, z_top = 0, i = 0;
+
+	if (handle == NULL || (thread = cs173_thread_state(handle)) == NULL)
+		return FAIL;
+	config = handle->config;
+	model = handle->model;
+	// The anchor layer of the GTL is also the top of the first cell below it, so layers are read
+	// with what both need.
+	read = cs173_read_mask(config, fields, 0) | cs173_read_mask(config, fields, 1);
+	if (cs173_load_fields(handle, read) != SUCCESS)
+		return FAIL;
+
+	// Neither layer is held yet.
+	memset(layers, 0, sizeof(layers));
+	layers[0].z = -1;
+	layers[1].z = -1;
+
+	// The horizontal work, once for the whole column.
+	cs173_project_lonlat(thread->latlon, thread->geo_utm, &e, &n, 1);
+	temp_e = e - config->bottom_left_corner_e;
+	temp_n = n - config->bottom_left_corner_n;
+	e = handle->cos_rotation_angle * temp_e - handle->sin_rotation_angle * temp_n;
+	n = handle->sin_rotation_angle * temp_e + handle->cos_rotation_angle * temp_n;
+	x = floor(e / handle->total_width_m * (config->nx - 1));
+	y = floor(n / handle->total_height_m * (config->ny - 1));
+	x_interval = (config->nx > 1) ? handle->total_width_m / (config->nx - 1) : handle->total_width_m;
+	y_interval = (config->ny > 1) ? handle->total_height_m / (config->ny - 1) : handle->total_height_m;
+	x_percent = fmod(e, x_interval) / x_interval;
+	y_percent = fmod(n, y_interval) / y_interval;
+	z_top = config->depth / config->depth_interval - 1;
+
+	for (i = 0; i < numdepths; i++) {
+		data[i].vp = -1;
+		data[i].vs = -1;
+		data[i].rho = -1;
+		data[i].qp = -1;
+		data[i].qs = -1;
+
+		// Above the surface, outside the box, or below the model.
+		z = z_top - floor(depths[i] / config->depth_interval);
+		if (depths[i] < 0 || x > config->nx - 2 || y > config->ny - 2 || x < 0 || y < 0 || z < 1)
+			continue;
+
+		if (depths[i] < config->depth_interval && config->gtl == 1) {
+			// The anchor at depth_interval and the Vs30 value are the same for every GTL depth.
+			if (!have_anchor) {
+				anchor = data[i];
+				if (z - 1 >= 1)
+					anchor = *cs173_profile_layer(model, layers, &next, x, y, z - 1, x_percent, y_percent, read);
+				vs30 = cs173_get_vs30_value_h(handle, longitude, latitude);
+				have_anchor = 1;
+			}
+			cs173_gtl_blend(depths[i] / config->depth_interval, vs30, &anchor, &data[i]);
+			if (strcmp(config->density, "vs") == 0)
+				data[i].rho = cs173_vs_to_density(config, data[i].vs);
+			else
+				data[i].rho = cs173_nafe_drake_rho(data[i].vp);
+		} else {
+			z_percent = fmod(depths[i], config->depth_interval) / config->depth_interval;
+			top = cs173_profile_layer(model, layers, &next, x, y, z, x_percent, y_percent, read);
+			bottom = cs173_profile_layer(model, layers, &next, x, y, z - 1, x_percent, y_percent, read);
+			data[i].vp = cs173_interp_linear(z_percent, top->vp, bottom->vp);
+			data[i].vs = cs173_interp_linear(z_percent, top->vs, bottom->vs);
+			data[i].rho = cs173_interp_linear(z_percent, top->rho, bottom->rho);
+		}
+
+		cs173_derive_q(&data[i]);
+		if ((fields & CS173_FIELD_ALL) != CS173_FIELD_ALL)
+			cs173_mask_fields(&data[i], fields);
+	}
+
+	return SUCCESS;
+}
+
+/** One block of rows of a section, as held in the ring between producer and consumer. */
+typedef struct cs173_section_slot_t {
+	/** The points of the block */
+	cs173_point_t *points;
+	/** Their UTM eastings */
+	double *utm_e;
+	/** Their UTM northings */
+	double *utm_n;
+	/** Their properties */
+	cs173_properties_t *data;
+	/** SUCCESS or FAIL once the block is queried */
+	int result;
+} cs173_section_slot_t;
+
+/** A section being streamed: a ring of blocks filled by a producer thread. */
+typedef struct cs173_section_stream_t {
+	/** The model handle */
+	cs173_model_handle *handle;
+	/** The section */
+	const cs173_section_t *section;
+	/** The CS173_FIELD_* bits of the properties wanted */
+	int fields;
+	/** UTM easting of the first point */
+	double origin_e;
+	/** UTM northing of the first point */
+	double origin_n;
+	/** Rows per block */
+	int block_rows;
+	/** Number of blocks */
+	int blocks;
+	/** The ring of blocks; block b goes in slot b % CS173_SECTION_SLOTS */
+	cs173_section_slot_t slots[CS173_SECTION_SLOTS];
+	/** Guards the counts below */
+	pthread_mutex_t lock;
+	/** Signalled when a block is produced or consumed, or the stream stops */
+	pthread_cond_t changed;
+	/** Blocks queried so far */
+	int produced;
+	/** Blocks handed to the callback so far */
+	int consumed;
+	/** Set when the consumer gives up, so the producer stops */
+	int stop;
+} cs173_section_stream_t;
+
+static void *cs173_section_producer(void *arg);
+static int cs173_section_block(cs173_section_stream_t *stream, int block);
+
+/**
+ * Streams CS173 on a plane section. See cs173_extract_section_h.
+ *
+ * @param section The section.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ * @param callback Called with each row in turn.
+ * @param arg Passed to the callback.
+ * @return SUCCESS, or FAIL if the section could not be extracted or the callback stopped it.
+ */
+int cs173_extract_section(const cs173_section_t *section, int fields, cs173_section_callback_t callback, void *arg) {
+	return cs173_extract_section_h(cs173_default_handle, section, fields, callback, arg);
+}
+
+/**
+ * Queries an opened model on a plane section and hands the results to a callback one row at a
+ * time, in order. Whatever the size of the section, only CS173_SECTION_SLOTS blocks of about
+ * CS173_SECTION_POINTS points are held at once. A producer thread queries the next block,
+ * through the same path and worker pool as cs173_query_fields_h, while the calling thread
+ * hands out the rows of the last one, so the callback's own I/O overlaps the model's. The
+ * callback is always called from the calling thread.
+ *
+ * @param handle The model handle from cs173_open.
+ * @param section The section.
+ * @param fields The CS173_FIELD_* bits of the properties wanted; the others are returned as -1.
+ * @param callback Called with each row in turn.
+ * @param arg Passed to the callback.
+ * @return SUCCESS, or FAIL if the section could not be extracted or the callback stopped it.
+ */
+int cs173_extract_section_h(cs173_model_handle *handle, const cs173_section_t *section, int fields,
+                            cs173_section_callback_t callback, void *arg) {
+	cs173_section_stream_t stream;
+	cs173_section_slot_t *slot = NULL;
+	cs173_thread_t *thread = NULL;
+	pthread_t producer;
+	size_t points = 0;
+	int block = 0, row = 0, i = 0, threaded = 0, ret = SUCCESS;
+
+	if (handle == NULL || section == NULL || callback == NULL || section->columns <= 0 || section->rows <= 0)
+		return FAIL;
+	if ((thread = cs173_thread_state(handle)) == NULL)
+		return FAIL;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.handle = handle;
+	stream.section = section;
+	stream.fields = fields;
+	stream.block_rows = (section->columns >= CS173_SECTION_POINTS) ? 1 : CS173_SECTION_POINTS / section->columns;
+	if (stream.block_rows > section->rows) stream.block_rows = section->rows;
+	stream.blocks = (section->rows + stream.block_rows - 1) / stream.block_rows;
+	stream.origin_e = section->longitude;
+	stream.origin_n = section->latitude;
+	cs173_project_lonlat(thread->latlon, thread->geo_utm, &stream.origin_e, &stream.origin_n, 1);
+
+	points = (size_t)stream.block_rows * section->columns;
+	for (i = 0; i < CS173_SECTION_SLOTS && ret == SUCCESS; i++) {
+		slot = &stream.slots[i];
+		slot->points = malloc(points * sizeof(cs173_point_t));
+		slot->utm_e = malloc(2 * points * sizeof(double));
+		slot->data = malloc(points * sizeof(cs173_properties_t));
+		if (slot->points == NULL || slot->utm_e == NULL || slot->data == NULL) ret = FAIL;
+		else slot->utm_n = slot->utm_e + points;
+	}
+
+	if (ret == SUCCESS)
+		ret = cs173_load_fields(handle, cs173_read_mask(handle->config, fields, 0) | cs173_read_mask(handle->config, fields, 1));
+
+	if (ret == SUCCESS) {
+		pthread_mutex_init(&stream.lock, NULL);
+		pthread_cond_init(&stream.changed, NULL);
+		threaded = (stream.blocks > 1 && pthread_create(&producer, NULL, cs173_section_producer, &stream) == 0);
+
+		for (block = 0; block < stream.blocks && ret == SUCCESS; block++) {
+			slot = &stream.slots[block % CS173_SECTION_SLOTS];
+			if (threaded) {
+				pthread_mutex_lock(&stream.lock);
+				while (stream.produced <= block)
+					pthread_cond_wait(&stream.changed, &stream.lock);
+				pthread_mutex_unlock(&stream.lock);
+			} else {
+				cs173_section_block(&stream, block);
+			}
+
+			ret = slot->result;
+			for (i = 0; i < stream.block_rows && ret == SUCCESS; i++) {
+				row = block * stream.block_rows + i;
+				if (row >= section->rows) break;
+				if (callback(arg, row, &slot->data[(size_t)i * section->columns], section->columns) != SUCCESS)
+					ret = FAIL;
+			}
+
+			pthread_mutex_lock(&stream.lock);
+			stream.consumed = block + 1;
+			if (ret != SUCCESS) stream.stop = 1;
+			pthread_cond_signal(&stream.changed);
+			pthread_mutex_unlock(&stream.lock);
+		}
+
+		if (threaded) pthread_join(producer, NULL);
+		pthread_cond_destroy(&stream.changed);
+		pthread_mutex_destroy(&stream.lock);
+	}
+
+	for (i = 0; i < CS173_SECTION_SLOTS; i++) {
+		free(stream.slots[i].points);
+		free(stream.slots[i].utm_e);
+		free(stream.slots[i].data);
+	}
+	return ret;
+}
+
+/**
+ * Queries the blocks of a section in turn, each as soon as its slot has been handed out.
+ *
+ * @param arg The cs173_section_stream_t.
+ */
+static void *cs173_section_producer(void *arg) {
+	cs173_section_stream_t *stream = (cs173_section_stream_t *)arg;
+	int block = 0, stop = 0;
+
+	for (block = 0; block < stream->blocks; block++) {
+		pthread_mutex_lock(&stream->lock);
+		while (!stream->stop && block - stream->consumed >= CS173_SECTION_SLOTS)
+			pthread_cond_wait(&stream->changed, &stream->lock);
+		stop = stream->stop;
+		pthread_mutex_unlock(&stream->lock);
+		if (stop) break;
+
+		cs173_section_block(stream, block);
+
+		pthread_mutex_lock(&stream->lock);
+		stream->produced = block + 1;
+		pthread_cond_signal(&stream->changed);
+		pthread_mutex_unlock(&stream->lock);
+	}
+
+	// This thread is about to exit, so its projections would only sit in the handle.
+	cs173_release_thread_state(stream->handle);
+	return NULL;
+}
+
+/**
+ * Places the points of one block of a section and queries them. The points are laid out in
+ * UTM, so they are projected back to longitude and latitude, for the GTL, rather than forward.
+ *
+ * @param stream The section stream.
+ * @param block The block.
+ * @return SUCCESS or FAIL, also left in the block's slot.
+ */
+static int cs173_section_block(cs173_section_stream_t *stream, int block) {
+	const cs173_section_t *section = stream->section;
+	cs173_section_slot_t *slot = &stream->slots[block % CS173_SECTION_SLOTS];
+	cs173_model_handle *handle = stream->handle;
+	cs173_thread_t *thread = cs173_thread_state(handle);
+	cs173_query_job_t job;
+	int first = block * stream->block_rows, rows = stream->block_rows, r = 0, c = 0, count = 0;
+	size_t k = 0;
+
+	if (first + rows > section->rows) rows = section->rows - first;
+	count = rows * section->columns;
+	slot->result = FAIL;
+	if (thread == NULL) return FAIL;
+
+	for (r = 0; r < rows; r++) {
+		for (c = 0; c < section->columns; c++) {
+			k = (size_t)r * section->columns + c;
+			slot->utm_e[k] = stream->origin_e + c * section->column_e + (first + r) * section->row_e;
+			slot->utm_n[k] = stream->origin_n + c * section->column_n + (first + r) * section->row_n;
+			slot->points[k].longitude = slot->utm_e[k];
+			slot->points[k].latitude = slot->utm_n[k];
+			slot->points[k].depth = section->depth + c * section->column_depth + (first + r) * section->row_depth;
+		}
+	}
+	for (k = 0; k < (size_t)count; k += CS173_PROJECTION_BATCH) {
+		double lon[CS173_PROJECTION_BATCH], lat[CS173_PROJECTION_BATCH];
+		size_t n = ((size_t)count - k < CS173_PROJECTION_BATCH) ? (size_t)count - k : CS173_PROJECTION_BATCH, j = 0;
+		for (j = 0; j < n; j++) {
+			lon[j] = slot->utm_e[k + j];
+			lat[j] = slot->utm_n[k + j];
+		}
+		pj_transform(thread->geo_utm, thread->latlon, n, 1, lon, lat, NULL);
+		for (j = 0; j < n; j++) {
+			slot->points[k + j].longitude = lon[j] * RAD_TO_DEG;
+			slot->points[k + j].latitude = lat[j] * RAD_TO_DEG;
+		}
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.handle = handle;
+	job.points = slot->points;
+	job.data = slot->data;
+	job.fields = stream->fields;
+	job.utm_e = slot->utm_e;
+	job.utm_n = slot->utm_n;
+	job.result = SUCCESS;
+	if (handle->pool == NULL || count <= CS173_PROJECTION_BATCH ||
+	    cs173_pool_run(handle->pool, cs173_query_chunk, &job, count, CS173_PROJECTION_BATCH) != SUCCESS)
+		cs173_query_chunk(&job, 0, count);
+
+	slot->result = job.result;
+	return slot->result;
+}
+
+/**
+ * Calculates Qp and Qs from Vs.
+ *
+ * @param data The material properties, with Vs set.
+ */
+static void cs173_derive_q(cs173_properties_t *data) {
+	// Calculate Qp and Qs.
+	if (data->vs < 1500)
+		data->qs = data->vs * 0.02;
+	else
+		data->qs = data->vs * 0.10;
+
+	data->qp = data->qs * 1.5;
+}
+
+/**
+ * Sets the properties not asked for to -1.
+ *
+ * @param data The material properties.
+ * @param fields The CS173_FIELD_* bits of the properties wanted.
+ */
+static void cs173_mask_fields(cs173_properties_t *data, int fields) {
+	if (!(fields & CS173_FIELD_VP)) data->vp = -1;
+	if (!(fields & CS173_FIELD_VS)) data->vs = -1;
+	if (!(fields & CS173_FIELD_RHO)) data->rho = -1;
+	if (!(fields & CS173_FIELD_QP)) data->qp = -1;
+	if (!(fields & CS173_FIELD_QS)) data->qs = -1;
+}
 
+/**
+ * Counts one read of a model file made by a query. The count is shared by all threads, which
+ * costs little next to the system call it counts.
+ *
+ * @param model The model.
+ * @param bytes The bytes read.
+ */
+static inline void cs173_count_read(cs173_model_t *model, size_t bytes) {
+	__atomic_fetch_add(&model->reads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&model->bytes_read, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Reads bytes of a model file left on disk, through the page cache if the model has one.
+ * pread leaves the shared file position alone, so concurrent queries do not race.
+ *
+ * @param model The model.
+ * @param fp The field file.
+ * @param buf Where the bytes go.
+ * @param size The number of bytes.
+ * @param offset Where the bytes start within the file.
+ * @return SUCCESS, or FAIL if the file could not be read or is too short.
+ */
+static int cs173_read_file(cs173_model_t *model, FILE *fp, void *buf, size_t size, off_t offset) {
+	ssize_t got = 0;
+	size_t done = 0;
+
+	if (model->cache != NULL && cs173_cache_read(model->cache, fileno(fp), buf, size, offset) == SUCCESS)
+		return SUCCESS;
+
+	while (done < size) {
+		got = pread(fileno(fp), (char *)buf + done, size - done, offset + done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) break;
+		done += got;
+	}
+	cs173_count_read(model, done);
+
+	return (done == size) ? SUCCESS : FAIL;
+}
+
+/**
+ * Unpacks one brick of the compressed layout into the brick cache, which holds the unpacked bricks
+ * as the pages of a bricked voxel file: page n is the brick stored at position n.
+ *
+ * @param arg The model.
+ * @param id 0, the id of the unpacked bricks, the only file in the brick cache.
+ * @param brick The storage position of the brick.
+ * @param buf Where the unpacked brick goes.
+ * @param page_size CS173_UNPACKED_BRICK_SIZE, or the brick does not fit.
+ * @return The bytes unpacked, or -1 if the brick could not be read or is damaged.
+ */
+static ssize_t cs173_unpack_page(void *arg, int id, off_t brick, void *buf, size_t page_size) {
+	cs173_model_t *model = (cs173_model_t *)arg;
+	unsigned char packed[CS173_PACKED_BRICK_MAX];
+	const unsigned char *in = packed;
+	unsigned long long start = model->brick_offsets[brick];
+	size_t length = model->brick_offsets[brick + 1] - start;
+
+	if (id != 0 || page_size != CS173_UNPACKED_BRICK_SIZE || length > CS173_PACKED_BRICK_MAX) return -1;
+	if (model->voxels_status >= 2) {
+		in = (const unsigned char *)model->voxels + start;
+	} else {
+		if (pread(fileno((FILE *)model->voxels), packed, length, start) != (ssize_t)length) return -1;
+		cs173_count_read(model, length);
+	}
+	if (cs173_unpack_brick(in, length, buf) != SUCCESS) return -1;
+
+	return CS173_UNPACKED_BRICK_SIZE;
+}
+
+/**
+ * Reads voxels of the compressed layout, unpacking the bricks they lie in if the cache does
+ * not hold them yet.
+ *
+ * @param model The model.
+ * @param voxels Where the voxels go.
+ * @param location The location of the first voxel, as from cs173_location.
+ * @param count The number of voxels, all in the same brick.
+ * @return SUCCESS, or FAIL if the brick could not be unpacked.
+ */
+static int cs173_read_unpacked(cs173_model_t *model, float *voxels, long location, int count) {
+	return cs173_cache_read_filled(model->brick_cache, 0, cs173_unpack_page, model, voxels, count * 3 * sizeof(float),
+	                               location * 3 * sizeof(float));
+}
+
+/**
+ * Reads whatever material properties are available at one sample of the model, given its
+ * location within the planar files, or within the voxel file for the voxel layouts.
+ *
+ * @param model The model to read from.
+ * @param location The sample's location, as from cs173_location.
+ * @param data The properties struct to which the material properties will be written.
+ * @param fields The CS173_FIELD_* bits of the planar fields to read; the others are left at -1,
+ * as are any that could not be read.
+ */
+static void cs173_read_sample(cs173_model_t *model, long location, cs173_properties_t *data, int fields) {
 	float *ptr = NULL;
 	FILE *fp = NULL;
-        long location = 0;
+	float temp = 0;
+
+	// Set everything to -1 to indicate not found.
+	data->vp = -1;
+	data->vs = -1;
+	data->rho = -1;
+	data->qp = -1;
+	data->qs = -1;
+
+	// Compressed voxels come out of their unpacked brick.
+	if (model->layout == CS173_LAYOUT_COMPRESSED) {
+		float voxel[3];
+		if (model->voxels_status != 0 && cs173_read_unpacked(model, voxel, location, 1) == SUCCESS) {
+			data->vp = voxel[0];
+			data->vs = voxel[1];
+			data->rho = voxel[2];
+		}
+		return;
+	}
+
+	// Quantized voxels are turned back into values with their brick's offset and scale.
+	if (model->layout == CS173_LAYOUT_QUANTIZED) {
+		uint16_t voxel[3] = { 0, 0, 0 };
+		float *range = model->brick_range + 6 * (location / CS173_BRICK_VOXELS);
+		if (model->voxels_status >= 2) {
+			memcpy(voxel, (uint16_t *)model->voxels + 3 * location, sizeof(voxel));
+		} else if (model->voxels_status == 1) {
+			fp = (FILE *)model->voxels;
+			if (cs173_read_file(model, fp, voxel, sizeof(voxel), 3 * location * sizeof(uint16_t)) != SUCCESS)
+				return;
+		} else {
+			return;
+		}
+		data->vp = range[0] + voxel[0] * range[1];
+		data->vs = range[2] + voxel[1] * range[3];
+		data->rho = range[4] + voxel[2] * range[5];
+		return;
+	}
+
+	// Interleaved and bricked voxels hold vp, vs, and rho side by side, so one read gets all three.
+	if (model->layout != CS173_LAYOUT_PLANAR) {
+		float voxel[3] = { -1, -1, -1 };
+		if (model->voxels_status >= 2) {
+			ptr = (float *)model->voxels + 3 * location;
+			voxel[0] = ptr[0];
+			voxel[1] = ptr[1];
+			voxel[2] = ptr[2];
+		} else if (model->voxels_status == 1) {
+			fp = (FILE *)model->voxels;
+			if (cs173_read_file(model, fp, voxel, 3 * sizeof(float), 3 * location * sizeof(float)) != SUCCESS)
+				voxel[0] = voxel[1] = voxel[2] = -1;
+		}
+		data->vp = voxel[0];
+		data->vs = voxel[1];
+		data->rho = voxel[2];
+		return;
+	}
+
+	// Check our loaded components of the model.
+	if (!(fields & CS173_FIELD_VS)) {
+		// Not asked for.
+	} else if (model->vs_status >= 2) {
+		// Read from memory or the mapping.
+		ptr = (float *)model->vs;
+		data->vs = ptr[location];
+	} else if (model->vs_status == 1) {
+		// Read from file.
+		fp = (FILE *)model->vs;
+		if (cs173_read_file(model, fp, &(temp), sizeof(float), location * sizeof(float)) == SUCCESS)
+			data->vs = temp;
+	}
+
+	// Check our loaded components of the model.
+	if (!(fields & CS173_FIELD_VP)) {
+		// Not asked for.
+	} else if (model->vp_status >= 2) {
+		// Read from memory or the mapping.
+		ptr = (float *)model->vp;
+		data->vp = ptr[location];
+	} else if (model->vp_status == 1) {
+		// Read from file.
+		fp = (FILE *)model->vp;
+		if (cs173_read_file(model, fp, &(temp), sizeof(float), location * sizeof(float)) == SUCCESS)
+			data->vp = temp;
+	}
+
+	// Check our loaded components of the model.
+	if (!(fields & CS173_FIELD_RHO)) {
+		// Not asked for.
+	} else if (model->rho_status >= 2) {
+		// Read from memory or the mapping.
+		ptr = (float *)model->rho;
+		data->rho = ptr[location];
+	} else if (model->rho_status == 1) {
+		// Read from file.
+		fp = (FILE *)model->rho;
+		if (cs173_read_file(model, fp, &(temp), sizeof(float), location * sizeof(float)) == SUCCESS)
+			data->rho = temp;
+	}
+}
+
+/**
+ * Returns the location of grid point (x, y, z) within the model's files: the sample index in the
+ * planar files, or the voxel index in the interleaved or bricked file.
+ */
+static inline long cs173_location(cs173_model_t *model, int x, int y, int z) {
+	if (model->layout == CS173_LAYOUT_BRICKED || model->layout == CS173_LAYOUT_QUANTIZED ||
+	    model->layout == CS173_LAYOUT_COMPRESSED)
+		return cs173_brick_location(model, x, y, z);
+	return model->strides.origin + x * model->strides.dx + y * model->strides.dy + z * model->strides.dz;
+}
+
+/**
+ * Retrieves the material properties (whatever is available) for the given data point, expressed
+ * in x, y, and z co-ordinates.
+ *
+ * @param x The x coordinate of the data point.
+ * @param y The y coordinate of the data point.
+ * @param z The z coordinate of the data point.
+ * @param data The properties struct to which the material properties will be written.
+ */
+void cs173_read_properties(int x, int y, int z, cs173_properties_t *data) {
+	cs173_load_fields(cs173_default_handle, CS173_FIELD_ALL);
+	cs173_read_sample(cs173_velocity_model, cs173_location(cs173_velocity_model, x, y, z), data, CS173_FIELD_ALL);
+}
+
+/**
+ * Retrieves the eight grid points surrounding a point in the order cs173_trilinear_interpolation
+ * expects: the (x, y), (x + 1, y), (x, y + 1), (x + 1, y + 1) corners at z, then at z - 1.
+ * The read itself is done by the strategy cs173_try_reading_model picked for the model's layout.
+ *
+ * @param x The x coordinate of the origin corner.
+ * @param y The y coordinate of the origin corner.
+ * @param z The z coordinate of the origin corner.
+ * @param eight_points The eight surrounding data properties.
+ */
+void cs173_read_stencil(int x, int y, int z, cs173_properties_t *eight_points) {
+	cs173_load_fields(cs173_default_handle, CS173_FIELD_VOXEL);
+	cs173_velocity_model->read_stencil(cs173_velocity_model, x, y, z, eight_points, CS173_FIELD_VOXEL);
+}
+
+/**
+ * Reads the stencil one corner at a time. Works for any layout and storage mode. Of the planar
+ * files, only the fields asked for are read.
+ */
+static void cs173_read_stencil_generic(cs173_model_t *model, int x, int y, int z, cs173_properties_t *eight_points,
+                                       int fields) {
+	int i = 0;
+
+	for (i = 0; i < 8; i++)
+		cs173_read_sample(model, cs173_location(model, x + (i & 1), y + ((i >> 1) & 1), z - (i >> 2)), &eight_points[i],
+		                  fields);
+}
+
+/**
+ * Reads the stencil from planar fields that are all in memory or mapped, as a base offset plus
+ * the constant corner deltas. Fields not asked for are left at -1 without being touched.
+ */
+static void cs173_read_stencil_planar(cs173_model_t *model, int x, int y, int z, cs173_properties_t *eight_points,
+                                      int fields) {
+	long base = model->strides.origin + x * model->strides.dx + y * model->strides.dy + z * model->strides.dz;
+	float *vp = (float *)model->vp, *vs = (float *)model->vs, *rho = (float *)model->rho;
+	int i = 0;
+
+	for (i = 0; i < 8; i++) {
+		long location = base + model->corner_delta[i];
+		eight_points[i].vp  = ((fields & CS173_FIELD_VP) && model->vp_status)   ? vp[location]  : -1;
+		eight_points[i].vs  = ((fields & CS173_FIELD_VS) && model->vs_status)   ? vs[location]  : -1;
+		eight_points[i].rho = ((fields & CS173_FIELD_RHO) && model->rho_status) ? rho[location] : -1;
+		eight_points[i].qp = -1;
+		eight_points[i].qs = -1;
+	}
+}
+
+/**
+ * Reads the stencil from interleaved or bricked voxels in memory or mapped. Within a brick, or
+ * anywhere in the interleaved layout, the corners are a base voxel plus constant deltas. A
+ * voxel is read whole whatever fields are asked for, as it sits in one cache line anyway.
+ */
+static void cs173_read_stencil_voxels(cs173_model_t *model, int x, int y, int z, cs173_properties_t *eight_points,
+                                      int fields) {
+	const long *delta = model->corner_delta;
+	int mask = CS173_BRICK_SIZE - 1;
+	long base = 0;
+	float *voxel = NULL;
+	int i = 0;
+
+	if (model->layout == CS173_LAYOUT_BRICKED) {
+		// Stencils that straddle a brick boundary go corner by corner.
+		if ((x & mask) == mask || (y & mask) == mask || (z & mask) == 0) {
+			cs173_read_stencil_generic(model, x, y, z, eight_points, fields);
+			return;
+		}
+		base = cs173_brick_location(model, x, y, z);
+		delta = model->brick_delta;
+	} else {
+		base = model->strides.origin + x * model->strides.dx + y * model->strides.dy + z * model->strides.dz;
+	}
+
+	for (i = 0; i < 8; i++) {
+		voxel = (float *)model->voxels + 3 * (base + delta[i]);
+		eight_points[i].vp  = voxel[0];
+		eight_points[i].vs  = voxel[1];
+		eight_points[i].rho = voxel[2];
+		eight_points[i].qp = -1;
+		eight_points[i].qs = -1;
+	}
+}
+
+/**
+ * Reads the stencil from quantized voxels in memory or mapped. The eight corners of a stencil
+ * inside one brick share its offset and scale, so the brick's range is looked up once and each
+ * corner is turned back into values as it is read.
+ */
+static void cs173_read_stencil_quantized(cs173_model_t *model, int x, int y, int z, cs173_properties_t *eight_points,
+                                         int fields) {
+	int mask = CS173_BRICK_SIZE - 1;
+	const uint16_t *voxel = NULL;
+	const float *range = NULL;
+	long base = 0;
+	int i = 0;
+
+	// Stencils that straddle a brick boundary go corner by corner.
+	if ((x & mask) == mask || (y & mask) == mask || (z & mask) == 0) {
+		cs173_read_stencil_generic(model, x, y, z, eight_points, fields);
+		return;
+	}
+	base = cs173_brick_location(model, x, y, z);
+	range = model->brick_range + 6 * (base / CS173_BRICK_VOXELS);
+
+	for (i = 0; i < 8; i++) {
+		voxel = (const uint16_t *)model->voxels + 3 * (base + model->brick_delta[i]);
+		eight_points[i].vp  = range[0] + voxel[0] * range[1];
+		eight_points[i].vs  = range[2] + voxel[1] * range[3];
+		eight_points[i].rho = range[4] + voxel[2] * range[5];
+		eight_points[i].qp = -1;
+		eight_points[i].qs = -1;
+	}
+}
+
+/**
+ * Reads the stencil from the compressed layout. A stencil inside one brick lies within a run
+ * of a layer and a row of voxels of that brick, from its (x, y, z - 1) corner to its
+ * (x + 1, y + 1, z) corner, which is copied out of the unpacked brick in one go.
+ */
+static void cs173_read_stencil_compressed(cs173_model_t *model, int x, int y, int z, cs173_properties_t *eight_points,
+                                          int fields) {
+	float span[3 * (CS173_BRICK_SIZE * CS173_BRICK_SIZE + CS173_BRICK_SIZE + 2)];
+	int mask = CS173_BRICK_SIZE - 1;
+	long base = 0, first = 0;
+	float *voxel = NULL;
+	int i = 0;
+
+	// Stencils that straddle a brick boundary go corner by corner.
+	if ((x & mask) == mask || (y & mask) == mask || (z & mask) == 0) {
+		cs173_read_stencil_generic(model, x, y, z, eight_points, fields);
+		return;
+	}
+	base = cs173_brick_location(model, x, y, z);
+	first = base + model->brick_delta[4];
+
+	if (cs173_read_unpacked(model, span, first, model->brick_delta[3] - model->brick_delta[4] + 1) != SUCCESS) {
+		for (i = 0; i < 8; i++) {
+			eight_points[i].vp = eight_points[i].vs = eight_points[i].rho = -1;
+			eight_points[i].qp = eight_points[i].qs = -1;
+		}
+		return;
+	}
+
+	for (i = 0; i < 8; i++) {
+		voxel = span + 3 * (base + model->brick_delta[i] - first);
+		eight_points[i].vp  = voxel[0];
+		eight_points[i].vs  = voxel[1];
+		eight_points[i].rho = voxel[2];
+		eight_points[i].qp = -1;
+		eight_points[i].qs = -1;
+	}
+}
+
+/**
+ * Resolves the seek_axis and seek_direction of the configuration into strides, so that grid point
+ * (x, y, z) is sample origin + x * dx + y * dy + z * dz of the planar files.
+ *
+ * @param config The model configuration.
+ * @param strides The strides describing the layout.
+ */
+void cs173_resolve_strides(cs173_configuration_t *config, cs173_strides_t *strides) {
+	long plane = (long)config->nx * config->ny;
+
+	memset(strides, 0, sizeof(cs173_strides_t));
 
         // the z is inverted at line #145
-        if ( strcmp(cs173_configuration->seek_axis, "fast-y") == 0 ||
-                 strcmp(cs173_configuration->seek_axis, "fast-Y") == 0 ) { // fast-y,  cs173 
-            if(strcmp(cs173_configuration->seek_direction, "bottom-up") == 0) { 
-	        location = ((long) z * cs173_configuration->nx * cs173_configuration->ny) + (x * cs173_configuration->ny) + y;
-                } else {
-                    // nz starts from 0 up to nz-1
-	            location = ((long)((cs173_configuration->nz -1) - z) * cs173_configuration->nx * cs173_configuration->ny) + (x * cs173_configuration->ny) + y;
+        if ( strcmp(config->seek_axis, "fast-y") == 0 ||
+                 strcmp(config->seek_axis, "fast-Y") == 0 ) { // fast-y,  cs173 
+            strides->dx = config->ny;
+            strides->dy = 1;
+            if(strcmp(config->seek_direction, "bottom-up") == 0) { 
+                strides->dz = plane;
+            } else {
+                // nz starts from 0 up to nz-1
+                strides->origin = (long)(config->nz - 1) * plane;
+                strides->dz = -plane;
             }
         } else {  // fast-X, cca data
-            if ( strcmp(cs173_configuration->seek_axis, "fast-x") == 0 ||
-                     strcmp(cs173_configuration->seek_axis, "fast-X") == 0 ) { // fast-y,  cs173 
-                if(strcmp(cs173_configuration->seek_direction, "bottom-up") == 0) { 
- 		    location = ((long)z * cs173_configuration->nx * cs173_configuration->ny) + (y * cs173_configuration->nx) + x;
-                    } else { // bottom-up
- 		        location = ((long)(cs173_configuration->nz - z) * cs173_configuration->nx * cs173_configuration->ny) + (y * cs173_configuration->nx) + x;
+            if ( strcmp(config->seek_axis, "fast-x") == 0 ||
+                     strcmp(config->seek_axis, "fast-X") == 0 ) { // fast-x, cca
+                strides->dx = 1;
+                strides->dy = config->nx;
+                if(strcmp(config->seek_direction, "bottom-up") == 0) { 
+                    strides->dz = plane;
+                } else { // top-down, nz starts from 0 up to nz-1
+                    strides->origin = (long)(config->nz - 1) * plane;
+                    strides->dz = -plane;
                 }
             }
         }
+}
+
+/**
+ * Returns the voxel index of grid point (x, y, z) within the bricked voxel file. Bricks are
+ * CS173_BRICK_SIZE voxels on a side, x fastest inside a brick, and stored in the order given
+ * by the model's brick_index table.
+ *
+ * @param model The model holding the brick table.
+ * @param x The x coordinate of the data point.
+ * @param y The y coordinate of the data point.
+ * @param z The z coordinate of the data point.
+ * @return The index of the voxel within the bricked file.
+ */
+long cs173_brick_location(cs173_model_t *model, int x, int y, int z) {
+	long brick = model->brick_index[((long)(z >> CS173_BRICK_SHIFT) * model->brick_ny + (y >> CS173_BRICK_SHIFT)) *
+	                                model->brick_nx + (x >> CS173_BRICK_SHIFT)];
+	int mask = CS173_BRICK_SIZE - 1;
+
+	return brick * CS173_BRICK_VOXELS + (((z & mask) * CS173_BRICK_SIZE + (y & mask)) * CS173_BRICK_SIZE + (x & mask));
+}
+
+/**
+ * Visits the bricks of an octree node in Morton (Z) order, numbering those that lie inside
+ * the brick grid.
+ */
+static void cs173_brick_visit(int *index, int bnx, int bny, int bnz, int bx, int by, int bz, int size, int *next) {
+	int child = 0, half = size / 2;
 
-	// Check our loaded components of the model.
-	if (cs173_velocity_model->vs_status == 2) {
-		// Read from memory.
-		ptr = (float *)cs173_velocity_model->vs;
-		data->vs = ptr[location];
-	} else if (cs173_velocity_model->vs_status == 1) {
-		// Read from file.
-		fp = (FILE *)cs173_velocity_model->vs;
-		fseek(fp, location * sizeof(float), SEEK_SET);
-                float temp;
-		fread(&(temp), sizeof(float), 1, fp);
-                data->vs = temp;
+	if (bx >= bnx || by >= bny || bz >= bnz) return;
+	if (size == 1) {
+		index[((long)bz * bny + by) * bnx + bx] = (*next)++;
+		return;
 	}
+	for (child = 0; child < 8; child++)
+		cs173_brick_visit(index, bnx, bny, bnz, bx + (child & 1) * half, by + ((child >> 1) & 1) * half,
+		                  bz + ((child >> 2) & 1) * half, half, next);
+}
 
-	// Check our loaded components of the model.
-	if (cs173_velocity_model->vp_status == 2) {
-		// Read from memory.
-		ptr = (float *)cs173_velocity_model->vp;
-		data->vp = ptr[location];
-	} else if (cs173_velocity_model->vp_status == 1) {
-		// Read from file.
-		fp = (FILE *)cs173_velocity_model->vp;
-		fseek(fp, location * sizeof(float), SEEK_SET);
-                float temp;
-		fread(&(temp), sizeof(float), 1, fp);
-                data->vp=temp;
-	}
+/**
+ * Builds the table giving the storage position of each brick of the bricked layout. The
+ * bricks are numbered along a Z-order curve, skipping those that fall outside the grid, so
+ * bricks that are near each other in space are near each other in the file.
+ *
+ * @param bnx Number of bricks in x.
+ * @param bny Number of bricks in y.
+ * @param bnz Number of bricks in z.
+ * @return The table, indexed (bz * bny + by) * bnx + bx, or NULL if out of memory.
+ */
+int *cs173_brick_order(int bnx, int bny, int bnz) {
+	int *index = malloc((size_t)bnx * bny * bnz * sizeof(int));
+	int size = 1, next = 0;
 
-	// Check our loaded components of the model.
-	if (cs173_velocity_model->rho_status == 2) {
-		// Read from memory.
-		ptr = (float *)cs173_velocity_model->rho;
-		data->rho = ptr[location];
-	} else if (cs173_velocity_model->rho_status == 1) {
-		// Read from file.
-		fp = (FILE *)cs173_velocity_model->rho;
-		fseek(fp, location * sizeof(float), SEEK_SET);
-                float temp;
-		fread(&(temp), sizeof(float), 1, fp);
-                data->rho=temp;
-	}
+	if (index == NULL) return NULL;
+	while (size < bnx || size < bny || size < bnz) size *= 2;
+	cs173_brick_visit(index, bnx, bny, bnz, 0, 0, 0, size, &next);
+
+	return index;
 }
 
 /**
@@ -375,7 +2450,7 @@ void cs173_read_properties(int x, int y, int z, cs173_properties_t *data) {
  */
 void cs173_trilinear_interpolation(double x_percent, double y_percent, double z_percent,
 							 cs173_properties_t *eight_points, cs173_properties_t *ret_properties) {
-	cs173_properties_t *temp_array = calloc(2, sizeof(cs173_properties_t));
+	cs173_properties_t temp_array[2];
 	cs173_properties_t *four_points = eight_points;
 
 	cs173_bilinear_interpolation(x_percent, y_percent, four_points, &temp_array[0]);
@@ -388,8 +2463,6 @@ void cs173_trilinear_interpolation(double x_percent, double y_percent, double z_
 
 	// Now linearly interpolate between the two.
 	cs173_linear_interpolation(z_percent, &temp_array[0], &temp_array[1], ret_properties);
-
-	free(temp_array);
 }
 
 /**
@@ -402,11 +2475,10 @@ void cs173_trilinear_interpolation(double x_percent, double y_percent, double z_
  * @param ret_properties Returned data properties.
  */
 void cs173_bilinear_interpolation(double x_percent, double y_percent, cs173_properties_t *four_points, cs173_properties_t *ret_properties) {
-	cs173_properties_t *temp_array = calloc(2, sizeof(cs173_properties_t));
+	cs173_properties_t temp_array[2];
 	cs173_linear_interpolation(x_percent, &four_points[0], &four_points[1], &temp_array[0]);
 	cs173_linear_interpolation(x_percent, &four_points[2], &four_points[3], &temp_array[1]);
 	cs173_linear_interpolation(y_percent, &temp_array[0], &temp_array[1], ret_properties);
-	free(temp_array);
 }
 
 /**
@@ -425,17 +2497,269 @@ void cs173_linear_interpolation(double percent, cs173_properties_t *x0, cs173_pr
 	ret_properties->qs  = (1 - percent) * x0->qs  + percent * x1->qs;
 }
 
+/**
+ * Returns a monotonic clock in nanoseconds, for the stage timers.
+ */
+static inline unsigned long long cs173_clock_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Adds one set of statistics to another. Each thread's statistics are written by that thread
+ * alone and read by others, so each counter is loaded and stored whole.
+ *
+ * @param to The statistics added to.
+ * @param from The statistics to add.
+ */
+static void cs173_add_stats(cs173_stats_t *to, cs173_stats_t *from) {
+#define CS173_ADD_STAT(field) __atomic_store_n(&to->field, __atomic_load_n(&to->field, __ATOMIC_RELAXED) + \
+                              __atomic_load_n(&from->field, __ATOMIC_RELAXED), __ATOMIC_RELAXED)
+	CS173_ADD_STAT(points);
+	CS173_ADD_STAT(gtl_points);
+	CS173_ADD_STAT(outside_points);
+	CS173_ADD_STAT(batch_points);
+	CS173_ADD_STAT(reads);
+	CS173_ADD_STAT(cache_hits);
+	CS173_ADD_STAT(prefetches);
+	CS173_ADD_STAT(bytes_read);
+	CS173_ADD_STAT(vs30_searches);
+	CS173_ADD_STAT(project_ns);
+	CS173_ADD_STAT(model_ns);
+	CS173_ADD_STAT(gtl_ns);
+#undef CS173_ADD_STAT
+}
+
+/**
+ * Gets the query statistics of the model. See cs173_get_stats_h.
+ *
+ * @param stats The statistics to fill in.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_get_stats(cs173_stats_t *stats) {
+	return cs173_get_stats_h(cs173_default_handle, stats);
+}
+
+/**
+ * Zeroes the query statistics of the model. See cs173_reset_stats_h.
+ *
+ * @return SUCCESS or FAIL.
+ */
+int cs173_reset_stats() {
+	return cs173_reset_stats_h(cs173_default_handle);
+}
+
+/**
+ * Gets what the queries of a model have done since it was opened or its statistics were last
+ * reset, summed over every thread that queried it. Each thread counts into its own state, so
+ * counting costs the queries next to nothing; the stage timers are only kept with stats =
+ * timers in the configuration. May be called while queries run, in which case it sees most,
+ * but not necessarily all, of their work so far.
+ *
+ * @param handle The model handle from cs173_open.
+ * @param stats The statistics to fill in.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_get_stats_h(cs173_model_handle *handle, cs173_stats_t *stats) {
+	cs173_thread_t *thread = NULL;
+	unsigned long long hits = 0, misses = 0, bytes = 0;
+
+	if (handle == NULL || stats == NULL) return FAIL;
+
+	memset(stats, 0, sizeof(cs173_stats_t));
+	pthread_mutex_lock(&handle->thread_lock);
+	cs173_add_stats(stats, &handle->retired_stats);
+	for (thread = handle->threads; thread != NULL; thread = thread->next)
+		cs173_add_stats(stats, &thread->stats);
+	pthread_mutex_unlock(&handle->thread_lock);
+
+	stats->reads += __atomic_load_n(&handle->model->reads, __ATOMIC_RELAXED);
+	stats->bytes_read += __atomic_load_n(&handle->model->bytes_read, __ATOMIC_RELAXED);
+	stats->vs30_searches += __atomic_load_n(&handle->vs30_map->searches, __ATOMIC_RELAXED);
+
+	// The page cache reads whole pages on a miss; each of those is one read of the file. The
+	// brick cache's misses unpack a brick instead, and count what they read themselves.
+	if (handle->model->cache != NULL) {
+		cs173_cache_counts(handle->model->cache, &hits, &misses, &bytes);
+		stats->cache_hits += hits;
+		stats->reads += misses;
+		stats->bytes_read += bytes;
+	}
+	if (handle->model->brick_cache != NULL) {
+		cs173_cache_counts(handle->model->brick_cache, &hits, &misses, &bytes);
+		stats->cache_hits += hits;
+	}
+
+	return SUCCESS;
+}
+
+/**
+ * Zeroes the query statistics of a model. Work done by queries running meanwhile may or may
+ * not be counted.
+ *
+ * @param handle The model handle from cs173_open.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_reset_stats_h(cs173_model_handle *handle) {
+	cs173_thread_t *thread = NULL;
+	cs173_stats_t zero;
+
+	if (handle == NULL) return FAIL;
+
+	memset(&zero, 0, sizeof(zero));
+	pthread_mutex_lock(&handle->thread_lock);
+	handle->retired_stats = zero;
+	for (thread = handle->threads; thread != NULL; thread = thread->next) {
+		// Adding a thread's own counts back negated would race with it, so store zeroes.
+		__atomic_store_n(&thread->stats.points, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.gtl_points, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.outside_points, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.batch_points, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.reads, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.cache_hits, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.prefetches, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.bytes_read, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.vs30_searches, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.project_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.model_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&thread->stats.gtl_ns, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&handle->thread_lock);
+
+	__atomic_store_n(&handle->model->reads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&handle->model->bytes_read, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&handle->vs30_map->searches, 0, __ATOMIC_RELAXED);
+	if (handle->model->cache != NULL)
+		cs173_cache_reset_counts(handle->model->cache);
+	if (handle->model->brick_cache != NULL)
+		cs173_cache_reset_counts(handle->model->brick_cache);
+
+	return SUCCESS;
+}
+
+/**
+ * Prints the query statistics of a model to stderr, for stats_report = on.
+ *
+ * @param handle The model handle.
+ */
+static void cs173_report_stats(cs173_model_handle *handle) {
+	cs173_stats_t stats;
+
+	if (cs173_get_stats_h(handle, &stats) != SUCCESS) return;
+
+	fprintf(stderr, "CS173 query statistics:\n");
+	fprintf(stderr, "  points queried:        %llu\n", stats.points);
+	fprintf(stderr, "    in the GTL:          %llu\n", stats.gtl_points);
+	fprintf(stderr, "    outside the model:   %llu\n", stats.outside_points);
+	fprintf(stderr, "    by the SIMD kernel:  %llu\n", stats.batch_points);
+	fprintf(stderr, "  model file reads:      %llu (%llu bytes)\n", stats.reads, stats.bytes_read);
+	fprintf(stderr, "  page cache hits:       %llu\n", stats.cache_hits);
+	fprintf(stderr, "  read-ahead requests:   %llu\n", stats.prefetches);
+	fprintf(stderr, "  Vs30 e-tree searches:  %llu\n", stats.vs30_searches);
+	if (handle->config->stats == CS173_STATS_TIMERS) {
+		fprintf(stderr, "  projecting:            %.6f s\n", stats.project_ns * 1e-9);
+		fprintf(stderr, "  reading the model:     %.6f s\n", stats.model_ns * 1e-9);
+		fprintf(stderr, "  blending the GTL:      %.6f s\n", stats.gtl_ns * 1e-9);
+	}
+}
+
 /**
  * Called when the model is being discarded. Free all variables.
  *
  * @return SUCCESS
  */
 int cs173_finalize() {
-	pj_free(cs173_latlon);
-	pj_free(cs173_utm);
+	cs173_close(cs173_default_handle);
+
+	cs173_default_handle = NULL;
+	cs173_configuration = NULL;
+	cs173_velocity_model = NULL;
+	cs173_vs30_map = NULL;
+	cs173_latlon = NULL;
+	cs173_utm = NULL;
+	cs173_geo_utm = NULL;
+	cs173_aeqd = NULL;
+	cs173_is_initialized = 0;
+
+	return SUCCESS;
+}
+
+/**
+ * Closes a model opened by cs173_open and frees everything it holds. No thread may be
+ * querying the handle while it is closed.
+ *
+ * @param handle The model handle, which may have been only partly opened.
+ * @return SUCCESS
+ */
+int cs173_close(cs173_model_handle *handle) {
+	cs173_model_t *model = NULL;
+	cs173_thread_t *thread = NULL;
+
+	if (handle == NULL) return SUCCESS;
+	model = handle->model;
+
+	// The workers' thread states are freed below, so stop the workers first.
+	cs173_pool_destroy(handle->pool);
+
+	if (handle->config && handle->model && handle->config->stats_report)
+		cs173_report_stats(handle);
+
+	while (handle->threads != NULL) {
+		thread = handle->threads;
+		handle->threads = thread->next;
+		cs173_free_thread(thread);
+	}
+
+	if (handle->latlon) pj_free(handle->latlon);
+	if (handle->utm) pj_free(handle->utm);
+	if (handle->geo_utm) pj_free(handle->geo_utm);
+	if (handle->aeqd) pj_free(handle->aeqd);
+
+	if (model) {
+		size_t size = model->field_size;
+		cs173_close_field(model->vp, model->vp_status, size);
+		cs173_close_field(model->vs, model->vs_status, size);
+		cs173_close_field(model->rho, model->rho_status, size);
+		cs173_close_field(model->qp, model->qp_status, size);
+		cs173_close_field(model->qs, model->qs_status, size);
+		if (model->layout == CS173_LAYOUT_COMPRESSED) {
+			// Read from disk, the index was read into memory of its own.
+			if (model->voxels_status == 1) free(model->brick_offsets);
+			cs173_close_field(model->voxels, model->voxels_status, model->packed_size);
+		} else if (model->layout == CS173_LAYOUT_QUANTIZED) {
+			// Read from disk, the ranges were read into memory of their own.
+			if (model->voxels_status == 1) free(model->brick_range);
+			cs173_close_field(model->voxels, model->voxels_status, cs173_quantized_size(model) + cs173_brick_range_size(model));
+		} else if (model->layout == CS173_LAYOUT_BRICKED)
+			cs173_close_field(model->voxels, model->voxels_status, cs173_bricked_size(model));
+		else
+			cs173_close_field(model->voxels, model->voxels_status, 3 * size);
+		cs173_destroy_cache(model->cache, model->cache_charge);
+		cs173_destroy_cache(model->brick_cache, model->brick_cache_charge);
+		free(model->brick_index);
+		free(model);
+	}
+	if (handle->vs30_map) {
+		if (handle->vs30_map->vs30_map) etree_close(handle->vs30_map->vs30_map);
+		if (handle->vs30_map->raster_mapping) {
+			munmap(handle->vs30_map->raster_mapping, handle->vs30_map->raster_mapping_size);
+		} else if (handle->vs30_map->raster) {
+			free(handle->vs30_map->raster);
+			pthread_mutex_lock(&cs173_memory_lock);
+			cs173_memory_used -= (size_t)handle->vs30_map->raster_nx * handle->vs30_map->raster_ny * sizeof(float);
+			pthread_mutex_unlock(&cs173_memory_lock);
+		}
+		free(handle->vs30_map);
+	}
+	if (handle->config) free(handle->config);
 
-	if (cs173_velocity_model) free(cs173_velocity_model);
-	if (cs173_configuration) free(cs173_configuration);
+	pthread_key_delete(handle->thread_key);
+	pthread_mutex_destroy(&handle->thread_lock);
+	pthread_mutex_destroy(&handle->vs30_lock);
+	pthread_mutex_destroy(&handle->load_lock);
+	free(handle);
 
 	return SUCCESS;
 }
@@ -480,6 +2804,10 @@ int cs173_read_configuration(char *file, cs173_configuration_t *config) {
 		return FAIL;
 	}
 
+	// The page cache and read-ahead are on unless the configuration turns them off.
+	config->page_cache = CS173_PAGE_CACHE_MB;
+	config->prefetch = 1;
+
 	// Read the lines in the cs173_configuration file.
 	while (fgets(line_holder, sizeof(line_holder), fp) != NULL) {
 		if (line_holder[0] != '#' && line_holder[0] != ' ' && line_holder[0] != '\n') {
@@ -514,6 +2842,51 @@ int cs173_read_configuration(char *file, cs173_configuration_t *config) {
                                 if (strcmp(value, "on") == 0) config->gtl = 1;
                                 else config->gtl = 0;
                         }
+			if (strcmp(key, "vs30_raster") == 0)			config->vs30_raster = (strcmp(value, "on") == 0);
+			if (strcmp(key, "vs30_cache") == 0)			sprintf(config->vs30_cache, "%s", value);
+			if (strcmp(key, "init") == 0)				config->eager_init = (strcmp(value, "eager") == 0);
+			if (strcmp(key, "query_order") == 0) {
+				if (strcmp(value, "sorted") == 0) config->query_order = CS173_ORDER_SORTED;
+				else if (strcmp(value, "given") == 0) config->query_order = CS173_ORDER_GIVEN;
+				else config->query_order = CS173_ORDER_AUTO;
+			}
+			if (strcmp(key, "stats") == 0) {
+				if (strcmp(value, "off") == 0) config->stats = CS173_STATS_OFF;
+				else if (strcmp(value, "timers") == 0) config->stats = CS173_STATS_TIMERS;
+				else config->stats = CS173_STATS_ON;
+			}
+			if (strcmp(key, "page_cache") == 0)			config->page_cache = atol(value);
+			if (strcmp(key, "prefetch") == 0)			config->prefetch = (strcmp(value, "off") != 0);
+			if (strcmp(key, "stats_report") == 0)			config->stats_report = (strcmp(value, "on") == 0);
+			if (strcmp(key, "simd") == 0) {
+				if (strcmp(value, "off") == 0) config->simd = CS173_SIMD_OFF;
+				else if (strcmp(value, "avx2") == 0) config->simd = CS173_SIMD_AVX2;
+				else if (strcmp(value, "avx512") == 0) config->simd = CS173_SIMD_AVX512;
+				else config->simd = CS173_SIMD_AUTO;
+			}
+			if (strcmp(key, "storage") == 0) {
+				if (strcmp(value, "memory") == 0) config->storage_mode = CS173_STORAGE_MEMORY;
+				else if (strcmp(value, "mmap") == 0) config->storage_mode = CS173_STORAGE_MMAP;
+				else if (strcmp(value, "file") == 0) config->storage_mode = CS173_STORAGE_FILE;
+				else config->storage_mode = CS173_STORAGE_AUTO;
+			}
+			if (strcmp(key, "precision") == 0) {
+				if (strcmp(value, "quantized") == 0) config->precision = CS173_PRECISION_QUANTIZED;
+				else config->precision = CS173_PRECISION_FULL;
+			}
+			if (strcmp(key, "memory_limit") == 0)			config->memory_limit = atol(value);
+			if (strcmp(key, "load_threads") == 0)			config->load_threads = atoi(value);
+			if (strcmp(key, "query_threads") == 0) {
+				if (strcmp(value, "auto") == 0) config->query_threads = -1;
+				else config->query_threads = atoi(value);
+			}
+			if (strcmp(key, "hugepages") == 0)			config->hugepages = (strcmp(value, "on") == 0);
+			if (strcmp(key, "mmap_advice") == 0) {
+				if (strcmp(value, "random") == 0) config->mmap_advice = MADV_RANDOM;
+				else if (strcmp(value, "sequential") == 0) config->mmap_advice = MADV_SEQUENTIAL;
+				else if (strcmp(value, "willneed") == 0) config->mmap_advice = MADV_WILLNEED;
+				else config->mmap_advice = MADV_NORMAL;
+			}
 
 		}
 	}
@@ -546,147 +2919,598 @@ void cs173_print_error(char *err) {
 	fprintf(stderr, "about the computer you are running CS173 on (Linux, Mac, etc.).\n");
 }
 
+/** Huge page size used to round in-memory field allocations. */
+#define CS173_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/** Most bytes a single pread is asked for while loading a field. */
+#define CS173_LOAD_CHUNK (256UL * 1024 * 1024)
+
 /**
- * Check if the data is too big to be loaded internally (exceed maximum
- * allowable by a INT variable)
+ * Check if one more field is too big to be loaded internally, either because its
+ * size does not fit a size_t or because it would exceed the memory budget (the
+ * memory_limit setting, or the physical memory of the node).
  *
+ * @param config The model configuration.
+ * @param size The size of the field in bytes.
  */
-static int too_big() {
-        long max_size= (long) (cs173_configuration->nx) * cs173_configuration->ny * cs173_configuration->nz;
-        long delta= max_size - INT_MAX;
+static int too_big(cs173_configuration_t *config, size_t size) {
+	size_t points = (size_t)config->nx * config->ny;
 
-	if( delta > 0) {
-	    return 1;
-        } else {
-	    return 0;
-        }
+	if (points / config->ny != (size_t)config->nx ||
+	    (SIZE_MAX / sizeof(float)) / points < (size_t)config->nz)
+		return 1;
+
+	return size > cs173_memory_room(config);
 }
 
 /**
- * Tries to read the model into memory.
+ * Returns how many more bytes of model data fit in memory: what is left of the memory_limit
+ * setting, or of the physical memory of the node, once the data already held is counted.
+ * The caller holds cs173_memory_lock.
+ *
+ * @param config The model configuration.
+ */
+static size_t cs173_memory_room(cs173_configuration_t *config) {
+	size_t limit = 0;
+	long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+
+	if (config->memory_limit > 0)
+		limit = (size_t)config->memory_limit * 1024 * 1024;
+	else if (pages > 0 && page_size > 0)
+		limit = (size_t)pages * page_size;
+	else
+		return SIZE_MAX;
+
+	return (cs173_memory_used > limit) ? 0 : limit - cs173_memory_used;
+}
+
+/**
+ * Creates a page cache, charging it to the memory budget the fields read into memory share.
+ * If the budget has less room left than asked for, the cache is cut down to fit, and if it
+ * has not even room for a page per stripe, there is no cache.
+ *
+ * @param config The model configuration.
+ * @param megabytes The megabytes of pages wanted.
+ * @param page_size Bytes per page.
+ * @param charge Set to the bytes charged, which cs173_destroy_cache gives back.
+ * @return The cache, or NULL if it does not fit or could not be allocated.
+ */
+static cs173_cache_t *cs173_create_cache(cs173_configuration_t *config, long megabytes, size_t page_size,
+                                         size_t *charge) {
+	cs173_cache_t *cache = NULL;
+	size_t budget = (size_t)megabytes * 1024 * 1024, room = 0;
+
+	pthread_mutex_lock(&cs173_memory_lock);
+	room = cs173_memory_room(config);
+	if (budget > room) budget = room - room % (page_size * CS173_CACHE_STRIPES);
+	if (budget >= page_size * CS173_CACHE_STRIPES) cs173_memory_used += budget;
+	pthread_mutex_unlock(&cs173_memory_lock);
+
+	if (budget < page_size * CS173_CACHE_STRIPES) {
+		fprintf(stderr, "WARNING: No room within the memory limit for a cache of the model files.\n");
+		return NULL;
+	}
+	if (budget < (size_t)megabytes * 1024 * 1024)
+		fprintf(stderr, "WARNING: Cut a cache of the model files to %zu MB to fit the memory limit.\n",
+		        budget / 1024 / 1024);
+
+	cache = cs173_cache_create(budget, page_size);
+	if (cache == NULL) {
+		cs173_destroy_cache(NULL, budget);
+		budget = 0;
+	}
+	*charge = budget;
+	return cache;
+}
+
+/**
+ * Frees a cache made by cs173_create_cache and gives back what it was charged.
+ *
+ * @param cache The cache, or NULL.
+ * @param charge The bytes it was charged.
+ */
+static void cs173_destroy_cache(cs173_cache_t *cache, size_t charge) {
+	cs173_cache_destroy(cache);
+	pthread_mutex_lock(&cs173_memory_lock);
+	cs173_memory_used -= charge;
+	pthread_mutex_unlock(&cs173_memory_lock);
+}
+
+/**
+ * Returns the number of bytes actually allocated for an in-memory field.
+ *
+ * @param size The size of the field in bytes.
+ */
+static size_t cs173_alloc_size(size_t size) {
+	return (size + CS173_HUGE_PAGE_SIZE - 1) & ~(CS173_HUGE_PAGE_SIZE - 1);
+}
+
+/**
+ * Allocates memory for one field with anonymous pages, backed by huge pages if the
+ * hugepages setting is on (explicit huge pages first, then transparent ones).
+ *
+ * @param config The model configuration.
+ * @param field_size The size of the field in bytes.
+ * @return The memory, or NULL if it could not be allocated.
+ */
+static void *cs173_alloc_field(cs173_configuration_t *config, size_t field_size) {
+	void *ptr = MAP_FAILED;
+	size_t size = cs173_alloc_size(field_size);
+
+#ifdef MAP_HUGETLB
+	if (config->hugepages)
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (ptr == MAP_FAILED) {
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+		if (config->hugepages) madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	return ptr;
+}
+
+/** One thread's share of a field being loaded with pread. */
+typedef struct cs173_load_range_t {
+	/** The field file descriptor */
+	int fd;
+	/** Where the range goes in memory */
+	char *dst;
+	/** Offset of the range within the file */
+	off_t offset;
+	/** Length of the range in bytes */
+	size_t length;
+	/** SUCCESS or FAIL once the range is read */
+	int result;
+} cs173_load_range_t;
+
+/**
+ * Reads one range of a field file with pread, in chunks of at most CS173_LOAD_CHUNK.
+ *
+ * @param arg The cs173_load_range_t to read.
+ */
+static void *cs173_load_range(void *arg) {
+	cs173_load_range_t *range = (cs173_load_range_t *)arg;
+	size_t done = 0, want = 0;
+	ssize_t got = 0;
+
+	range->result = SUCCESS;
+	while (done < range->length) {
+		want = range->length - done;
+		if (want > CS173_LOAD_CHUNK) want = CS173_LOAD_CHUNK;
+		got = pread(range->fd, range->dst + done, want, range->offset + done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) {
+			range->result = FAIL;
+			break;
+		}
+		done += got;
+	}
+
+	return NULL;
+}
+
+/**
+ * Reads a whole field file into memory, splitting it across load_threads threads.
+ *
+ * @param config The model configuration.
+ * @param file The field file location on disk.
+ * @param dst The memory to read into, at least size bytes.
+ * @param size The size of the field in bytes.
+ * @return SUCCESS or FAIL.
+ */
+static int cs173_load_field(cs173_configuration_t *config, char *file, void *dst, size_t size) {
+	size_t share = 0;
+	int threads = config->load_threads, i = 0, started = 0, ret = SUCCESS;
+	cs173_load_range_t *ranges = NULL;
+	pthread_t *tids = NULL;
+	int fd = open(file, O_RDONLY);
+
+	if (fd < 0) return FAIL;
+
+	if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > CS173_MAX_LOAD_THREADS) threads = CS173_MAX_LOAD_THREADS;
+	if (threads < 1 || size < CS173_LOAD_CHUNK) threads = 1;
+
+	ranges = calloc(threads, sizeof(cs173_load_range_t));
+	tids = calloc(threads, sizeof(pthread_t));
+	if (ranges == NULL || tids == NULL) {
+		free(ranges);
+		free(tids);
+		close(fd);
+		return FAIL;
+	}
+
+	// Page-aligned, even shares so each thread streams its own part of the file.
+	share = ((size / threads) + CS173_HUGE_PAGE_SIZE - 1) & ~(CS173_HUGE_PAGE_SIZE - 1);
+	for (i = 0; i < threads; i++) {
+		ranges[i].fd = fd;
+		ranges[i].offset = (off_t)share * i;
+		ranges[i].dst = (char *)dst + (size_t)share * i;
+		ranges[i].length = ((size_t)share * i >= size) ? 0 :
+		                   (size - (size_t)share * i < share ? size - (size_t)share * i : share);
+	}
+
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, cs173_load_range, &ranges[i]) != 0) break;
+		started = i;
+	}
+	cs173_load_range(&ranges[0]);
+	// Anything we could not hand to a thread gets read here.
+	for (i = started + 1; i < threads; i++) cs173_load_range(&ranges[i]);
+	for (i = 1; i <= started; i++) pthread_join(tids[i], NULL);
+
+	for (i = 0; i < threads; i++)
+		if (ranges[i].result != SUCCESS) ret = FAIL;
+
+	free(ranges);
+	free(tids);
+	close(fd);
+	return ret;
+}
+
+/**
+ * Opens one field file of the model, storing it in memory, memory-mapping it, or leaving it
+ * on disk depending on the configured storage mode and whether it fits.
+ *
+ * @param config The model configuration.
+ * @param file The field file location on disk.
+ * @param base_malloc The size of the field in bytes.
+ * @param data Set to the in-memory data, the mapping, or the FILE pointer.
+ * @param status Set to 1 if read from disk, 2 if in memory, 3 if memory-mapped.
+ * @return SUCCESS, or FAIL if the file could not be opened at all or is too short.
+ */
+static int cs173_open_field(cs173_configuration_t *config, char *file, size_t base_malloc, void **data, int *status) {
+	int mode = config->storage_mode;
+	int fd = -1, fits = 0;
+	struct stat st;
+
+	if (mode == CS173_STORAGE_AUTO || mode == CS173_STORAGE_MEMORY) {
+		// Reserve the memory up front so handles opened side by side share the budget.
+		pthread_mutex_lock(&cs173_memory_lock);
+		fits = !too_big(config, base_malloc);
+		if (fits) cs173_memory_used += cs173_alloc_size(base_malloc);
+		pthread_mutex_unlock(&cs173_memory_lock);
+	}
+
+	if (fits) { // only if fit
+		*data = cs173_alloc_field(config, base_malloc);
+		if (*data != NULL) {
+			// Read the model in.
+			if (cs173_load_field(config, file, *data, base_malloc) == SUCCESS) {
+				*status = 2;
+				return SUCCESS;
+			}
+			munmap(*data, cs173_alloc_size(base_malloc));
+		}
+		pthread_mutex_lock(&cs173_memory_lock);
+		cs173_memory_used -= cs173_alloc_size(base_malloc);
+		pthread_mutex_unlock(&cs173_memory_lock);
+	}
+
+	if (mode == CS173_STORAGE_AUTO || mode == CS173_STORAGE_MMAP) {
+		fd = open(file, O_RDONLY);
+		if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= base_malloc) {
+			*data = mmap(NULL, base_malloc, PROT_READ, MAP_SHARED, fd, 0);
+			if (*data != MAP_FAILED) {
+				close(fd);
+				madvise(*data, base_malloc, config->mmap_advice);
+				*status = 3;
+				return SUCCESS;
+			}
+		}
+		if (fd >= 0) close(fd);
+	}
+
+	// Left on disk, the file must still hold the whole field.
+	*data = fopen(file, "rb");
+	if (*data == NULL) return FAIL;
+	if (fstat(fileno((FILE *)*data), &st) != 0 || (size_t)st.st_size < base_malloc) {
+		fclose((FILE *)*data);
+		*data = NULL;
+		return FAIL;
+	}
+	*status = 1;
+	return SUCCESS;
+}
+
+/**
+ * Releases a field opened by cs173_open_field.
+ *
+ * @param data The in-memory data, the mapping, or the FILE pointer.
+ * @param status The status the field was opened with.
+ * @param size The size of the field in bytes.
+ */
+static void cs173_close_field(void *data, int status, size_t size) {
+	if (status == 1) fclose((FILE *)data);
+	else if (status == 2) {
+		munmap(data, cs173_alloc_size(size));
+		pthread_mutex_lock(&cs173_memory_lock);
+		cs173_memory_used -= cs173_alloc_size(size);
+		pthread_mutex_unlock(&cs173_memory_lock);
+	}
+	else if (status == 3) munmap(data, size);
+}
+
+/**
+ * Tries to read the model into memory, using the configuration and directory set up by cs173_init.
  *
  * @param model The model parameter struct which will hold the pointers to the data either on disk or in memory.
- * @return 2 if all files are read to memory, SUCCESS if file is found but at least 1
+ * @return 2 if all files are read to memory or mapped, SUCCESS if file is found but at least 1
  * is not in memory, FAIL if no file found.
  */
 int cs173_try_reading_model(cs173_model_t *model) {
-	double base_malloc = cs173_configuration->nx * cs173_configuration->ny * cs173_configuration->nz * sizeof(float);
-	int file_count = 0;
-	int all_read_to_memory =0;
+	return cs173_read_model(cs173_configuration, cs173_iteration_directory, model);
+}
+
+/**
+ * Tries to read the model into memory.
+ *
+ * @param config The model configuration.
+ * @param directory The directory holding the model data files.
+ * @param model The model parameter struct which will hold the pointers to the data either on disk or in memory.
+ * @return 2 if all files are read to memory or mapped, SUCCESS if file is found but at least 1
+ * is not in memory, FAIL if no file found.
+ */
+static int cs173_read_model(cs173_configuration_t *config, const char *directory, cs173_model_t *model) {
+	int ret = 0;
+
+	if (cs173_find_model(config, directory, model) != SUCCESS)
+		return FAIL;
+
+	ret = cs173_load_model(config, directory, model, CS173_FIELD_ALL);
+	model->ready = model->present;
+
+	return ret;
+}
+
+/**
+ * Works out which model files there are and how they are laid out, without opening them.
+ *
+ * @param config The model configuration.
+ * @param directory The directory holding the model data files.
+ * @param model The model parameter struct, whose present mask and addressing are filled in.
+ * @return SUCCESS, or FAIL if no file found.
+ */
+static int cs173_find_model(cs173_configuration_t *config, const char *directory, cs173_model_t *model) {
+	int i = 0;
+
+	model->field_size = (size_t)config->nx * config->ny * config->nz * sizeof(float);
+	model->brick_nx = (config->nx + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	model->brick_ny = (config->ny + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	model->brick_nz = (config->nz + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	cs173_find_layout(config, directory, model);
+
+	// Resolve the addressing once so the query never has to look at the layout strings.
+	cs173_resolve_strides(config, &model->strides);
+	for (i = 0; i < 8; i++) {
+		model->corner_delta[i] = (i & 1) * model->strides.dx + ((i >> 1) & 1) * model->strides.dy - (i >> 2) * model->strides.dz;
+		model->brick_delta[i] = (i & 1) + ((i >> 1) & 1) * CS173_BRICK_SIZE - (i >> 2) * CS173_BRICK_SIZE * CS173_BRICK_SIZE;
+	}
+	model->read_stencil = cs173_read_stencil_generic;
+
+	return (model->present != 0) ? SUCCESS : FAIL;
+}
+
+/**
+ * Picks the layout of the model from the files in its directory, skipping the voxel files that
+ * have already failed to open, and marks the fields that are there. Fields once marked stay
+ * marked, so that fields lost with a voxel file that failed are reported broken, not missing. Quantized, bricked,
+ * compressed or interleaved (vp, vs, rho) voxels take the place of the three planar files, in
+ * that order. The quantized ones are lossy, so they are only read if asked for.
+ *
+ * @param config The model configuration.
+ * @param directory The directory holding the model data files.
+ * @param model The model parameter struct, whose layout and present mask are set.
+ */
+static void cs173_find_layout(cs173_configuration_t *config, const char *directory, cs173_model_t *model) {
+	const char *names[5] = { "vp", "vs", "density", "qp", "qs" };
+	const char *files[4] = { CS173_QUANTIZED_FILE, CS173_BRICKED_FILE, CS173_COMPRESSED_FILE, CS173_INTERLEAVED_FILE };
+	const int layouts[4] = { CS173_LAYOUT_QUANTIZED, CS173_LAYOUT_BRICKED, CS173_LAYOUT_COMPRESSED, CS173_LAYOUT_INTERLEAVED };
 	char current_file[128];
-	FILE *fp;
+	int i = 0;
+
+	model->layout = CS173_LAYOUT_PLANAR;
+	for (i = 0; i < 4 && model->layout == CS173_LAYOUT_PLANAR; i++) {
+		if (layouts[i] == CS173_LAYOUT_QUANTIZED && config->precision != CS173_PRECISION_QUANTIZED) continue;
+		if (model->failed_layouts & (1 << layouts[i])) continue;
+		sprintf(current_file, "%s/%s", directory, files[i]);
+		if (access(current_file, R_OK) != 0) continue;
+		if (layouts[i] != CS173_LAYOUT_INTERLEAVED && model->brick_index == NULL &&
+		    (model->brick_index = cs173_brick_order(model->brick_nx, model->brick_ny, model->brick_nz)) == NULL)
+			continue;
+		model->layout = layouts[i];
+		model->present |= CS173_FIELD_VOXEL;
+	}
 
 	// Let's see what data we actually have.
-	sprintf(current_file, "%s/vp.dat", cs173_iteration_directory);
-	if (access(current_file, R_OK) == 0) {
-                if( !too_big() ) { // only if fit
-		    model->vp = malloc(base_malloc);
-		    if (model->vp != NULL) {
-			// Read the model in.
-			fp = fopen(current_file, "rb");
-			fread(model->vp, 1, base_malloc, fp);
-                        all_read_to_memory++;
-			fclose(fp);
-			model->vp_status = 2;
-		    } else {
-			model->vp = fopen(current_file, "rb");
-			model->vp_status = 1;
-                    }
-		} else {
-		    model->vp = fopen(current_file, "rb");
-		    model->vp_status = 1;
-                }
-		file_count++;
+	for (i = 0; i < 5; i++) {
+		if (model->layout != CS173_LAYOUT_PLANAR && i < 3) continue;
+		sprintf(current_file, "%s/%s.dat", directory, names[i]);
+		if (access(current_file, R_OK) == 0) model->present |= 1 << i;
 	}
+}
 
-	sprintf(current_file, "%s/vs.dat", cs173_iteration_directory);
-	if (access(current_file, R_OK) == 0) {
-                if( !too_big( )) { // only if fit
-		    model->vs = malloc(base_malloc);
-		    if (model->vs != NULL) {
-			// Read the model in.
-			fp = fopen(current_file, "rb");
-			fread(model->vs, 1, base_malloc, fp);
-                        all_read_to_memory++;
-			fclose(fp);
-			model->vs_status = 2;
-		    } else {
-			model->vs = fopen(current_file, "rb");
-			model->vs_status = 1;
-		    }
-		} else {
-		    model->vs = fopen(current_file, "rb");
-		    model->vs_status = 1;
-                }
-		file_count++;
+/**
+ * Opens the quantized voxel file like any other field, and finds the offset and scale of each
+ * brick that follow the voxels: in place if the file is in memory or mapped, or read into
+ * memory of their own if it stays on disk.
+ *
+ * @param config The model configuration.
+ * @param file The quantized file location on disk.
+ * @param model The model parameter struct, whose voxels and brick ranges are set.
+ * @return SUCCESS, or FAIL if the file could not be opened or is too short.
+ */
+static int cs173_open_quantized(cs173_configuration_t *config, char *file, cs173_model_t *model) {
+	size_t voxels = cs173_quantized_size(model), ranges = cs173_brick_range_size(model);
+	ssize_t got = 0;
+
+	if (cs173_open_field(config, file, voxels + ranges, &model->voxels, &model->voxels_status) != SUCCESS)
+		return FAIL;
+
+	if (model->voxels_status >= 2) {
+		model->brick_range = (float *)((char *)model->voxels + voxels);
+		return SUCCESS;
 	}
 
-	sprintf(current_file, "%s/density.dat", cs173_iteration_directory);
-	if (access(current_file, R_OK) == 0) {
-                if(!too_big() ) { // only if fit
-		    model->rho = malloc(base_malloc);
-		    if (model->rho != NULL) {
-			// Read the model in.
-			fp = fopen(current_file, "rb");
-			fread(model->rho, 1, base_malloc, fp);
-                        all_read_to_memory++;
-			fclose(fp);
-			model->rho_status = 2;
-		    } else {
-			model->rho = fopen(current_file, "rb");
-			model->rho_status = 1;
-		    }
-		} else {
-		    model->rho = fopen(current_file, "rb");
-		    model->rho_status = 1;
-		}
-		file_count++;
+	model->brick_range = malloc(ranges);
+	if (model->brick_range != NULL)
+		got = pread(fileno((FILE *)model->voxels), model->brick_range, ranges, voxels);
+	if (model->brick_range == NULL || got != (ssize_t)ranges) {
+		cs173_print_error("Could not read the brick ranges of the quantized model file.");
+		free(model->brick_range);
+		model->brick_range = NULL;
+		cs173_close_field(model->voxels, model->voxels_status, voxels + ranges);
+		model->voxels = NULL;
+		model->voxels_status = 0;
+		return FAIL;
 	}
 
-	sprintf(current_file, "%s/qp.dat", cs173_iteration_directory);
-	if (access(current_file, R_OK) == 0) {
-                if( !too_big() ) { // only if fit
-		    model->qp = malloc(base_malloc);
-		    if (model->qp != NULL) {
-			// Read the model in.
-			fp = fopen(current_file, "rb");
-			fread(model->qp, 1, base_malloc, fp);
-                        all_read_to_memory++;
-			fclose(fp);
-			model->qp_status = 2;
-		    } else {
-			model->qp = fopen(current_file, "rb");
-			model->qp_status = 1;
-		    }
+	return SUCCESS;
+}
+
+/**
+ * Opens the compressed voxel file like any other field, finds the index of its packed bricks,
+ * and sets up the cache their unpacked copies are kept in. The index is used in place if the
+ * file is in memory or mapped, or read into memory of its own if it stays on disk. The cache
+ * holds page_cache megabytes of unpacked bricks, and at least CS173_BRICK_CACHE_MB.
+ *
+ * @param config The model configuration.
+ * @param file The compressed file location on disk.
+ * @param model The model parameter struct, whose voxels, brick offsets and cache are set.
+ * @return SUCCESS, or FAIL if the file could not be opened or its index is damaged.
+ */
+static int cs173_open_compressed(cs173_configuration_t *config, char *file, cs173_model_t *model) {
+	size_t bricks = (size_t)model->brick_nx * model->brick_ny * model->brick_nz;
+	size_t index = (bricks + 1) * sizeof(unsigned long long), i = 0;
+	long budget = (config->page_cache > CS173_BRICK_CACHE_MB) ? config->page_cache : CS173_BRICK_CACHE_MB;
+	int ret = SUCCESS;
+	struct stat st;
+
+	if (stat(file, &st) != 0 || (size_t)st.st_size < index) return FAIL;
+	model->packed_size = st.st_size;
+	if (cs173_open_field(config, file, model->packed_size, &model->voxels, &model->voxels_status) != SUCCESS)
+		return FAIL;
+
+	if (model->voxels_status >= 2) {
+		model->brick_offsets = (unsigned long long *)model->voxels;
+	} else {
+		model->brick_offsets = malloc(index);
+		if (model->brick_offsets == NULL ||
+		    pread(fileno((FILE *)model->voxels), model->brick_offsets, index, 0) != (ssize_t)index)
+			ret = FAIL;
+	}
+
+	// Every brick must lie after the index, within the file.
+	for (i = 0; ret == SUCCESS && i < bricks; i++)
+		if (model->brick_offsets[i] < index || model->brick_offsets[i] > model->brick_offsets[i + 1])
+			ret = FAIL;
+	if (ret == SUCCESS && model->brick_offsets[bricks] > model->packed_size) ret = FAIL;
+
+	// The bricks get a cache of their own: one page is one brick, whatever the page cache uses.
+	if (ret == SUCCESS)
+		model->brick_cache = cs173_create_cache(config, budget, CS173_UNPACKED_BRICK_SIZE, &model->brick_cache_charge);
+	if (ret == SUCCESS && model->brick_cache == NULL) ret = FAIL;
+
+	if (ret != SUCCESS) {
+		cs173_print_error("Could not read the brick index of the compressed model file.");
+		if (model->voxels_status == 1) free(model->brick_offsets);
+		model->brick_offsets = NULL;
+		cs173_close_field(model->voxels, model->voxels_status, model->packed_size);
+		model->voxels = NULL;
+		model->voxels_status = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * Opens the given fields of a model found by cs173_find_model, storing each in memory,
+ * mapping it or leaving it on disk, and picks the stencil reader for what is open. A voxel file
+ * that cannot be opened is passed over for the next layout found, down to the planar files. A
+ * field that still cannot be opened is marked broken, and reads as -1.
+ *
+ * @param config The model configuration.
+ * @param directory The directory holding the model data files.
+ * @param model The model parameter struct.
+ * @param fields The CS173_FIELD_* bits of the fields to open, none of them open yet.
+ * @return 2 if all files opened are read to memory or mapped, SUCCESS if at least 1 is not in
+ * memory, FAIL if any could not be opened.
+ */
+static int cs173_load_model(cs173_configuration_t *config, const char *directory, cs173_model_t *model, int fields) {
+	const char *names[5] = { "vp", "vs", "density", "qp", "qs" };
+	void **data[5] = { &model->vp, &model->vs, &model->rho, &model->qp, &model->qs };
+	int *statuses[5] = { &model->vp_status, &model->vs_status, &model->rho_status, &model->qp_status, &model->qs_status };
+	int file_count = 0;
+	int all_read_to_memory = 0;
+	int paged = 0;
+	char current_file[128], error[192];
+	int i = 0;
+
+	fields &= model->present;
+
+	while (model->layout != CS173_LAYOUT_PLANAR && (fields & CS173_FIELD_VOXEL)) {
+		if (model->layout == CS173_LAYOUT_QUANTIZED) {
+			sprintf(current_file, "%s/%s", directory, CS173_QUANTIZED_FILE);
+			i = cs173_open_quantized(config, current_file, model);
+		} else if (model->layout == CS173_LAYOUT_COMPRESSED) {
+			sprintf(current_file, "%s/%s", directory, CS173_COMPRESSED_FILE);
+			i = cs173_open_compressed(config, current_file, model);
+		} else if (model->layout == CS173_LAYOUT_BRICKED) {
+			sprintf(current_file, "%s/%s", directory, CS173_BRICKED_FILE);
+			i = cs173_open_field(config, current_file, cs173_bricked_size(model), &model->voxels, &model->voxels_status);
 		} else {
-		    model->qp = fopen(current_file, "rb");
-		    model->qp_status = 1;
+			sprintf(current_file, "%s/%s", directory, CS173_INTERLEAVED_FILE);
+			i = cs173_open_field(config, current_file, 3 * model->field_size, &model->voxels, &model->voxels_status);
 		}
-		file_count++;
+		if (i == SUCCESS) {
+			if (model->voxels_status != 1) all_read_to_memory++;
+			else if (model->layout != CS173_LAYOUT_COMPRESSED) paged++;
+			file_count++;
+			break;
+		}
+
+		// Try the next layout there is, and the planar files if there is none.
+		fprintf(stderr, "WARNING: Could not open the model file %s, looking for another.\n", current_file);
+		model->failed_layouts |= 1 << model->layout;
+		cs173_find_layout(config, directory, model);
 	}
 
-	sprintf(current_file, "%s/qs.dat", cs173_iteration_directory);
-	if (access(current_file, R_OK) == 0) {
-                if( !too_big() ) { // only if fit
-		    model->qs = malloc(base_malloc);
-		    if (model->qs != NULL) {
-			// Read the model in.
-			fp = fopen(current_file, "rb");
-			fread(model->qs, 1, base_malloc, fp);
-                        all_read_to_memory++;
-			model->qs_status = 2;
-		    } else {
-			model->qs = fopen(current_file, "rb");
-			model->qs_status = 1;
-		    }
-		} else {
-		    model->qs = fopen(current_file, "rb");
-		    model->qs_status = 1;
+	for (i = 0; i < 5; i++) {
+		if (!(fields & (1 << i)) || (model->layout != CS173_LAYOUT_PLANAR && i < 3)) continue;
+		sprintf(current_file, "%s/%s.dat", directory, names[i]);
+		if (cs173_open_field(config, current_file, model->field_size, data[i], statuses[i]) != SUCCESS) {
+			sprintf(error, "Could not open the model file %s.", current_file);
+			cs173_print_error(error);
+			model->broken |= 1 << i;
+			continue;
 		}
+		if (*statuses[i] != 1) all_read_to_memory++;
+		else paged++;
 		file_count++;
 	}
 
-	if (file_count == 0)
+	// Fields left on disk are read through one page cache, set up with the first of them. The
+	// compressed file is not: its bricks are cached unpacked, in the brick cache.
+	if (paged > 0 && model->cache == NULL && config->page_cache > 0)
+		model->cache = cs173_create_cache(config, config->page_cache, CS173_CACHE_PAGE_SIZE, &model->cache_charge);
+
+	if (fields & CS173_FIELD_VOXEL) {
+		if (model->layout == CS173_LAYOUT_QUANTIZED && model->voxels_status >= 2)
+			model->read_stencil = cs173_read_stencil_quantized;
+		else if (model->layout == CS173_LAYOUT_COMPRESSED && model->voxels_status != 0)
+			model->read_stencil = cs173_read_stencil_compressed;
+		else if (model->layout != CS173_LAYOUT_PLANAR && model->voxels_status >= 2)
+			model->read_stencil = cs173_read_stencil_voxels;
+		else if (model->layout == CS173_LAYOUT_PLANAR && model->vp_status != 1 && model->vs_status != 1 && model->rho_status != 1)
+			model->read_stencil = cs173_read_stencil_planar;
+		else
+			model->read_stencil = cs173_read_stencil_generic;
+	}
+
+	if (file_count == 0 || (model->broken & fields))
 		return FAIL;
 	else if (file_count > 0 && all_read_to_memory != file_count)
 		return SUCCESS;
@@ -701,10 +3525,21 @@ int cs173_try_reading_model(cs173_model_t *model) {
  * @return Density, in g/m^3.
  **/
 double cs173_calculate_density(double vs) {
+        return cs173_vs_to_density(cs173_configuration, vs);
+}
+
+/**
+ * Calculates the density based off of Vs with the scaling coefficients of one configuration.
+ *
+ * @param config The model configuration holding p0 to p5.
+ * @param vs The Vs value off which to scale.
+ * @return Density, in g/m^3.
+ **/
+static double cs173_vs_to_density(cs173_configuration_t *config, double vs) {
         double retVal;
         vs = vs / 1000;
-        retVal = cs173_configuration->p0 + cs173_configuration->p1 * vs + cs173_configuration->p2 * pow(vs, 2) +
-                         cs173_configuration->p3 * pow(vs, 3) + cs173_configuration->p4 * pow(vs, 4) + cs173_configuration->p5 * pow(vs, 5);
+        retVal = config->p0 + config->p1 * vs + config->p2 * pow(vs, 2) +
+                         config->p3 * pow(vs, 3) + config->p4 * pow(vs, 4) + config->p5 * pow(vs, 5);
         retVal = retVal * 1000;
         return retVal;
 }
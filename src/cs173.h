@@ -8,6 +8,9 @@
  *
  */
 
+#ifndef CS173_H
+#define CS173_H
+
 // Includes
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +31,102 @@
 /** Defines a return value of failure */
 #define FAIL 1
 
+/** Model fields are read to memory if they fit, memory-mapped otherwise */
+#define CS173_STORAGE_AUTO 0
+/** Model fields are read to memory, or read from disk if they do not fit */
+#define CS173_STORAGE_MEMORY 1
+/** Model fields are memory-mapped read-only */
+#define CS173_STORAGE_MMAP 2
+/** Model fields are read from disk point by point */
+#define CS173_STORAGE_FILE 3
+
+/** Model data is stored as one planar file per field */
+#define CS173_LAYOUT_PLANAR 0
+/** Model data is stored as (vp, vs, rho) voxels in one file */
+#define CS173_LAYOUT_INTERLEAVED 1
+
+/** Model data is stored as (vp, vs, rho) voxels in Morton-ordered bricks in one file */
+#define CS173_LAYOUT_BRICKED 2
+/** Model data is stored as (vp, vs, rho) voxels bricked as above, each field quantized to 16 bits per brick */
+#define CS173_LAYOUT_QUANTIZED 3
+/** Model data is stored as (vp, vs, rho) voxels bricked as above, each brick packed losslessly on its own */
+#define CS173_LAYOUT_COMPRESSED 4
+
+/** Name of the interleaved (vp, vs, rho) voxel file within the model directory */
+#define CS173_INTERLEAVED_FILE "vp_vs_rho.dat"
+/** Name of the bricked (vp, vs, rho) voxel file within the model directory */
+#define CS173_BRICKED_FILE "vp_vs_rho_bricked.dat"
+/** Name of the quantized (vp, vs, rho) voxel file within the model directory */
+#define CS173_QUANTIZED_FILE "vp_vs_rho_quantized.dat"
+/** Name of the compressed (vp, vs, rho) voxel file within the model directory */
+#define CS173_COMPRESSED_FILE "vp_vs_rho_compressed.dat"
+
+/** Model fields are read at full precision */
+#define CS173_PRECISION_FULL 0
+/** Model fields are read from the quantized file, if the model has one */
+#define CS173_PRECISION_QUANTIZED 1
+/** Bit of the Vp field, in the masks of the fields to query and of the fields a model has */
+#define CS173_FIELD_VP 0x01
+/** Bit of the Vs field */
+#define CS173_FIELD_VS 0x02
+/** Bit of the density field */
+#define CS173_FIELD_RHO 0x04
+/** Bit of the Qp field */
+#define CS173_FIELD_QP 0x08
+/** Bit of the Qs field */
+#define CS173_FIELD_QS 0x10
+/** The fields held together by the interleaved and bricked voxels */
+#define CS173_FIELD_VOXEL (CS173_FIELD_VP | CS173_FIELD_VS | CS173_FIELD_RHO)
+/** Every field */
+#define CS173_FIELD_ALL 0x1f
+
+/** Log2 of the brick edge length */
+#define CS173_BRICK_SHIFT 4
+/** Brick edge length in voxels */
+#define CS173_BRICK_SIZE (1 << CS173_BRICK_SHIFT)
+/** Voxels per brick */
+#define CS173_BRICK_VOXELS (CS173_BRICK_SIZE * CS173_BRICK_SIZE * CS173_BRICK_SIZE)
+/** Largest quantized value; a brick's field is stored as offset + value * scale */
+#define CS173_QUANTIZED_MAX 65535
+
+/** Upper bound on the threads used to read one field into memory */
+#define CS173_MAX_LOAD_THREADS 16
+
+/** Number of points projected to UTM per pj_transform call in cs173_query */
+#define CS173_PROJECTION_BATCH 256
+
+/** Queries are sorted into file order if they read from disk and are large enough */
+#define CS173_ORDER_AUTO 0
+/** Queries of more than one batch are always sorted into file order */
+#define CS173_ORDER_SORTED 1
+/** Queries are served in the order given */
+#define CS173_ORDER_GIVEN 2
+
+/** Megabytes of model file pages cached for fields read from disk, unless configured otherwise */
+#define CS173_PAGE_CACHE_MB 256
+/** Fewest megabytes of unpacked bricks cached for the compressed layout, whatever page_cache says */
+#define CS173_BRICK_CACHE_MB 16
+
+/** Bytes per range of a model file prefetched when there is no page cache */
+#define CS173_PREFETCH_PAGE_SIZE 4096
+
+/** Queries are counted in cs173_stats_t */
+#define CS173_STATS_ON 0
+/** Queries are counted and each stage of them timed */
+#define CS173_STATS_TIMERS 1
+/** Queries are not counted */
+#define CS173_STATS_OFF 2
+
+/** Points queried at a time by cs173_extract_section, at least one row */
+#define CS173_SECTION_POINTS 16384
+/** Blocks of rows cs173_extract_section holds at once: one being queried, the rest being handed out */
+#define CS173_SECTION_SLOTS 2
+
+/** Fewest points of a query sorted into file order under CS173_ORDER_AUTO */
+#define CS173_SORT_MIN_POINTS 4096
+/** Bits of the key sorted on per radix sort pass */
+#define CS173_SORT_DIGIT_BITS 11
+
 // Structures
 /** Defines a point (latitude, longitude, and depth) in WGS84 format */
 typedef struct cs173_point_t {
@@ -53,6 +152,100 @@ typedef struct cs173_properties_t {
 	double qs;
 } cs173_properties_t;
 
+/**
+ * Defines a regular mesh of points. The mesh is regular in the model's UTM projection: its
+ * x axis points rotation degrees counterclockwise from east and its y axis 90 degrees further
+ * on. Points are numbered (k * ny + j) * nx + i, x fastest and depth slowest.
+ */
+typedef struct cs173_mesh_t {
+	/** Longitude of the mesh origin, point (0, 0, 0) */
+	double longitude;
+	/** Latitude of the mesh origin */
+	double latitude;
+	/** Depth of the top plane of the mesh, in meters */
+	double depth;
+	/** Spacing along the mesh x axis, in meters */
+	double dx;
+	/** Spacing along the mesh y axis, in meters */
+	double dy;
+	/** Spacing in depth, in meters */
+	double dz;
+	/** Angle of the mesh x axis counterclockwise from UTM east, in degrees */
+	double rotation;
+	/** Number of points along the mesh x axis */
+	int nx;
+	/** Number of points along the mesh y axis */
+	int ny;
+	/** Number of planes in depth */
+	int nz;
+} cs173_mesh_t;
+
+/**
+ * Defines a plane section of points, rows by columns, stepping regularly in the model's UTM
+ * projection and in depth. A map-view slice steps in easting and northing along both rows
+ * and columns; a vertical cross-section steps along a line in its columns and in depth in
+ * its rows.
+ */
+typedef struct cs173_section_t {
+	/** Longitude of the first point of the first row */
+	double longitude;
+	/** Latitude of the first point of the first row */
+	double latitude;
+	/** Depth of the first point of the first row, in meters */
+	double depth;
+	/** Easting step from one point of a row to the next, in meters */
+	double column_e;
+	/** Northing step from one point of a row to the next, in meters */
+	double column_n;
+	/** Depth step from one point of a row to the next, in meters */
+	double column_depth;
+	/** Easting step from one row to the next, in meters */
+	double row_e;
+	/** Northing step from one row to the next, in meters */
+	double row_n;
+	/** Depth step from one row to the next, in meters */
+	double row_depth;
+	/** Number of points in a row */
+	int columns;
+	/** Number of rows */
+	int rows;
+} cs173_section_t;
+
+/** Receives one row of a section; returns SUCCESS to go on, or anything else to stop. */
+typedef int (*cs173_section_callback_t)(void *arg, int row, const cs173_properties_t *data, int count);
+
+/**
+ * Counts what queries of a model did and, with stats = timers, how long they spent at each
+ * stage. The point counts cover cs173_query and the calls built on it; the reads and the
+ * Vs30 map searches cover every query.
+ */
+typedef struct cs173_stats_t {
+	/** Points queried */
+	unsigned long long points;
+	/** Points in the GTL */
+	unsigned long long gtl_points;
+	/** Points outside the model: off its box, above the surface or below the bottom */
+	unsigned long long outside_points;
+	/** Points served by the SIMD batch kernel */
+	unsigned long long batch_points;
+	/** Reads of model files issued by queries, one system call each */
+	unsigned long long reads;
+	/** Reads by queries served from the page cache instead */
+	unsigned long long cache_hits;
+	/** Ranges of model files queries asked the system to read ahead, one system call each */
+	unsigned long long prefetches;
+	/** Bytes read from model files by queries */
+	unsigned long long bytes_read;
+	/** Searches of the Vs30 map e-tree by queries */
+	unsigned long long vs30_searches;
+	/** Nanoseconds spent projecting points to UTM */
+	unsigned long long project_ns;
+	/** Nanoseconds spent reading and interpolating the model */
+	unsigned long long model_ns;
+	/** Nanoseconds spent blending the Vs30 map in the GTL */
+	unsigned long long gtl_ns;
+} cs173_stats_t;
+
 /** The CS173 configuration structure. */
 typedef struct cs173_configuration_t {
 	/** The zone of UTM projection */
@@ -105,32 +298,131 @@ typedef struct cs173_configuration_t {
         double p4;
         /** Brocher 2005 scaling polynomial coefficient 10^5 */
         double p5;
+	/** How the model fields are stored, one of the CS173_STORAGE_* modes */
+	int storage_mode;
+	/** Which precision the model fields are read at, one of the CS173_PRECISION_* settings */
+	int precision;
+	/** The madvise hint applied to memory-mapped fields */
+	int mmap_advice;
+	/** Memory budget for in-memory fields in megabytes, 0 for the node's physical memory */
+	long memory_limit;
+	/** Threads used to read fields into memory, 0 for one per CPU */
+	int load_threads;
+	/** Back in-memory fields with huge pages (1 or 0) */
+	int hugepages;
+	/** Which SIMD batch query kernel to allow, one of the CS173_SIMD_* settings */
+	int simd;
+	/** Workers a large query is split across, 0 or 1 for none, -1 for one per CPU */
+	int query_threads;
+	/** Read the Vs30 map over the model's footprint into memory at init (1 or 0) */
+	int vs30_raster;
+	/** Where the Vs30 raster is cached between runs: empty for the model directory, or off */
+	char vs30_cache[128];
+	/** Open every field and the Vs30 map at init (1), or each on the first query needing it (0) */
+	int eager_init;
+	/** Which order large queries are served in, one of the CS173_ORDER_* settings */
+	int query_order;
+	/** What queries count and time, one of the CS173_STATS_* settings */
+	int stats;
+	/** Print the query statistics when the model is closed (1 or 0) */
+	int stats_report;
+	/** Megabytes of pages cached for fields read from disk, 0 for none */
+	long page_cache;
+	/** Read ahead every page a batch of points will read from disk before reading any (1 or 0) */
+	int prefetch;
 } cs173_configuration_t;
 
+/** Linear addressing of the planar files: grid point (x, y, z) is sample origin + x * dx + y * dy + z * dz. */
+typedef struct cs173_strides_t {
+	/** Sample index of grid point (0, 0, 0) */
+	long origin;
+	/** Step between neighbouring samples in x */
+	long dx;
+	/** Step between neighbouring samples in y */
+	long dy;
+	/** Step between neighbouring samples in z */
+	long dz;
+} cs173_strides_t;
+
 /** The model structure which points to available portions of the model. */
 typedef struct cs173_model_t {
 	/** A pointer to the Vs data either in memory or disk. Null if does not exist. */
 	void *vs;
-	/** Vs status: 0 = not found, 1 = found and not in memory, 2 = found and in memory */
+	/** Vs status: 0 = not found, 1 = found and not in memory, 2 = found and in memory, 3 = found and memory-mapped */
 	int vs_status;
 	/** A pointer to the Vp data either in memory or disk. Null if does not exist. */
 	void *vp;
-	/** Vp status: 0 = not found, 1 = found and not in memory, 2 = found and in memory */
+	/** Vp status: 0 = not found, 1 = found and not in memory, 2 = found and in memory, 3 = found and memory-mapped */
 	int vp_status;
 	/** A pointer to the rho data either in memory or disk. Null if does not exist. */
 	void *rho;
-	/** Rho status: 0 = not found, 1 = found and not in memory, 2 = found and in memory */
+	/** Rho status: 0 = not found, 1 = found and not in memory, 2 = found and in memory, 3 = found and memory-mapped */
 	int rho_status;
 	/** A pointer to the Qp data either in memory or disk. Null if does not exist. */
 	void *qp;
-	/** Qp status: 0 = not found, 1 = found and not in memory, 2 = found and in memory */
+	/** Qp status: 0 = not found, 1 = found and not in memory, 2 = found and in memory, 3 = found and memory-mapped */
 	int qp_status;
 	/** A pointer to the Qs data either in memory or disk. Null if does not exist. */
 	void *qs;
-	/** Qs status: 0 = not found, 1 = found and not in memory, 2 = found and in memory */
+	/** Qs status: 0 = not found, 1 = found and not in memory, 2 = found and in memory, 3 = found and memory-mapped */
 	int qs_status;
+	/** A pointer to interleaved (vp, vs, rho) voxels either in memory or disk. Null if does not exist. */
+	void *voxels;
+	/** Voxels status: 0 = not found, 1 = found and not in memory, 2 = found and in memory, 3 = found and memory-mapped */
+	int voxels_status;
+	/** How the data is laid out, one of the CS173_LAYOUT_* values */
+	int layout;
+	/** The CS173_FIELD_* bits of the fields found in the model directory */
+	int present;
+	/** The CS173_FIELD_* bits of the fields opened so far, or found to be unreadable */
+	int ready;
+	/** The CS173_FIELD_* bits of the fields that were found but could not be opened */
+	int broken;
+	/** The CS173_LAYOUT_* bits of the voxel files that were found but could not be opened */
+	int failed_layouts;
+	/** Whether the warning that fields are read from disk has been printed */
+	int disk_warned;
+	/** Storage position of each brick of the bricked layout. Null if not bricked. */
+	int *brick_index;
+	/** Offset and scale of vp, vs and rho in each brick of the quantized layout, by storage position. Null if not quantized. */
+	float *brick_range;
+	/** Offset of each packed brick of the compressed layout and of its end, by storage position. Null if not compressed. */
+	unsigned long long *brick_offsets;
+	/** Size in bytes of the compressed voxel file */
+	size_t packed_size;
+	/** Number of bricks in x */
+	int brick_nx;
+	/** Number of bricks in y */
+	int brick_ny;
+	/** Number of bricks in z */
+	int brick_nz;
+	/** Size in bytes of each field */
+	size_t field_size;
+	/** Addressing of the planar and interleaved files, resolved from the configuration */
+	cs173_strides_t strides;
+	/** Offset of each stencil corner from the origin corner, for the planar and interleaved files */
+	long corner_delta[8];
+	/** Offset of each stencil corner from the origin corner within a brick */
+	long brick_delta[8];
+	/** Reads the eight grid points surrounding a point, specialised for the layout and storage */
+	void (*read_stencil)(struct cs173_model_t *model, int x, int y, int z, cs173_properties_t *eight_points, int fields);
+	/** Page cache of the fields read from disk, or NULL */
+	struct cs173_cache_t *cache;
+	/** Bytes of the memory budget charged for the page cache */
+	size_t cache_charge;
+	/** Cache of the unpacked bricks of the compressed layout, one brick per page, or NULL */
+	struct cs173_cache_t *brick_cache;
+	/** Bytes of the memory budget charged for the brick cache */
+	size_t brick_cache_charge;
+	/** Reads of the model files issued by queries */
+	unsigned long long reads;
+	/** Bytes read from the model files by queries */
+	unsigned long long bytes_read;
 } cs173_model_t;
 
+/** An opened model. Opaque; any number of threads may query the same handle. */
+typedef struct cs173_model_handle cs173_model_handle;
+
 
 // UCVM API Required Functions
 
@@ -163,16 +455,63 @@ int cs173_finalize();
 int cs173_version(char *ver, int len);
 /** Queries the model */
 int cs173_query(cs173_point_t *points, cs173_properties_t *data, int numpts);
+/** Queries the model for the given CS173_FIELD_* fields only */
+int cs173_query_fields(cs173_point_t *points, cs173_properties_t *data, int numpts, int fields);
+/** Extracts the given CS173_FIELD_* fields on a regular mesh, into a buffer or a file */
+int cs173_extract_mesh(const cs173_mesh_t *mesh, int fields, cs173_properties_t *data, FILE *fp);
+/** Queries the model down one vertical column */
+int cs173_query_profile(double longitude, double latitude, const double *depths, cs173_properties_t *data,
+                        int numdepths, int fields);
+/** Streams the model on a plane section to a callback, row by row */
+int cs173_extract_section(const cs173_section_t *section, int fields, cs173_section_callback_t callback, void *arg);
+/** Gets the query statistics of the model */
+int cs173_get_stats(cs173_stats_t *stats);
+/** Zeroes the query statistics of the model */
+int cs173_reset_stats();
+
+// Thread-safe Functions
+
+/** Opens a model, returning its handle or NULL */
+cs173_model_handle *cs173_open(const char *dir, const char *label);
+/** Queries a model through its handle, safe to call from several threads at once */
+int cs173_query_h(cs173_model_handle *handle, cs173_point_t *points, cs173_properties_t *data, int numpts);
+/** Queries a model through its handle for the given CS173_FIELD_* fields only */
+int cs173_query_fields_h(cs173_model_handle *handle, cs173_point_t *points, cs173_properties_t *data, int numpts, int fields);
+/** Extracts fields of a model on a regular mesh through its handle, into a buffer or a file */
+int cs173_extract_mesh_h(cs173_model_handle *handle, const cs173_mesh_t *mesh, int fields, cs173_properties_t *data,
+                         FILE *fp);
+/** Queries a model down one vertical column through its handle */
+int cs173_query_profile_h(cs173_model_handle *handle, double longitude, double latitude, const double *depths,
+                          cs173_properties_t *data, int numdepths, int fields);
+/** Streams a model on a plane section to a callback, row by row, through its handle */
+int cs173_extract_section_h(cs173_model_handle *handle, const cs173_section_t *section, int fields,
+                            cs173_section_callback_t callback, void *arg);
+/** Gets the query statistics of a model, summed over the threads that queried it */
+int cs173_get_stats_h(cs173_model_handle *handle, cs173_stats_t *stats);
+/** Zeroes the query statistics of a model */
+int cs173_reset_stats_h(cs173_model_handle *handle);
+/** Closes a model opened by cs173_open */
+int cs173_close(cs173_model_handle *handle);
 
 // Non-UCVM Helper Functions
 /** Reads the configuration file. */
-int read_configuration(char *file, cs173_configuration_t *config);
+int cs173_read_configuration(char *file, cs173_configuration_t *config);
 /** Prints out the error string. */
 void cs173_print_error(char *err);
 /** Retrieves the value at a specified grid point in the model. */
 void cs173_read_properties(int x, int y, int z, cs173_properties_t *data);
+/** Retrieves the eight grid points surrounding a point. */
+void cs173_read_stencil(int x, int y, int z, cs173_properties_t *eight_points);
+/** Resolves the configured seek axis and direction into strides. */
+void cs173_resolve_strides(cs173_configuration_t *config, cs173_strides_t *strides);
+/** Returns the voxel index of a grid point within the bricked or quantized voxel file. */
+long cs173_brick_location(cs173_model_t *model, int x, int y, int z);
+/** Builds the Morton storage order of the bricks of the bricked layout. */
+int *cs173_brick_order(int bnx, int bny, int bnz);
 /** Attempts to malloc the model size in memory and read it in. */
 int cs173_try_reading_model(cs173_model_t *model);
+/** Converts arrays of longitude/latitude (degrees) to UTM in place. */
+int cs173_lonlat_to_utm(double *x, double *y, int count);
 /** Calculates density from Vs. */
 double cs173_calculate_density(double vs);
 /** Calculates density from Vp. */
@@ -194,6 +533,8 @@ extern cs173_configuration_t *cs173_configuration;
 extern projPJ cs173_latlon;
 /** Proj.4 UTM projection holder. */
 extern projPJ cs173_utm;
+/** Proj.4 WGS84 UTM projection holder used to place query points in the model. */
+extern projPJ cs173_geo_utm;
 
 /** The cosine of the rotation angle used to rotate the box and point around the bottom-left corner. */
 extern double cs173_cos_rotation_angle;
@@ -205,3 +546,4 @@ extern double cs173_total_height_m;
 /** The width of this model's region, in meters. */
 extern double cs173_total_width_m;
 
+#endif
@@ -0,0 +1,343 @@
+/**
+ * @file cs173_cache.c
+ * @brief Lock-striped CLOCK page cache for the model files read from disk.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * cs173_read_sample reads fields left on disk through this cache. A page is identified by the
+ * file descriptor and its page number, and always lives in the same stripe, picked by hashing
+ * both. Each stripe has a fixed share of the frames, a chained hash table over them, and a
+ * CLOCK hand that evicts the first frame not referenced since the hand last passed it. Misses
+ * are filled with pread, or whatever fill function the reader passes, while the stripe is
+ * locked, so two threads missing on the same page fill it only once.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include "cs173.h"
+#include "cs173_cache.h"
+
+/** One frame of a stripe and the page it holds. */
+typedef struct cs173_cache_frame_t {
+	/** File descriptor, or other id, of the page's file, or -1 if the frame is empty */
+	int fd;
+	/** Set when the page is read, cleared as the CLOCK hand passes */
+	int referenced;
+	/** Page number within the file */
+	off_t page;
+	/** Bytes of the page that the file has */
+	size_t length;
+	/** Next frame in the same hash bucket, or -1 */
+	int next;
+} cs173_cache_frame_t;
+
+/** One independently locked part of the cache. */
+typedef struct cs173_cache_stripe_t {
+	/** Guards everything in the stripe */
+	pthread_mutex_t lock;
+	/** The frames */
+	cs173_cache_frame_t *frames;
+	/** The frames' pages, page_size bytes each */
+	char *data;
+	/** Bytes per page */
+	size_t page_size;
+	/** Number of frames */
+	int count;
+	/** First frame of each hash bucket, or -1 */
+	int *buckets;
+	/** Number of hash buckets, a power of two */
+	int nbuckets;
+	/** Next frame the CLOCK hand looks at */
+	int hand;
+	/** Reads served from a cached page */
+	unsigned long long hits;
+	/** Pages read from the file */
+	unsigned long long misses;
+	/** Bytes read from the file */
+	unsigned long long bytes;
+} cs173_cache_stripe_t;
+
+struct cs173_cache_t {
+	/** The stripes */
+	cs173_cache_stripe_t stripes[CS173_CACHE_STRIPES];
+};
+
+/**
+ * Hashes a page of a file. Neighbouring pages of a file land in different stripes.
+ *
+ * @param fd The file descriptor.
+ * @param page The page number.
+ */
+static inline unsigned long long cs173_cache_hash(int fd, off_t page) {
+	unsigned long long h = ((unsigned long long)page * 0x9E3779B97F4A7C15ULL) ^ ((unsigned long long)fd * 0xC2B2AE3D27D4EB4FULL);
+
+	return h ^ (h >> 29);
+}
+
+/**
+ * Fills a page of a file with pread. The cache's fill function for model files on disk.
+ *
+ * @param arg Unused; the file descriptor is all pread needs.
+ * @param fd The file descriptor.
+ * @param page The page number.
+ * @param buf Where the page goes.
+ * @param page_size Bytes per page.
+ * @return The bytes read, short at the end of the file, or -1 if the file could not be read.
+ */
+static ssize_t cs173_cache_pread(void *arg, int fd, off_t page, void *buf, size_t page_size) {
+	ssize_t got = 0;
+	size_t done = 0;
+
+	(void)arg;
+
+	while (done < page_size) {
+		got = pread(fd, (char *)buf + done, page_size - done, page * page_size + done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) return -1;
+		if (got == 0) break;
+		done += got;
+	}
+
+	return done;
+}
+
+/**
+ * Creates a page cache.
+ *
+ * @param budget The most bytes of pages to hold, split evenly across the stripes.
+ * @param page_size Bytes per page.
+ * @return The cache, or NULL if it could not be allocated.
+ */
+cs173_cache_t *cs173_cache_create(size_t budget, size_t page_size) {
+	cs173_cache_t *cache = calloc(1, sizeof(cs173_cache_t));
+	cs173_cache_stripe_t *stripe = NULL;
+	int count = budget / page_size / CS173_CACHE_STRIPES, i = 0, j = 0, ret = SUCCESS;
+
+	if (cache == NULL) return NULL;
+	if (count < 1) count = 1;
+
+	for (i = 0; i < CS173_CACHE_STRIPES; i++) {
+		stripe = &cache->stripes[i];
+		pthread_mutex_init(&stripe->lock, NULL);
+		stripe->count = count;
+		stripe->page_size = page_size;
+		for (stripe->nbuckets = 1; stripe->nbuckets < count; stripe->nbuckets <<= 1);
+		stripe->frames = malloc(count * sizeof(cs173_cache_frame_t));
+		stripe->buckets = malloc(stripe->nbuckets * sizeof(int));
+		// Pages are only touched as they are filled, so an unused budget costs no memory.
+		stripe->data = malloc((size_t)count * page_size);
+		if (stripe->frames == NULL || stripe->buckets == NULL || stripe->data == NULL) {
+			ret = FAIL;
+			continue;
+		}
+		for (j = 0; j < count; j++) {
+			stripe->frames[j].fd = -1;
+			stripe->frames[j].next = -1;
+		}
+		for (j = 0; j < stripe->nbuckets; j++) stripe->buckets[j] = -1;
+	}
+
+	if (ret != SUCCESS) {
+		cs173_cache_destroy(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+/**
+ * Finds a page in its stripe, filling it in over the frame the CLOCK hand picks if it is not
+ * there. The stripe must be locked.
+ *
+ * @param stripe The stripe the page belongs to.
+ * @param bucket The page's hash bucket within the stripe.
+ * @param fd The file descriptor, or other id of the file.
+ * @param page The page number.
+ * @param fill Fills the page if it is missing.
+ * @param arg Passed to fill.
+ * @return The frame holding the page, or -1 if it could not be filled.
+ */
+static int cs173_cache_page(cs173_cache_stripe_t *stripe, int bucket, int fd, off_t page, cs173_cache_fill_t fill,
+                            void *arg) {
+	cs173_cache_frame_t *frame = NULL;
+	int f = 0, *link = NULL;
+	ssize_t done = 0;
+
+	for (f = stripe->buckets[bucket]; f >= 0; f = stripe->frames[f].next) {
+		if (stripe->frames[f].fd == fd && stripe->frames[f].page == page) {
+			stripe->frames[f].referenced = 1;
+			stripe->hits++;
+			return f;
+		}
+	}
+
+	// Give every referenced frame a second chance on the way to the victim.
+	while (stripe->frames[stripe->hand].fd >= 0 && stripe->frames[stripe->hand].referenced) {
+		stripe->frames[stripe->hand].referenced = 0;
+		stripe->hand = (stripe->hand + 1) % stripe->count;
+	}
+	f = stripe->hand;
+	stripe->hand = (stripe->hand + 1) % stripe->count;
+	frame = &stripe->frames[f];
+
+	if (frame->fd >= 0) {
+		link = &stripe->buckets[cs173_cache_hash(frame->fd, frame->page) & (stripe->nbuckets - 1)];
+		while (*link != f) link = &stripe->frames[*link].next;
+		*link = frame->next;
+		frame->fd = -1;
+	}
+
+	done = fill(arg, fd, page, stripe->data + (size_t)f * stripe->page_size, stripe->page_size);
+	if (done < 0) return -1;
+	stripe->misses++;
+	stripe->bytes += done;
+
+	frame->fd = fd;
+	frame->page = page;
+	frame->length = done;
+	frame->referenced = 1;
+	frame->next = stripe->buckets[bucket];
+	stripe->buckets[bucket] = f;
+
+	return f;
+}
+
+/**
+ * Reads part of a file on disk through the cache, page by page. Safe to call from several
+ * threads at once.
+ *
+ * @param cache The cache.
+ * @param fd The file descriptor, which identifies the file while it stays open.
+ * @param buf Where the bytes go.
+ * @param size The number of bytes.
+ * @param offset Where the bytes start within the file.
+ * @return SUCCESS, or FAIL if the file could not be read or is too short.
+ */
+int cs173_cache_read(cs173_cache_t *cache, int fd, void *buf, size_t size, off_t offset) {
+	return cs173_cache_read_filled(cache, fd, cs173_cache_pread, NULL, buf, size, offset);
+}
+
+/**
+ * Reads part of a file through the cache, page by page, filling the pages it misses with the
+ * given function. Safe to call from several threads at once, as long as fill is.
+ *
+ * @param cache The cache.
+ * @param id Identifies the file among those read through the cache.
+ * @param fill Fills a missing page of the file.
+ * @param arg Passed to fill.
+ * @param buf Where the bytes go.
+ * @param size The number of bytes.
+ * @param offset Where the bytes start within the file.
+ * @return SUCCESS, or FAIL if a page could not be filled or is too short.
+ */
+int cs173_cache_read_filled(cs173_cache_t *cache, int id, cs173_cache_fill_t fill, void *arg, void *buf, size_t size,
+                            off_t offset) {
+	size_t page_size = cache->stripes[0].page_size;
+	cs173_cache_stripe_t *stripe = NULL;
+	unsigned long long hash = 0;
+	off_t page = 0;
+	size_t done = 0, within = 0, length = 0;
+	int f = 0, ret = SUCCESS;
+
+	while (done < size && ret == SUCCESS) {
+		page = (offset + done) / page_size;
+		within = (offset + done) % page_size;
+		length = page_size - within;
+		if (length > size - done) length = size - done;
+
+		hash = cs173_cache_hash(id, page);
+		stripe = &cache->stripes[(hash >> 32) % CS173_CACHE_STRIPES];
+		pthread_mutex_lock(&stripe->lock);
+		f = cs173_cache_page(stripe, hash & (stripe->nbuckets - 1), id, page, fill, arg);
+		if (f < 0 || stripe->frames[f].length < within + length)
+			ret = FAIL;
+		else
+			memcpy((char *)buf + done, stripe->data + (size_t)f * page_size + within, length);
+		pthread_mutex_unlock(&stripe->lock);
+		done += length;
+	}
+
+	return ret;
+}
+
+/**
+ * Returns whether a cache holds a page, without reading it in or counting a hit.
+ *
+ * @param cache The cache.
+ * @param fd The file descriptor.
+ * @param offset Any offset within the page.
+ * @return 1 if the page is cached, 0 if not.
+ */
+int cs173_cache_holds(cs173_cache_t *cache, int fd, off_t offset) {
+	off_t page = offset / cache->stripes[0].page_size;
+	unsigned long long hash = cs173_cache_hash(fd, page);
+	cs173_cache_stripe_t *stripe = &cache->stripes[(hash >> 32) % CS173_CACHE_STRIPES];
+	int f = 0, found = 0;
+
+	pthread_mutex_lock(&stripe->lock);
+	for (f = stripe->buckets[hash & (stripe->nbuckets - 1)]; f >= 0 && !found; f = stripe->frames[f].next)
+		found = (stripe->frames[f].fd == fd && stripe->frames[f].page == page);
+	pthread_mutex_unlock(&stripe->lock);
+
+	return found;
+}
+
+/**
+ * Gets the counts of a cache, summed over its stripes.
+ *
+ * @param cache The cache.
+ * @param hits Set to the reads served from a cached page.
+ * @param misses Set to the pages read from their file.
+ * @param bytes Set to the bytes read from the files.
+ */
+void cs173_cache_counts(cs173_cache_t *cache, unsigned long long *hits, unsigned long long *misses,
+                        unsigned long long *bytes) {
+	int i = 0;
+
+	*hits = *misses = *bytes = 0;
+	for (i = 0; i < CS173_CACHE_STRIPES; i++) {
+		pthread_mutex_lock(&cache->stripes[i].lock);
+		*hits += cache->stripes[i].hits;
+		*misses += cache->stripes[i].misses;
+		*bytes += cache->stripes[i].bytes;
+		pthread_mutex_unlock(&cache->stripes[i].lock);
+	}
+}
+
+/**
+ * Zeroes the counts of a cache. The cached pages stay.
+ *
+ * @param cache The cache.
+ */
+void cs173_cache_reset_counts(cs173_cache_t *cache) {
+	int i = 0;
+
+	for (i = 0; i < CS173_CACHE_STRIPES; i++) {
+		pthread_mutex_lock(&cache->stripes[i].lock);
+		cache->stripes[i].hits = 0;
+		cache->stripes[i].misses = 0;
+		cache->stripes[i].bytes = 0;
+		pthread_mutex_unlock(&cache->stripes[i].lock);
+	}
+}
+
+/**
+ * Frees a cache. No thread may be reading through it.
+ *
+ * @param cache The cache, or NULL.
+ */
+void cs173_cache_destroy(cs173_cache_t *cache) {
+	int i = 0;
+
+	if (cache == NULL) return;
+
+	for (i = 0; i < CS173_CACHE_STRIPES; i++) {
+		pthread_mutex_destroy(&cache->stripes[i].lock);
+		free(cache->stripes[i].frames);
+		free(cache->stripes[i].buckets);
+		free(cache->stripes[i].data);
+	}
+	free(cache);
+}
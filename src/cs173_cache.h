@@ -0,0 +1,50 @@
+/**
+ * @file cs173_cache.h
+ * @brief Page cache used internally for model files read from disk.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Holds fixed-size pages of the model files that are left on disk, so that queries landing
+ * near each other read a file once per page rather than once per sample. The cache is split
+ * into stripes, each with its own lock, table and CLOCK hand, so threads reading different
+ * parts of a model rarely wait on each other. The compressed layout caches its unpacked bricks
+ * the same way, as the pages of a file that exists only in the cache.
+ *
+ */
+
+#ifndef CS173_CACHE_H
+#define CS173_CACHE_H
+
+#include <sys/types.h>
+
+/** Bytes per cached page of a model file read from disk */
+#define CS173_CACHE_PAGE_SIZE 65536
+/** Number of independently locked stripes of the cache */
+#define CS173_CACHE_STRIPES 64
+
+/** A page cache. Opaque. */
+typedef struct cs173_cache_t cs173_cache_t;
+
+/** Fills page number page of the file id into buf; returns the bytes filled, or -1. */
+typedef ssize_t (*cs173_cache_fill_t)(void *arg, int id, off_t page, void *buf, size_t page_size);
+
+/** Creates a cache holding up to budget bytes of pages of page_size bytes, or returns NULL. */
+cs173_cache_t *cs173_cache_create(size_t budget, size_t page_size);
+/** Reads size bytes at offset of the file fd through the cache. */
+int cs173_cache_read(cs173_cache_t *cache, int fd, void *buf, size_t size, off_t offset);
+/** Reads size bytes at offset of the file id through the cache, filling missing pages with fill. */
+int cs173_cache_read_filled(cs173_cache_t *cache, int id, cs173_cache_fill_t fill, void *arg, void *buf, size_t size,
+                            off_t offset);
+/** Returns whether the cache holds the page of file fd at offset. */
+int cs173_cache_holds(cs173_cache_t *cache, int fd, off_t offset);
+/** Gets the page hits and misses of the cache, and the bytes read to fill the misses. */
+void cs173_cache_counts(cs173_cache_t *cache, unsigned long long *hits, unsigned long long *misses,
+                        unsigned long long *bytes);
+/** Zeroes the counts of the cache. */
+void cs173_cache_reset_counts(cs173_cache_t *cache);
+/** Frees the cache and its pages. */
+void cs173_cache_destroy(cs173_cache_t *cache);
+
+#endif
@@ -0,0 +1,106 @@
+/**
+ * @file cs173_codec.c
+ * @brief Lossless brick codec for the compressed model layout.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * cs173_convert packs the bricks of the compressed layout with cs173_pack_brick, and the
+ * library unpacks them with cs173_unpack_brick as queries first touch them. A packed brick
+ * holds vp, then vs, then rho. Each field starts with CS173_BRICK_VOXELS two-bit tags, four to
+ * a byte, followed by the low bytes of each value's residual, least significant first, as many
+ * as its tag says.
+ *
+ * Values are predicted from the two before them by extending the line through them, working
+ * on the bit patterns as integers: within a range of one exponent these grow with the value,
+ * so a smoothly varying field is predicted closely. The residual is the difference from the
+ * prediction, folded so that small negative differences are small too.
+ *
+ */
+
+#include <stdint.h>
+#include "cs173.h"
+#include "cs173_codec.h"
+
+/** Bytes kept of a value's residual, by tag */
+static const int cs173_tag_bytes[4] = { 0, 2, 3, 4 };
+
+/**
+ * Folds a difference of bit patterns into a residual: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+ */
+static inline uint32_t cs173_fold(uint32_t difference) {
+	return (difference << 1) ^ (uint32_t)-(difference >> 31);
+}
+
+/**
+ * Unfolds a residual back into a difference of bit patterns.
+ */
+static inline uint32_t cs173_unfold(uint32_t residual) {
+	return (residual >> 1) ^ (uint32_t)-(residual & 1);
+}
+
+/**
+ * Packs a brick of voxels.
+ *
+ * @param voxels The brick's CS173_BRICK_VOXELS (vp, vs, rho) voxels, x fastest.
+ * @param out Where the packed brick goes, CS173_PACKED_BRICK_MAX bytes.
+ * @return The size of the packed brick in bytes.
+ */
+size_t cs173_pack_brick(const float *voxels, unsigned char *out) {
+	unsigned char *tags = NULL;
+	uint32_t bits = 0, previous = 0, older = 0, delta = 0;
+	size_t size = 0;
+	int f = 0, i = 0, b = 0, tag = 0;
+
+	for (f = 0; f < 3; f++) {
+		tags = out + size;
+		memset(tags, 0, CS173_BRICK_VOXELS / 4);
+		size += CS173_BRICK_VOXELS / 4;
+		previous = older = 0;
+		for (i = 0; i < CS173_BRICK_VOXELS; i++) {
+			memcpy(&bits, &voxels[3 * i + f], sizeof(bits));
+			delta = cs173_fold(bits - (2 * previous - older));
+			older = previous;
+			previous = bits;
+			tag = (delta == 0) ? 0 : (delta < (1u << 16)) ? 1 : (delta < (1u << 24)) ? 2 : 3;
+			tags[i / 4] |= tag << (2 * (i % 4));
+			for (b = 0; b < cs173_tag_bytes[tag]; b++) out[size++] = (delta >> (8 * b)) & 0xff;
+		}
+	}
+
+	return size;
+}
+
+/**
+ * Unpacks a brick packed by cs173_pack_brick.
+ *
+ * @param in The packed brick.
+ * @param size The size of the packed brick in bytes.
+ * @param voxels Set to the brick's CS173_BRICK_VOXELS (vp, vs, rho) voxels.
+ * @return SUCCESS, or FAIL if the packed brick is too short or too long.
+ */
+int cs173_unpack_brick(const unsigned char *in, size_t size, float *voxels) {
+	const unsigned char *tags = NULL;
+	uint32_t bits = 0, previous = 0, older = 0, delta = 0;
+	size_t at = 0;
+	int f = 0, i = 0, b = 0, n = 0;
+
+	for (f = 0; f < 3; f++) {
+		if (size - at < CS173_BRICK_VOXELS / 4) return FAIL;
+		tags = in + at;
+		at += CS173_BRICK_VOXELS / 4;
+		previous = older = 0;
+		for (i = 0; i < CS173_BRICK_VOXELS; i++) {
+			n = cs173_tag_bytes[(tags[i / 4] >> (2 * (i % 4))) & 3];
+			if (size - at < (size_t)n) return FAIL;
+			for (b = 0, delta = 0; b < n; b++) delta |= (uint32_t)in[at++] << (8 * b);
+			bits = 2 * previous - older + cs173_unfold(delta);
+			older = previous;
+			previous = bits;
+			memcpy(&voxels[3 * i + f], &bits, sizeof(bits));
+		}
+	}
+
+	return (at == size) ? SUCCESS : FAIL;
+}
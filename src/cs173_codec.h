@@ -0,0 +1,32 @@
+/**
+ * @file cs173_codec.h
+ * @brief Lossless brick codec used internally for the compressed model layout.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Packs one brick of (vp, vs, rho) voxels, field by field. Each value is predicted from the two
+ * before it along x and only the low bytes of its residual are kept, with a two-bit tag per
+ * value saying how many. Velocity models vary smoothly and are often constant over whole
+ * layers, so most values cost two or three bytes, or nothing. Bricks are packed independently,
+ * so any one can be unpacked without the others.
+ *
+ */
+
+#ifndef CS173_CODEC_H
+#define CS173_CODEC_H
+
+#include <stddef.h>
+
+/** Bytes of one unpacked brick: CS173_BRICK_VOXELS (vp, vs, rho) voxels of floats */
+#define CS173_UNPACKED_BRICK_SIZE (CS173_BRICK_VOXELS * 3 * sizeof(float))
+/** Most bytes a packed brick can take: per field, the tags and four bytes per value */
+#define CS173_PACKED_BRICK_MAX (3 * (CS173_BRICK_VOXELS / 4 + CS173_BRICK_VOXELS * 4))
+
+/** Packs a brick of voxels into out, which holds CS173_PACKED_BRICK_MAX bytes; returns its size. */
+size_t cs173_pack_brick(const float *voxels, unsigned char *out);
+/** Unpacks a brick of size bytes into voxels, or returns FAIL if it is damaged. */
+int cs173_unpack_brick(const unsigned char *in, size_t size, float *voxels);
+
+#endif
@@ -0,0 +1,454 @@
+/**
+ * @file cs173_convert.c
+ * @brief Converts the CS173 planar data files to the alternative storage layouts.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * One-time conversion of vp.dat, vs.dat and density.dat into the layouts that
+ * cs173_try_reading_model picks up on its own when present in the model directory.
+ *
+ *   cs173_convert -d <model data dir> -f interleaved|bricked|quantized|compressed
+ *
+ * The quantized layout is lossy; its conversion reports the error it makes in each field.
+ *
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cs173.h"
+#include "cs173_codec.h"
+
+/** Samples converted per read of each planar file. */
+#define CONVERT_CHUNK (1024 * 1024)
+
+/**
+ * Prints the usage and exits.
+ */
+static void usage() {
+	printf("\n./cs173_convert -d [data dir] -f [interleaved|bricked|quantized|compressed]\n\n");
+	printf("-d - model data directory holding the config file.\n");
+	printf("-f - layout to convert the model to.\n");
+	printf("     interleaved: %s, (vp, vs, rho) per voxel.\n", CS173_INTERLEAVED_FILE);
+	printf("     bricked: %s, (vp, vs, rho) voxels in %d^3 Morton-ordered bricks.\n\n",
+	       CS173_BRICKED_FILE, CS173_BRICK_SIZE);
+	printf("     quantized: %s, bricked as above, 16 bits per field and voxel.\n", CS173_QUANTIZED_FILE);
+	printf("                Read with precision = quantized in the config file.\n");
+	printf("     compressed: %s, bricked as above, each brick packed losslessly.\n\n", CS173_COMPRESSED_FILE);
+	exit(1);
+}
+
+/**
+ * Writes vp, vs and rho side by side for each sample, in the planar files' order.
+ * A missing field is written as -1, as cs173_read_properties reports it.
+ *
+ * @param dir The directory holding the planar files.
+ * @param total The number of samples in each field.
+ * @return SUCCESS or FAIL.
+ */
+static int convert_interleaved(char *dir, size_t total) {
+	const char *names[3] = { "vp", "vs", "density" };
+	FILE *in[3] = { NULL, NULL, NULL }, *out = NULL;
+	float *planar = malloc(3 * CONVERT_CHUNK * sizeof(float));
+	float *voxels = malloc(3 * CONVERT_CHUNK * sizeof(float));
+	char file[512];
+	size_t done = 0, count = 0, i = 0;
+	int f = 0, ret = SUCCESS;
+
+	for (f = 0; f < 3; f++) {
+		sprintf(file, "%s/%s.dat", dir, names[f]);
+		in[f] = fopen(file, "rb");
+		if (in[f] == NULL) fprintf(stderr, "%s not found, writing -1 in its place.\n", file);
+	}
+	sprintf(file, "%s/%s", dir, CS173_INTERLEAVED_FILE);
+	out = fopen(file, "wb");
+
+	if (out == NULL || planar == NULL || voxels == NULL) {
+		fprintf(stderr, "Could not set up the conversion to %s.\n", file);
+		ret = FAIL;
+	}
+
+	while (ret == SUCCESS && done < total) {
+		count = (total - done < CONVERT_CHUNK) ? total - done : CONVERT_CHUNK;
+		for (f = 0; f < 3; f++) {
+			if (in[f] == NULL) {
+				for (i = 0; i < count; i++) planar[f * CONVERT_CHUNK + i] = -1;
+			} else if (fread(&planar[f * CONVERT_CHUNK], sizeof(float), count, in[f]) != count) {
+				fprintf(stderr, "%s.dat is shorter than nx * ny * nz.\n", names[f]);
+				ret = FAIL;
+			}
+		}
+		for (i = 0; i < count; i++) {
+			voxels[3 * i]     = planar[i];
+			voxels[3 * i + 1] = planar[CONVERT_CHUNK + i];
+			voxels[3 * i + 2] = planar[2 * CONVERT_CHUNK + i];
+		}
+		if (ret == SUCCESS && fwrite(voxels, sizeof(float), 3 * count, out) != 3 * count) {
+			fprintf(stderr, "Could not write %s.\n", file);
+			ret = FAIL;
+		}
+		done += count;
+	}
+
+	for (f = 0; f < 3; f++)
+		if (in[f] != NULL) fclose(in[f]);
+	if (out != NULL && fclose(out) != 0) ret = FAIL;
+	if (ret != SUCCESS) unlink(file);
+	free(planar);
+	free(voxels);
+
+	return ret;
+}
+
+/**
+ * Maps one planar field file read-only.
+ *
+ * @param file The field file.
+ * @param size The expected size of the field in bytes.
+ * @return The mapping, or NULL if the file is missing or too short.
+ */
+static float *map_field(char *file, size_t size) {
+	struct stat st;
+	void *ptr = MAP_FAILED;
+	int fd = open(file, O_RDONLY);
+
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= size)
+		ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return ptr == MAP_FAILED ? NULL : (float *)ptr;
+}
+
+/**
+ * Gathers one brick of (vp, vs, rho) voxels from the planar fields. Voxels past the end of
+ * the grid are zero and left out of the inside mask.
+ *
+ * @param in The mapped planar fields, NULL for a missing one.
+ * @param config The model configuration.
+ * @param strides The addressing of the planar fields.
+ * @param bx The brick's x index.
+ * @param by The brick's y index.
+ * @param bz The brick's z index.
+ * @param brick Set to the voxels, CS173_BRICK_VOXELS * 3 floats.
+ * @param inside Set to 1 for each voxel on the grid, 0 for the others, unless NULL.
+ */
+static void gather_brick(float **in, cs173_configuration_t *config, cs173_strides_t *strides, int bx, int by, int bz,
+                         float *brick, unsigned char *inside) {
+	int x = 0, y = 0, z = 0, f = 0;
+	long location = 0, voxel = 0;
+
+	memset(brick, 0, CS173_BRICK_VOXELS * 3 * sizeof(float));
+	if (inside != NULL) memset(inside, 0, CS173_BRICK_VOXELS);
+	for (z = bz * CS173_BRICK_SIZE; z < (bz + 1) * CS173_BRICK_SIZE && z < config->nz; z++) {
+		for (y = by * CS173_BRICK_SIZE; y < (by + 1) * CS173_BRICK_SIZE && y < config->ny; y++) {
+			for (x = bx * CS173_BRICK_SIZE; x < (bx + 1) * CS173_BRICK_SIZE && x < config->nx; x++) {
+				location = strides->origin + x * strides->dx + y * strides->dy + z * strides->dz;
+				voxel = ((z % CS173_BRICK_SIZE) * CS173_BRICK_SIZE + (y % CS173_BRICK_SIZE)) *
+				        CS173_BRICK_SIZE + (x % CS173_BRICK_SIZE);
+				for (f = 0; f < 3; f++)
+					brick[3 * voxel + f] = (in[f] == NULL) ? -1 : in[f][location];
+				if (inside != NULL) inside[voxel] = 1;
+			}
+		}
+	}
+}
+
+/**
+ * Writes the model as bricks of (vp, vs, rho) voxels, placing each brick at the position
+ * cs173_brick_order gives it. Voxels of edge bricks past the end of the grid are zero.
+ *
+ * @param dir The directory holding the planar files.
+ * @param config The model configuration.
+ * @return SUCCESS or FAIL.
+ */
+static int convert_bricked(char *dir, cs173_configuration_t *config) {
+	const char *names[3] = { "vp", "vs", "density" };
+	size_t size = (size_t)config->nx * config->ny * config->nz * sizeof(float);
+	int bnx = (config->nx + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	int bny = (config->ny + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	int bnz = (config->nz + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	int *order = cs173_brick_order(bnx, bny, bnz);
+	float *in[3] = { NULL, NULL, NULL };
+	float *brick = malloc(CS173_BRICK_VOXELS * 3 * sizeof(float));
+	size_t brick_bytes = CS173_BRICK_VOXELS * 3 * sizeof(float);
+	char file[512];
+	int bx = 0, by = 0, bz = 0, f = 0, fd = -1, ret = SUCCESS;
+	cs173_strides_t strides;
+
+	cs173_resolve_strides(config, &strides);
+
+	for (f = 0; f < 3; f++) {
+		sprintf(file, "%s/%s.dat", dir, names[f]);
+		in[f] = map_field(file, size);
+		if (in[f] == NULL) fprintf(stderr, "%s not found, writing -1 in its place.\n", file);
+	}
+	sprintf(file, "%s/%s", dir, CS173_BRICKED_FILE);
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0 || order == NULL || brick == NULL) {
+		fprintf(stderr, "Could not set up the conversion to %s.\n", file);
+		ret = FAIL;
+	}
+
+	for (bz = 0; ret == SUCCESS && bz < bnz; bz++) {
+		for (bx = 0; ret == SUCCESS && bx < bnx; bx++) {
+			for (by = 0; ret == SUCCESS && by < bny; by++) {
+				gather_brick(in, config, &strides, bx, by, bz, brick, NULL);
+				if (pwrite(fd, brick, brick_bytes,
+				           (off_t)order[((long)bz * bny + by) * bnx + bx] * brick_bytes) != (ssize_t)brick_bytes) {
+					fprintf(stderr, "Could not write %s.\n", file);
+					ret = FAIL;
+				}
+			}
+		}
+	}
+
+	for (f = 0; f < 3; f++)
+		if (in[f] != NULL) munmap(in[f], size);
+	if (fd >= 0 && close(fd) != 0) ret = FAIL;
+	if (ret != SUCCESS) unlink(file);
+	free(order);
+	free(brick);
+
+	return ret;
+}
+
+/**
+ * Writes the model as bricks of (vp, vs, rho) voxels like convert_bricked, but with each field
+ * of a brick stored as 16-bit steps between its smallest and largest value there. The offset
+ * (smallest value) and scale (step) of the three fields of every brick follow the voxels, in
+ * the bricks' storage order. Reports the error this makes in each field, which is at most half
+ * of the largest step.
+ *
+ * @param dir The directory holding the planar files.
+ * @param config The model configuration.
+ * @return SUCCESS or FAIL.
+ */
+static int convert_quantized(char *dir, cs173_configuration_t *config) {
+	const char *names[3] = { "vp", "vs", "density" };
+	size_t size = (size_t)config->nx * config->ny * config->nz * sizeof(float);
+	int bnx = (config->nx + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	int bny = (config->ny + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	int bnz = (config->nz + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	int *order = cs173_brick_order(bnx, bny, bnz);
+	float *in[3] = { NULL, NULL, NULL };
+	float *brick = malloc(CS173_BRICK_VOXELS * 3 * sizeof(float));
+	uint16_t *quantized = malloc(CS173_BRICK_VOXELS * 3 * sizeof(uint16_t));
+	unsigned char *inside = malloc(CS173_BRICK_VOXELS);
+	size_t brick_bytes = CS173_BRICK_VOXELS * 3 * sizeof(uint16_t);
+	off_t ranges = (off_t)bnx * bny * bnz * brick_bytes;
+	double max_error[3] = { 0, 0, 0 }, max_relative[3] = { 0, 0, 0 }, sum_squares[3] = { 0, 0, 0 };
+	double bound[3] = { 0, 0, 0 }, error = 0;
+	float low = 0, high = 0, range[6], value = 0;
+	size_t samples = 0;
+	char file[512];
+	int bx = 0, by = 0, bz = 0, f = 0, fd = -1, ret = SUCCESS;
+	long voxel = 0, q = 0, position = 0;
+	cs173_strides_t strides;
+
+	cs173_resolve_strides(config, &strides);
+
+	for (f = 0; f < 3; f++) {
+		sprintf(file, "%s/%s.dat", dir, names[f]);
+		in[f] = map_field(file, size);
+		if (in[f] == NULL) fprintf(stderr, "%s not found, writing -1 in its place.\n", file);
+	}
+	sprintf(file, "%s/%s", dir, CS173_QUANTIZED_FILE);
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0 || order == NULL || brick == NULL || quantized == NULL || inside == NULL) {
+		fprintf(stderr, "Could not set up the conversion to %s.\n", file);
+		ret = FAIL;
+	}
+
+	for (bz = 0; ret == SUCCESS && bz < bnz; bz++) {
+		for (bx = 0; ret == SUCCESS && bx < bnx; bx++) {
+			for (by = 0; ret == SUCCESS && by < bny; by++) {
+				gather_brick(in, config, &strides, bx, by, bz, brick, inside);
+				memset(quantized, 0, brick_bytes);
+
+				for (f = 0; f < 3; f++) {
+					low = high = 0;
+					for (voxel = 0, q = 0; voxel < CS173_BRICK_VOXELS; voxel++) {
+						if (!inside[voxel]) continue;
+						value = brick[3 * voxel + f];
+						if (q++ == 0 || value < low) low = value;
+						if (q == 1 || value > high) high = value;
+					}
+					range[2 * f] = low;
+					range[2 * f + 1] = (high - low) / CS173_QUANTIZED_MAX;
+					if (range[2 * f + 1] / 2 > bound[f]) bound[f] = range[2 * f + 1] / 2;
+
+					for (voxel = 0; voxel < CS173_BRICK_VOXELS; voxel++) {
+						if (!inside[voxel]) continue;
+						value = brick[3 * voxel + f];
+						q = (range[2 * f + 1] > 0) ? lrint((value - low) / range[2 * f + 1]) : 0;
+						if (q < 0) q = 0;
+						if (q > CS173_QUANTIZED_MAX) q = CS173_QUANTIZED_MAX;
+						quantized[3 * voxel + f] = q;
+
+						// Measure the error as the library will see it.
+						error = fabs((float)(range[2 * f] + quantized[3 * voxel + f] * range[2 * f + 1]) - value);
+						if (error > max_error[f]) max_error[f] = error;
+						if (value != 0 && error / fabs(value) > max_relative[f]) max_relative[f] = error / fabs(value);
+						sum_squares[f] += error * error;
+					}
+				}
+				for (voxel = 0; voxel < CS173_BRICK_VOXELS; voxel++) samples += inside[voxel];
+
+				position = order[((long)bz * bny + by) * bnx + bx];
+				if (pwrite(fd, quantized, brick_bytes, (off_t)position * brick_bytes) != (ssize_t)brick_bytes ||
+				    pwrite(fd, range, sizeof(range), ranges + (off_t)position * sizeof(range)) != (ssize_t)sizeof(range)) {
+					fprintf(stderr, "Could not write %s.\n", file);
+					ret = FAIL;
+				}
+			}
+		}
+	}
+
+	if (ret == SUCCESS) {
+		printf("Quantization error over %zu samples:\n", samples);
+		printf("  %-8s %14s %14s %14s %14s\n", "field", "max", "max relative", "rms", "bound");
+		for (f = 0; f < 3; f++)
+			printf("  %-8s %14.6g %14.6g %14.6g %14.6g\n", names[f], max_error[f], max_relative[f],
+			       samples > 0 ? sqrt(sum_squares[f] / samples) : 0, bound[f]);
+	}
+
+	for (f = 0; f < 3; f++)
+		if (in[f] != NULL) munmap(in[f], size);
+	if (fd >= 0 && close(fd) != 0) ret = FAIL;
+	if (ret != SUCCESS) unlink(file);
+	free(order);
+	free(brick);
+	free(quantized);
+	free(inside);
+
+	return ret;
+}
+
+/**
+ * Writes the model as bricks of (vp, vs, rho) voxels like convert_bricked, but with each brick
+ * packed by cs173_pack_brick and written straight after the one before it in storage order.
+ * The file starts with the offset of each packed brick, in storage order, and of the end of the
+ * last one. Every brick is unpacked again and checked against the model before it is written.
+ *
+ * @param dir The directory holding the planar files.
+ * @param config The model configuration.
+ * @return SUCCESS or FAIL.
+ */
+static int convert_compressed(char *dir, cs173_configuration_t *config) {
+	const char *names[3] = { "vp", "vs", "density" };
+	size_t size = (size_t)config->nx * config->ny * config->nz * sizeof(float);
+	int bnx = (config->nx + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	int bny = (config->ny + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	int bnz = (config->nz + CS173_BRICK_SIZE - 1) / CS173_BRICK_SIZE;
+	long bricks = (long)bnx * bny * bnz, b = 0, brick = 0;
+	int *order = cs173_brick_order(bnx, bny, bnz);
+	long *stored = malloc(bricks * sizeof(long));
+	unsigned long long *offsets = malloc((bricks + 1) * sizeof(unsigned long long));
+	float *in[3] = { NULL, NULL, NULL };
+	float *voxels = malloc(CS173_UNPACKED_BRICK_SIZE), *check = malloc(CS173_UNPACKED_BRICK_SIZE);
+	unsigned char *packed = malloc(CS173_PACKED_BRICK_MAX);
+	size_t length = 0;
+	char file[512];
+	int f = 0, fd = -1, ret = SUCCESS;
+	cs173_strides_t strides;
+
+	cs173_resolve_strides(config, &strides);
+
+	for (f = 0; f < 3; f++) {
+		sprintf(file, "%s/%s.dat", dir, names[f]);
+		in[f] = map_field(file, size);
+		if (in[f] == NULL) fprintf(stderr, "%s not found, writing -1 in its place.\n", file);
+	}
+	sprintf(file, "%s/%s", dir, CS173_COMPRESSED_FILE);
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0 || order == NULL || stored == NULL || offsets == NULL || voxels == NULL || check == NULL || packed == NULL) {
+		fprintf(stderr, "Could not set up the conversion to %s.\n", file);
+		ret = FAIL;
+	}
+
+	// Which brick goes at each storage position.
+	for (brick = 0; ret == SUCCESS && brick < bricks; brick++) stored[order[brick]] = brick;
+
+	offsets[0] = (bricks + 1) * sizeof(unsigned long long);
+	for (b = 0; ret == SUCCESS && b < bricks; b++) {
+		brick = stored[b];
+		gather_brick(in, config, &strides, brick % bnx, (brick / bnx) % bny, brick / ((long)bnx * bny), voxels, NULL);
+		length = cs173_pack_brick(voxels, packed);
+		if (cs173_unpack_brick(packed, length, check) != SUCCESS || memcmp(voxels, check, CS173_UNPACKED_BRICK_SIZE) != 0) {
+			fprintf(stderr, "Brick %ld does not unpack to what was packed.\n", brick);
+			ret = FAIL;
+		} else if (pwrite(fd, packed, length, offsets[b]) != (ssize_t)length) {
+			fprintf(stderr, "Could not write %s.\n", file);
+			ret = FAIL;
+		}
+		offsets[b + 1] = offsets[b] + length;
+	}
+
+	if (ret == SUCCESS && pwrite(fd, offsets, (bricks + 1) * sizeof(unsigned long long), 0) !=
+	                      (ssize_t)((bricks + 1) * sizeof(unsigned long long))) {
+		fprintf(stderr, "Could not write %s.\n", file);
+		ret = FAIL;
+	}
+	if (ret == SUCCESS)
+		printf("Packed %zu bytes of fields into %llu bytes (%.2f to 1).\n", 3 * size, offsets[bricks],
+		       (double)3 * size / offsets[bricks]);
+
+	for (f = 0; f < 3; f++)
+		if (in[f] != NULL) munmap(in[f], size);
+	if (fd >= 0 && close(fd) != 0) ret = FAIL;
+	if (ret != SUCCESS) unlink(file);
+	free(order);
+	free(stored);
+	free(offsets);
+	free(voxels);
+	free(check);
+	free(packed);
+
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	cs173_configuration_t *config = calloc(1, sizeof(cs173_configuration_t));
+	char *data_dir = NULL, *format = NULL;
+	char file[256], model_dir[256];
+	size_t total = 0;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "d:f:")) != -1) {
+		switch (opt) {
+		case 'd': data_dir = optarg; break;
+		case 'f': format = optarg; break;
+		default: usage();
+		}
+	}
+	if (data_dir == NULL || format == NULL) usage();
+
+	sprintf(file, "%s/config", data_dir);
+	if (cs173_read_configuration(file, config) != SUCCESS) return 1;
+	sprintf(model_dir, "%s/%s", data_dir, config->model_dir);
+	total = (size_t)config->nx * config->ny * config->nz;
+
+	if (strcmp(format, "interleaved") == 0) {
+		if (convert_interleaved(model_dir, total) != SUCCESS) return 1;
+	} else if (strcmp(format, "bricked") == 0) {
+		if (convert_bricked(model_dir, config) != SUCCESS) return 1;
+	} else if (strcmp(format, "quantized") == 0) {
+		if (convert_quantized(model_dir, config) != SUCCESS) return 1;
+	} else if (strcmp(format, "compressed") == 0) {
+		if (convert_compressed(model_dir, config) != SUCCESS) return 1;
+	} else {
+		usage();
+	}
+
+	printf("Converted %s to %s.\n", model_dir, format);
+	free(config);
+	return 0;
+}
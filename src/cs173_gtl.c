@@ -5,8 +5,12 @@
  *
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cs173.h"
 #include "cs173_gtl.h"
+#include "cs173_handle.h"
 
 /** Location of the ucvm.e e-tree file. */
 char cs173_vs30_etree_file[128];
@@ -22,6 +26,25 @@ double cs173_cos_vs30_rotation_angle = 0;
 /** The sine of the Vs30 map's rotation. */
 double cs173_sin_vs30_rotation_angle = 0;
 
+static double cs173_vs30_sample(cs173_vs30_map_config_t *map, double offset_e, double offset_n,
+                                double cos_rotation, double sin_rotation, pthread_mutex_t *lock);
+
+/**
+ * Returns the e-tree address of map sample loc along one axis, pulled back onto the last
+ * sample at the far edge of the map.
+ *
+ * @param map The Vs30 map structure.
+ * @param loc The sample index along the axis.
+ * @param ticks The number of e-tree ticks along the axis.
+ */
+static etree_tick_t cs173_vs30_tick(cs173_vs30_map_config_t *map, int loc, etree_tick_t ticks) {
+	etree_tick_t tick = loc * map->edgetics;
+
+	/* Adjust addresses for edges of grid */
+	if (tick >= ticks) tick = ticks - map->edgetics;
+	return tick;
+}
+
 
 /**
  * Reads the format of the Vs30 data e-tree. This file location is typically specified
@@ -32,10 +55,23 @@ double cs173_sin_vs30_rotation_angle = 0;
  */
 int cs173_read_vs30_map(char *filename, cs173_vs30_map_config_t *map) {
 	char appmeta[512];
-	char *token;
-	int index = 0, retVal = 0;
+	char *token, *saveptr = NULL;
+	int index = 0, retVal = 0, max_level = 0;
+	struct stat st;
+	const char *meta = NULL;
 	map->vs30_map = etree_open(filename, O_RDONLY, 64, 0, 3);
-	retVal = snprintf(appmeta, sizeof(appmeta), "%s", etree_getappmeta(map->vs30_map));
+	meta = etree_getappmeta(map->vs30_map);
+	retVal = snprintf(appmeta, sizeof(appmeta), "%s", meta);
+
+	// Anything derived from the map, such as a cached raster, is tied to this e-tree by its
+	// size, modification time and metadata (64-bit FNV-1a).
+	if (stat(filename, &st) == 0) {
+		map->etree_size = st.st_size;
+		map->etree_mtime = st.st_mtime;
+	}
+	map->appmeta_hash = 14695981039346656037ULL;
+	for (; meta != NULL && *meta != '\0'; meta++)
+		map->appmeta_hash = (map->appmeta_hash ^ (unsigned char)*meta) * 1099511628211ULL;
 
 	if (retVal >= 0 && retVal < 128) {
 		return FAIL;
@@ -43,7 +79,7 @@ int cs173_read_vs30_map(char *filename, cs173_vs30_map_config_t *map) {
 
 	// Now we need to parse the map cs173_configuration.
 	index = 0;
-	token = strtok(appmeta, "|");
+	token = strtok_r(appmeta, "|", &saveptr);
 
 	while (token != NULL) {
 		switch (index) {
@@ -87,9 +123,14 @@ int cs173_read_vs30_map(char *filename, cs173_vs30_map_config_t *map) {
 	    	break;
 		}
 	    index++;
-	    token = strtok(NULL, "|");
+	    token = strtok_r(NULL, "|", &saveptr);
 	}
 
+	// The sample spacing within the e-tree only depends on the map, so work it out once here.
+	max_level = ceil(log(map->x_dimension / map->spacing) / log(2.0));
+	map->edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - max_level);
+	map->edge_size = map->x_dimension / (double)((etree_tick_t)1<<max_level);
+
 	return SUCCESS;
 
 }
@@ -107,57 +148,93 @@ double cs173_get_vs30_value(double longitude, double latitude, cs173_vs30_map_co
 	// Convert both points to UTM.
 	double longitude_utm_e = longitude * DEG_TO_RAD;
 	double latitude_utm_n = latitude * DEG_TO_RAD;
-	double vs30_long_utm_e = map->origin_point.longitude * DEG_TO_RAD;
-	double vs30_lat_utm_n = map->origin_point.latitude * DEG_TO_RAD;
-	double temp_rotated_point_n = 0.0, temp_rotated_point_e = 0.0;
-	double rotated_point_n = 0.0, rotated_point_e = 0.0;
-	double percent = 0.0;
-	int loc_x = 0, loc_y = 0;
-	etree_addr_t addr;
-	cs173_vs30_mpayload_t vs30_payload[4];
-
-	int max_level = ceil(log(map->x_dimension / map->spacing) / log(2.0));
+	double vs30_long_utm_e = 0, vs30_lat_utm_n = 0;
 
-	etree_tick_t edgetics = (etree_tick_t)1 << (ETREE_MAXLEVEL - max_level);
-	double map_edgesize = map->x_dimension / (double)((etree_tick_t)1<<max_level);
+	// The default handle may not have needed its Vs30 map yet.
+	if (map == cs173_vs30_map && cs173_ensure_gtl(cs173_default_handle) != SUCCESS) return -1;
+	vs30_long_utm_e = map->origin_point.longitude * DEG_TO_RAD;
+	vs30_lat_utm_n = map->origin_point.latitude * DEG_TO_RAD;
 
 	pj_transform(cs173_latlon, cs173_aeqd, 1, 1, &longitude_utm_e, &latitude_utm_n, NULL);
 	pj_transform(cs173_latlon, cs173_aeqd, 1, 1, &vs30_long_utm_e, &vs30_lat_utm_n, NULL);
 
-	// Now that both are in UTM, we can subtract and rotate.
-	temp_rotated_point_e = longitude_utm_e - vs30_long_utm_e;
-	temp_rotated_point_n = latitude_utm_n - vs30_lat_utm_n;
+	return cs173_vs30_sample(map, longitude_utm_e - vs30_long_utm_e, latitude_utm_n - vs30_lat_utm_n,
+	                         cs173_cos_vs30_rotation_angle, cs173_sin_vs30_rotation_angle, NULL);
+}
 
-	rotated_point_e = cs173_cos_vs30_rotation_angle * temp_rotated_point_e - cs173_sin_vs30_rotation_angle * temp_rotated_point_n;
-	rotated_point_n = cs173_sin_vs30_rotation_angle * temp_rotated_point_e + cs173_cos_vs30_rotation_angle * temp_rotated_point_n;
+/**
+ * Gets the Vs30 value at a point of a model handle's Vs30 map, projecting with the calling
+ * thread's projections. Safe to call from several threads at once.
+ *
+ * @param handle The model handle.
+ * @param longitude The longitude in WGS84 format.
+ * @param latitude The latitude in WGS84 format.
+ * @return The Vs30 value at that point, or -1 if outside the boundaries.
+ */
+double cs173_get_vs30_value_h(cs173_model_handle *handle, double longitude, double latitude) {
+	cs173_thread_t *thread = cs173_thread_state(handle);
+	double point_e = longitude * DEG_TO_RAD, point_n = latitude * DEG_TO_RAD;
+
+	if (thread == NULL || cs173_thread_gtl(handle, thread) != SUCCESS) return -1;
+	pj_transform(thread->latlon, thread->aeqd, 1, 1, &point_e, &point_n, NULL);
+
+	return cs173_vs30_sample(handle->vs30_map, point_e - handle->vs30_map->origin_e, point_n - handle->vs30_map->origin_n,
+	                         handle->cos_vs30_rotation_angle, handle->sin_vs30_rotation_angle, &handle->vs30_lock);
+}
+
+/**
+ * Reads the four e-tree samples around a point of the Vs30 map and interpolates them.
+ *
+ * @param map The Vs30 map structure.
+ * @param offset_e Easting of the point from the map origin, in the map projection.
+ * @param offset_n Northing of the point from the map origin, in the map projection.
+ * @param cos_rotation The cosine of the map's rotation.
+ * @param sin_rotation The sine of the map's rotation.
+ * @param lock Held around the e-tree searches, or NULL.
+ * @return The Vs30 value at that point, or -1 if outside the boundaries.
+ */
+static double cs173_vs30_sample(cs173_vs30_map_config_t *map, double offset_e, double offset_n,
+                                double cos_rotation, double sin_rotation, pthread_mutex_t *lock) {
+	double rotated_point_n = 0.0, rotated_point_e = 0.0;
+	double percent = 0.0;
+	int loc_x = 0, loc_y = 0;
+	etree_addr_t addr;
+	cs173_vs30_mpayload_t vs30_payload[4];
+	const float *cell = NULL;
+	int i = 0;
+
+	// Rotate into the map.
+	rotated_point_e = cos_rotation * offset_e - sin_rotation * offset_n;
+	rotated_point_n = sin_rotation * offset_e + cos_rotation * offset_n;
 
 	// Are we within the box?
 	if (rotated_point_e < 0 || rotated_point_n < 0 || rotated_point_e > map->x_dimension ||
 		rotated_point_n > map->y_dimension) return -1;
 
 	// Get the integer location of the grid point within the map.
-	loc_x = floor(rotated_point_e / map_edgesize);
-	loc_y = floor(rotated_point_n / map_edgesize);
-
-	// We need the four surrounding points for bilinear interpolation.
-	addr.level = ETREE_MAXLEVEL;
-	addr.x = loc_x * edgetics; addr.y = loc_y * edgetics; addr.z = 0;
-    /* Adjust addresses for edges of grid */
-    if (addr.x >= map->x_ticks) addr.x = map->x_ticks - edgetics;
-    if (addr.y >= map->y_ticks) addr.y = map->y_ticks - edgetics;
-	etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[0]));
-	addr.x = (loc_x + 1) * edgetics; addr.y = loc_y * edgetics;
-    if (addr.x >= map->x_ticks) addr.x = map->x_ticks - edgetics;
-    if (addr.y >= map->y_ticks) addr.y = map->y_ticks - edgetics;
-	etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[1]));
-	addr.x = loc_x * edgetics; addr.y = (loc_y + 1) * edgetics;
-    if (addr.x >= map->x_ticks) addr.x = map->x_ticks - edgetics;
-    if (addr.y >= map->y_ticks) addr.y = map->y_ticks - edgetics;
-	etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[2]));
-	addr.x = (loc_x + 1) * edgetics; addr.y = (loc_y + 1) * edgetics;
-    if (addr.x >= map->x_ticks) addr.x = map->x_ticks - edgetics;
-    if (addr.y >= map->y_ticks) addr.y = map->y_ticks - edgetics;
-	etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[3]));
+	loc_x = floor(rotated_point_e / map->edge_size);
+	loc_y = floor(rotated_point_n / map->edge_size);
+
+	// We need the four surrounding points for bilinear interpolation, from the raster if it covers them.
+	if (map->raster != NULL && loc_x >= map->raster_x0 && loc_y >= map->raster_y0 &&
+	    loc_x + 1 < map->raster_x0 + map->raster_nx && loc_y + 1 < map->raster_y0 + map->raster_ny) {
+		cell = map->raster + (long)(loc_y - map->raster_y0) * map->raster_nx + (loc_x - map->raster_x0);
+		vs30_payload[0].vs30 = cell[0];
+		vs30_payload[1].vs30 = cell[1];
+		vs30_payload[2].vs30 = cell[map->raster_nx];
+		vs30_payload[3].vs30 = cell[map->raster_nx + 1];
+	} else {
+		if (lock) pthread_mutex_lock(lock);
+		__atomic_fetch_add(&map->searches, 4, __ATOMIC_RELAXED);
+		addr.level = ETREE_MAXLEVEL;
+		addr.z = 0;
+		for (i = 0; i < 4; i++) {
+			addr.x = cs173_vs30_tick(map, loc_x + (i & 1), map->x_ticks);
+			addr.y = cs173_vs30_tick(map, loc_y + (i >> 1), map->y_ticks);
+			etree_search(map->vs30_map, addr, NULL, "*", &(vs30_payload[i]));
+		}
+		if (lock) pthread_mutex_unlock(lock);
+	}
 
 	percent = fmod(rotated_point_e / map->spacing, map->spacing) / map->spacing;
 	vs30_payload[0].vs30 = percent * vs30_payload[0].vs30 + (1 - percent) * vs30_payload[1].vs30;
@@ -166,6 +243,132 @@ double cs173_get_vs30_value(double longitude, double latitude, cs173_vs30_map_co
 	return vs30_payload[0].vs30;
 }
 
+/**
+ * Reads a rectangle of map samples out of the Vs30 e-tree into a dense raster, so lookups
+ * inside it are plain array reads. Each raster cell holds exactly what the e-tree search for
+ * that sample returns, edge adjustments included.
+ *
+ * @param map The Vs30 map structure.
+ * @param x0 First map sample in x.
+ * @param y0 First map sample in y.
+ * @param nx Number of samples in x.
+ * @param ny Number of samples in y.
+ * @return SUCCESS, or FAIL if the raster could not be allocated.
+ */
+int cs173_rasterize_vs30_map(cs173_vs30_map_config_t *map, int x0, int y0, int nx, int ny) {
+	float *raster = malloc((size_t)nx * ny * sizeof(float));
+	cs173_vs30_mpayload_t payload;
+	etree_addr_t addr;
+	int x = 0, y = 0;
+
+	if (raster == NULL) return FAIL;
+
+	addr.level = ETREE_MAXLEVEL;
+	addr.z = 0;
+	for (y = 0; y < ny; y++) {
+		addr.y = cs173_vs30_tick(map, y0 + y, map->y_ticks);
+		for (x = 0; x < nx; x++) {
+			addr.x = cs173_vs30_tick(map, x0 + x, map->x_ticks);
+			payload.vs30 = 0;
+			etree_search(map->vs30_map, addr, NULL, "*", &payload);
+			raster[(long)y * nx + x] = payload.vs30;
+		}
+	}
+
+	map->raster = raster;
+	map->raster_x0 = x0;
+	map->raster_y0 = y0;
+	map->raster_nx = nx;
+	map->raster_ny = ny;
+
+	return SUCCESS;
+}
+
+/**
+ * Maps the raster of a Vs30 cache file, if the file was written for this very e-tree (same
+ * size, modification time and metadata) and the same rectangle of map samples.
+ *
+ * @param map The Vs30 map structure.
+ * @param file The cache file.
+ * @param x0 First map sample in x.
+ * @param y0 First map sample in y.
+ * @param nx Number of samples in x.
+ * @param ny Number of samples in y.
+ * @return SUCCESS if the raster was mapped, FAIL if the file is missing, stale or damaged.
+ */
+int cs173_load_vs30_raster(cs173_vs30_map_config_t *map, char *file, int x0, int y0, int nx, int ny) {
+	cs173_vs30_cache_header_t header;
+	struct stat st;
+	size_t size = sizeof(cs173_vs30_cache_header_t) + (size_t)nx * ny * sizeof(float);
+	void *ptr = MAP_FAILED;
+	int fd = open(file, O_RDONLY);
+
+	if (fd < 0) return FAIL;
+	if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+	    memcmp(header.magic, CS173_VS30_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+	    header.version == CS173_VS30_CACHE_VERSION && header.header_size == sizeof(header) &&
+	    header.etree_size == map->etree_size && header.etree_mtime == map->etree_mtime &&
+	    header.appmeta_hash == map->appmeta_hash && header.edge_size == map->edge_size &&
+	    header.x0 == x0 && header.y0 == y0 && header.nx == nx && header.ny == ny &&
+	    fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+		ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) return FAIL;
+
+	map->raster_mapping = ptr;
+	map->raster_mapping_size = size;
+	map->raster = (float *)((char *)ptr + sizeof(cs173_vs30_cache_header_t));
+	map->raster_x0 = x0;
+	map->raster_y0 = y0;
+	map->raster_nx = nx;
+	map->raster_ny = ny;
+
+	return SUCCESS;
+}
+
+/**
+ * Writes the map's raster to a cache file for later runs. The file is written under a
+ * temporary name and renamed into place, so processes starting at the same time never see
+ * half a file.
+ *
+ * @param map The Vs30 map structure, with its raster read.
+ * @param file The cache file.
+ * @return SUCCESS or FAIL.
+ */
+int cs173_save_vs30_raster(cs173_vs30_map_config_t *map, char *file) {
+	cs173_vs30_cache_header_t header;
+	size_t size = (size_t)map->raster_nx * map->raster_ny * sizeof(float);
+	char temp[512];
+	FILE *fp = NULL;
+	int ret = SUCCESS;
+
+	if (map->raster == NULL) return FAIL;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CS173_VS30_CACHE_MAGIC, sizeof(header.magic));
+	header.version = CS173_VS30_CACHE_VERSION;
+	header.header_size = sizeof(header);
+	header.etree_size = map->etree_size;
+	header.etree_mtime = map->etree_mtime;
+	header.appmeta_hash = map->appmeta_hash;
+	header.edge_size = map->edge_size;
+	header.x0 = map->raster_x0;
+	header.y0 = map->raster_y0;
+	header.nx = map->raster_nx;
+	header.ny = map->raster_ny;
+
+	snprintf(temp, sizeof(temp), "%s.%d.tmp", file, (int)getpid());
+	fp = fopen(temp, "wb");
+	if (fp == NULL) return FAIL;
+	if (fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(map->raster, 1, size, fp) != size)
+		ret = FAIL;
+	if (fclose(fp) != 0) ret = FAIL;
+	if (ret == SUCCESS && rename(temp, file) != 0) ret = FAIL;
+	if (ret != SUCCESS) unlink(temp);
+
+	return ret;
+}
+
 /**
  * Gets the GTL value using the Wills and Wald dataset, given a latitude, longitude and depth.
  *
@@ -174,26 +377,95 @@ double cs173_get_vs30_value(double longitude, double latitude, cs173_vs30_map_co
  * @return Success or failure.
  */
 int cs173_get_vs30_based_gtl(cs173_point_t *point, cs173_properties_t *data) {
-        double a = 0.5, b = 0.6, c = 0.5;
-	double percent_z = point->depth / cs173_configuration->depth_interval;
-	double f = 0.0, g = 0.0;
-	double vs30 = 0.0, vp30 = 0.0;
+	return cs173_get_vs30_based_gtl_h(cs173_default_handle, point, data);
+}
+
+/**
+ * Gets the GTL value of a model handle using the Wills and Wald dataset, given a latitude,
+ * longitude and depth. Safe to call from several threads at once. cs173_query_h does not go
+ * through here; it reads the anchor itself and calls cs173_apply_vs30_gtl.
+ *
+ * @param handle The model handle.
+ * @param point The point at which to retrieve the property. Note, depth is ignored.
+ * @param data The material properties at the point specified, or -1 if not found.
+ * @return Success or failure.
+ */
+int cs173_get_vs30_based_gtl_h(cs173_model_handle *handle, cs173_point_t *point, cs173_properties_t *data) {
+	double percent_z = point->depth / handle->config->depth_interval;
+	cs173_point_t pt;
+	cs173_properties_t dt;
 
 	// Double check that we're above the first layer.
 	if (percent_z > 1) return FAIL;
 
 	// Query for the point at depth_interval.
-	cs173_point_t *pt = calloc(1, sizeof(cs173_point_t));
-	cs173_properties_t *dt = calloc(1, sizeof(cs173_properties_t));
+	pt.latitude = point->latitude;
+	pt.longitude = point->longitude;
+	pt.depth = handle->config->depth_interval;
 
-	pt->latitude = point->latitude;
-	pt->longitude = point->longitude;
-	pt->depth = cs173_configuration->depth_interval;
-
-	if (cs173_query(pt, dt, 1) != SUCCESS) return FAIL;
+	if (cs173_query_h(handle, &pt, &dt, 1) != SUCCESS) return FAIL;
 
 	// Now we need the Vs30 data value.
-	vs30 = cs173_get_vs30_value(point->longitude, point->latitude, cs173_vs30_map);
+	cs173_gtl_blend(percent_z, cs173_get_vs30_value_h(handle, point->longitude, point->latitude), &dt, data);
+
+	return SUCCESS;
+}
+
+/**
+ * Applies the GTL to a batch of near-surface points. Each point's entry in data must hold its
+ * anchor, the model at depth_interval below the surface at that point, and is replaced by
+ * its GTL vp and vs. The points are projected to the Vs30 map all in one go.
+ *
+ * @param handle The model handle.
+ * @param thread The calling thread's state.
+ * @param points The points of the query batch.
+ * @param data The properties of the query batch.
+ * @param index The positions within the batch of the GTL points.
+ * @param count The number of GTL points, at most CS173_PROJECTION_BATCH.
+ */
+void cs173_apply_vs30_gtl(cs173_model_handle *handle, cs173_thread_t *thread, const cs173_point_t *points,
+                          cs173_properties_t *data, const int *index, int count) {
+	cs173_vs30_map_config_t *map = handle->vs30_map;
+	double point_e[CS173_PROJECTION_BATCH], point_n[CS173_PROJECTION_BATCH];
+	cs173_properties_t anchor;
+	double vs30 = 0;
+	int k = 0;
+
+	// Without a Vs30 map every point is off the map.
+	if (cs173_thread_gtl(handle, thread) != SUCCESS) {
+		for (k = 0; k < count; k++) {
+			anchor = data[index[k]];
+			cs173_gtl_blend(points[index[k]].depth / handle->config->depth_interval, -1, &anchor, &data[index[k]]);
+		}
+		return;
+	}
+
+	for (k = 0; k < count; k++) {
+		point_e[k] = points[index[k]].longitude * DEG_TO_RAD;
+		point_n[k] = points[index[k]].latitude * DEG_TO_RAD;
+	}
+	pj_transform(thread->latlon, thread->aeqd, count, 1, point_e, point_n, NULL);
+
+	for (k = 0; k < count; k++) {
+		vs30 = cs173_vs30_sample(map, point_e[k] - map->origin_e, point_n[k] - map->origin_n,
+		                         handle->cos_vs30_rotation_angle, handle->sin_vs30_rotation_angle, &handle->vs30_lock);
+		anchor = data[index[k]];
+		cs173_gtl_blend(points[index[k]].depth / handle->config->depth_interval, vs30, &anchor, &data[index[k]]);
+	}
+}
+
+/**
+ * Blends the Vs30 value at a point with the model at depth_interval below it.
+ *
+ * @param percent_z The point's depth as a fraction of depth_interval.
+ * @param vs30 The Vs30 value at the point, or -1 if off the map.
+ * @param anchor The material properties at depth_interval.
+ * @param data The point's vp and vs, or -1 if off the map.
+ */
+void cs173_gtl_blend(double percent_z, double vs30, const cs173_properties_t *anchor, cs173_properties_t *data) {
+        double a = 0.5, b = 0.6, c = 0.5;
+	double f = 0.0, g = 0.0;
+	double vp30 = 0.0;
 
 	if (vs30 == -1) {
 		data->vp = -1;
@@ -202,16 +474,10 @@ int cs173_get_vs30_based_gtl(cs173_point_t *point, cs173_properties_t *data) {
 		// Get the point's material properties within the GTL.
 		f = percent_z + b * (percent_z - pow(percent_z, 2.0f));
 		g = a - a * percent_z + c * (pow(percent_z, 2.0f) + 2.0 * sqrt(percent_z) - 3.0 * percent_z);
-		data->vs = f * dt->vs + g * vs30;
+		data->vs = f * anchor->vs + g * vs30;
 		vs30 = vs30 / 1000;
 		vp30 = 0.9409 + 2.0947 * vs30 - 0.8206 * pow(vs30, 2.0f) + 0.2683 * pow(vs30, 3.0f) - 0.0251 * pow(vs30, 4.0f);
 		vp30 = vp30 * 1000;
-		data->vp = f * dt->vp + g * vp30;
+		data->vp = f * anchor->vp + g * vp30;
 	}
-
-	free(pt);
-	free(dt);
-
-	return SUCCESS;
 }
-
@@ -5,8 +5,18 @@
  * 
  **/
 
+#ifndef CS173_GTL_H
+#define CS173_GTL_H
+
 #include "etree.h"
 
+/** Name of the Vs30 raster cache file within the model directory, unless configured otherwise */
+#define CS173_VS30_CACHE_FILE "vs30_raster.cache"
+/** Identifies a Vs30 raster cache file */
+#define CS173_VS30_CACHE_MAGIC "CS173V30"
+/** Version of the Vs30 raster cache file layout */
+#define CS173_VS30_CACHE_VERSION 1
+
 /** The configuration structure for the Vs30 map. */
 typedef struct cs173_vs30_map_config_t {
 	/** Pointer to the e-tree file */
@@ -41,9 +51,65 @@ typedef struct cs173_vs30_map_config_t {
 	int y_ticks;
 	/** Number of e-tree ticks in the Z direction */
 	int z_ticks;
+	/** E-tree ticks between neighbouring map samples */
+	etree_tick_t edgetics;
+	/** Meters between neighbouring map samples */
+	double edge_size;
+	/** Easting of the origin point in the map projection, set up at open */
+	double origin_e;
+	/** Northing of the origin point in the map projection, set up at open */
+	double origin_n;
+	/** Vs30 of map samples raster_x0 .. raster_x0 + raster_nx - 1 (x fastest) and likewise in y, or NULL */
+	float *raster;
+	/** First map sample in x held by the raster */
+	int raster_x0;
+	/** First map sample in y held by the raster */
+	int raster_y0;
+	/** Number of map samples in x held by the raster */
+	int raster_nx;
+	/** Number of map samples in y held by the raster */
+	int raster_ny;
+	/** The cache file mapping the raster lives in, or NULL if the raster was allocated */
+	void *raster_mapping;
+	/** Size of the cache file mapping */
+	size_t raster_mapping_size;
+	/** Size of the e-tree file, part of the cache key */
+	long long etree_size;
+	/** Modification time of the e-tree file, part of the cache key */
+	long long etree_mtime;
+	/** Hash of the e-tree application metadata, part of the cache key */
+	unsigned long long appmeta_hash;
+	/** Searches of the e-tree made by queries */
+	unsigned long long searches;
 } cs173_vs30_map_config_t;
 
 
+/** Header of a Vs30 raster cache file; the raster follows it, x fastest. */
+typedef struct cs173_vs30_cache_header_t {
+	/** CS173_VS30_CACHE_MAGIC */
+	char magic[8];
+	/** CS173_VS30_CACHE_VERSION */
+	int version;
+	/** Size of this header, where the raster starts */
+	int header_size;
+	/** Size of the e-tree file the raster was read from */
+	long long etree_size;
+	/** Modification time of the e-tree file */
+	long long etree_mtime;
+	/** Hash of the e-tree application metadata */
+	unsigned long long appmeta_hash;
+	/** Meters between neighbouring map samples */
+	double edge_size;
+	/** First map sample in x */
+	int x0;
+	/** First map sample in y */
+	int y0;
+	/** Number of samples in x */
+	int nx;
+	/** Number of samples in y */
+	int ny;
+} cs173_vs30_cache_header_t;
+
 /** Contains the Vs30 and surface values from the UCVM map. */
 typedef struct cs173_vs30_mpayload_t {
         /** Surface height in meters */
@@ -59,6 +125,18 @@ int cs173_get_vs30_based_gtl(cs173_point_t *point, cs173_properties_t *data);
 int cs173_read_vs30_map(char *filename, cs173_vs30_map_config_t *map);
 /** Gets the Vs30 value at a point */
 double cs173_get_vs30_value(double longitude, double latitude, cs173_vs30_map_config_t *map);
+/** Retrieves the vs30 value for a given point through a model handle. */
+int cs173_get_vs30_based_gtl_h(cs173_model_handle *handle, cs173_point_t *point, cs173_properties_t *data);
+/** Gets the Vs30 value at a point through a model handle */
+double cs173_get_vs30_value_h(cs173_model_handle *handle, double longitude, double latitude);
+/** Reads a rectangle of the Vs30 map into an in-memory raster. */
+int cs173_rasterize_vs30_map(cs173_vs30_map_config_t *map, int x0, int y0, int nx, int ny);
+/** Maps a Vs30 raster from a cache file, if the file matches the map and the rectangle. */
+int cs173_load_vs30_raster(cs173_vs30_map_config_t *map, char *file, int x0, int y0, int nx, int ny);
+/** Writes the Vs30 raster to a cache file. */
+int cs173_save_vs30_raster(cs173_vs30_map_config_t *map, char *file);
+/** Blends the Vs30 value at a point with the model at depth_interval below it. */
+void cs173_gtl_blend(double percent_z, double vs30, const cs173_properties_t *anchor, cs173_properties_t *data);
 
 
 extern char cs173_vs30_etree_file[];
@@ -74,3 +152,4 @@ extern double cs173_cos_vs30_rotation_angle;
 /** The sine of the Vs30 map's rotation. */
 extern double cs173_sin_vs30_rotation_angle;
 
+#endif
@@ -0,0 +1,116 @@
+/**
+ * @file cs173_handle.h
+ * @brief Model handle used internally by the CS173 library.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * A cs173_model_handle holds everything one opened model needs: the configuration, the model
+ * data, the Vs30 map and the constants derived from them. All of it is read-only once set up,
+ * so any number of threads may query the same handle. Model fields and the Vs30 map may be
+ * set up on the first query that needs them; that happens under load_lock and is published
+ * to other threads only once complete. What cannot be shared, the Proj.4 projections, lives
+ * in a cs173_thread_t built the first time a thread queries the handle.
+ *
+ */
+
+#ifndef CS173_HANDLE_H
+#define CS173_HANDLE_H
+
+#include <pthread.h>
+#include "cs173.h"
+#include "cs173_gtl.h"
+#include "cs173_pool.h"
+#include "cs173_simd.h"
+
+/** The per-thread state of a handle: Proj.4 projections on the thread's own context. */
+typedef struct cs173_thread_t {
+	/** The Proj.4 context the projections below belong to */
+	projCtx ctx;
+	/** Latitude longitude, WGS84 projection */
+	projPJ latlon;
+	/** WGS84 UTM projection used to place query points in the model */
+	projPJ geo_utm;
+	/** Vs30 map projection */
+	projPJ aeqd;
+	/** What this thread's queries did; only this thread writes it */
+	cs173_stats_t stats;
+	/** The next thread state of the same handle */
+	struct cs173_thread_t *next;
+} cs173_thread_t;
+
+/** One opened model. */
+struct cs173_model_handle {
+	/** Configuration parameters */
+	cs173_configuration_t *config;
+	/** Pointers to the velocity model data */
+	cs173_model_t *model;
+	/** Configuration parameters for the Vs30 map */
+	cs173_vs30_map_config_t *vs30_map;
+	/** Location of the model data files */
+	char iteration_directory[128];
+	/** Location of the ucvm.e e-tree file */
+	char vs30_etree_file[128];
+	/** Proj.4 definition of the query point UTM projection */
+	char geo_utm_definition[64];
+	/** Proj.4 latitude longitude, WGS84 projection, for the legacy globals */
+	projPJ latlon;
+	/** Proj.4 UTM projection, for the legacy globals */
+	projPJ utm;
+	/** Proj.4 WGS84 UTM projection, for the legacy globals */
+	projPJ geo_utm;
+	/** Proj.4 Vs30 map projection, for the legacy globals */
+	projPJ aeqd;
+	/** The cosine of the rotation angle of the box */
+	double cos_rotation_angle;
+	/** The sine of the rotation angle of the box */
+	double sin_rotation_angle;
+	/** The height of this model's region, in meters */
+	double total_height_m;
+	/** The width of this model's region, in meters */
+	double total_width_m;
+	/** The cosine of the Vs30 map's rotation */
+	double cos_vs30_rotation_angle;
+	/** The sine of the Vs30 map's rotation */
+	double sin_vs30_rotation_angle;
+	/** Model constants for the batch query kernel */
+	cs173_batch_params_t batch_params;
+	/** The batch query kernel, picked once a field it can gather is open, or NULL to query point by point */
+	cs173_batch_kernel_t batch_kernel;
+	/** The CS173_FIELD_* bits of the fields the batch kernel can gather */
+	int batch_fields;
+	/** Workers that large queries are split across, or NULL to query in the calling thread */
+	cs173_pool_t *pool;
+	/** Key of the calling thread's cs173_thread_t */
+	pthread_key_t thread_key;
+	/** Guards the list of thread states */
+	pthread_mutex_t thread_lock;
+	/** Every thread state built for this handle, freed by cs173_close */
+	cs173_thread_t *threads;
+	/** Statistics of the thread states freed before the handle is closed */
+	cs173_stats_t retired_stats;
+	/** Serializes searches of the Vs30 e-tree, which keeps its own buffer cache */
+	pthread_mutex_t vs30_lock;
+	/** Serializes opening fields and setting up the GTL on first use */
+	pthread_mutex_t load_lock;
+	/** 0 until the GTL is first needed, then 1 if it was set up or -1 if it could not be */
+	int gtl_state;
+};
+
+/** Returns the calling thread's state for a handle, building it on first use. */
+cs173_thread_t *cs173_thread_state(cs173_model_handle *handle);
+/** Opens the given CS173_FIELD_* fields of a handle's model, if not open yet. */
+int cs173_load_fields(cs173_model_handle *handle, int fields);
+/** Sets up the handle's Vs30 map and projection, if not set up yet. */
+int cs173_ensure_gtl(cs173_model_handle *handle);
+/** Sets up the GTL of a handle and the calling thread's Vs30 map projection, if not set up yet. */
+int cs173_thread_gtl(cs173_model_handle *handle, cs173_thread_t *thread);
+/** Applies the GTL to a batch of points whose data holds their anchor at depth_interval. */
+void cs173_apply_vs30_gtl(cs173_model_handle *handle, cs173_thread_t *thread, const cs173_point_t *points,
+                          cs173_properties_t *data, const int *index, int count);
+
+/** The handle opened by cs173_init, behind the legacy API. */
+extern cs173_model_handle *cs173_default_handle;
+
+#endif
@@ -0,0 +1,86 @@
+/**
+ * @file cs173_interp.h
+ * @brief Interpolation kernels used internally by the CS173 query path.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Small inline kernels that interpolate a stencil read by cs173_read_stencil without
+ * touching the heap. Only vp, vs and rho are interpolated, the fields the model files
+ * hold; Qp and Qs are derived from Vs afterwards by the caller.
+ *
+ */
+
+#ifndef CS173_INTERP_H
+#define CS173_INTERP_H
+
+/**
+ * Linearly interpolates from a to b.
+ *
+ * @param percent Percent of the way from a to b (from 0 to 1 interval).
+ * @param a Value at 0.
+ * @param b Value at 1.
+ * @return The interpolated value.
+ */
+static inline double cs173_interp_linear(double percent, double a, double b) {
+	return (1 - percent) * a + percent * b;
+}
+
+/**
+ * Bilinearly interpolates a plane given in origin, +x, +y, +x+y order.
+ *
+ * @param x_percent X percentage.
+ * @param y_percent Y percentage.
+ * @param c0 Origin value.
+ * @param c1 Value at +x.
+ * @param c2 Value at +y.
+ * @param c3 Value at +x+y.
+ * @return The interpolated value.
+ */
+static inline double cs173_interp_plane(double x_percent, double y_percent, double c0, double c1, double c2, double c3) {
+	return cs173_interp_linear(y_percent, cs173_interp_linear(x_percent, c0, c1), cs173_interp_linear(x_percent, c2, c3));
+}
+
+/**
+ * Trilinearly interpolates vp, vs and rho of a stencil in the order cs173_read_stencil returns
+ * it (top plane first, bottom plane second). Of those, fields not in the mask are set to -1;
+ * Qp and Qs of the result are left untouched.
+ *
+ * @param x_percent X percentage
+ * @param y_percent Y percentage
+ * @param z_percent Z percentage
+ * @param p Eight surrounding data properties
+ * @param ret Returned data properties
+ * @param fields The CS173_FIELD_* bits of the fields to interpolate
+ */
+static inline void cs173_interp_trilinear(double x_percent, double y_percent, double z_percent,
+                                          const cs173_properties_t *p, cs173_properties_t *ret, int fields) {
+	ret->vp  = !(fields & CS173_FIELD_VP) ? -1 :
+	           cs173_interp_linear(z_percent, cs173_interp_plane(x_percent, y_percent, p[0].vp, p[1].vp, p[2].vp, p[3].vp),
+	                               cs173_interp_plane(x_percent, y_percent, p[4].vp, p[5].vp, p[6].vp, p[7].vp));
+	ret->vs  = !(fields & CS173_FIELD_VS) ? -1 :
+	           cs173_interp_linear(z_percent, cs173_interp_plane(x_percent, y_percent, p[0].vs, p[1].vs, p[2].vs, p[3].vs),
+	                               cs173_interp_plane(x_percent, y_percent, p[4].vs, p[5].vs, p[6].vs, p[7].vs));
+	ret->rho = !(fields & CS173_FIELD_RHO) ? -1 :
+	           cs173_interp_linear(z_percent, cs173_interp_plane(x_percent, y_percent, p[0].rho, p[1].rho, p[2].rho, p[3].rho),
+	                               cs173_interp_plane(x_percent, y_percent, p[4].rho, p[5].rho, p[6].rho, p[7].rho));
+}
+
+/**
+ * Bilinearly interpolates vp, vs and rho of one plane of a stencil (origin, +x, +y, +x+y).
+ * Qp and Qs of the result are left untouched.
+ *
+ * @param x_percent X percentage.
+ * @param y_percent Y percentage.
+ * @param p Four data properties forming the plane.
+ * @param ret Returned data properties.
+ */
+static inline void cs173_interp_bilinear(double x_percent, double y_percent, const cs173_properties_t *p,
+                                         cs173_properties_t *ret) {
+	ret->vp  = cs173_interp_plane(x_percent, y_percent, p[0].vp, p[1].vp, p[2].vp, p[3].vp);
+	ret->vs  = cs173_interp_plane(x_percent, y_percent, p[0].vs, p[1].vs, p[2].vs, p[3].vs);
+	ret->rho = cs173_interp_plane(x_percent, y_percent, p[0].rho, p[1].rho, p[2].rho, p[3].rho);
+}
+
+#endif
@@ -0,0 +1,274 @@
+/**
+ * @file cs173_pool.c
+ * @brief Persistent work-stealing worker pool for the CS173 library.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * cs173_query_h hands large point arrays to this pool. The calling thread works as worker 0
+ * alongside the pool's own threads, which sleep between jobs. Every worker owns a range of
+ * chunk indices: it takes chunks from the front of its own range and, when that runs dry,
+ * steals the back half of the fullest-looking range it finds.
+ *
+ */
+
+#include <pthread.h>
+#include "cs173.h"
+#include "cs173_pool.h"
+
+/** The chunks one worker has left to do. */
+typedef struct cs173_pool_range_t {
+	/** Guards next and end */
+	pthread_mutex_t lock;
+	/** Next chunk to take */
+	int next;
+	/** One past the last chunk */
+	int end;
+} cs173_pool_range_t;
+
+/** A worker thread's view of the pool. */
+typedef struct cs173_pool_worker_t {
+	/** The pool the worker belongs to */
+	struct cs173_pool_t *pool;
+	/** The worker's index, 1 and up; 0 is the thread calling cs173_pool_run */
+	int id;
+	/** The worker thread */
+	pthread_t thread;
+} cs173_pool_worker_t;
+
+struct cs173_pool_t {
+	/** Number of workers, counting the calling thread */
+	int threads;
+	/** Number of worker threads actually started */
+	int started;
+	/** The worker threads */
+	cs173_pool_worker_t *workers;
+	/** The chunk range of each worker */
+	cs173_pool_range_t *ranges;
+	/** Held for the duration of a run, so only one job runs at a time */
+	pthread_mutex_t run_lock;
+	/** Guards the fields below */
+	pthread_mutex_t lock;
+	/** Signalled when a job is posted or the pool is shutting down */
+	pthread_cond_t wake;
+	/** Signalled when the last worker finishes a job */
+	pthread_cond_t finished;
+	/** Incremented for every job posted */
+	unsigned long generation;
+	/** Worker threads still busy with the current job */
+	int active;
+	/** Set when the pool is being destroyed */
+	int shutdown;
+	/** The current job */
+	cs173_pool_job_t job;
+	/** The current job's argument */
+	void *arg;
+	/** Items in the current job */
+	int count;
+	/** Items per chunk in the current job */
+	int chunk;
+};
+
+/**
+ * Takes the next chunk for a worker, from its own range or, failing that, by stealing the back
+ * half of another worker's range.
+ *
+ * @param pool The pool.
+ * @param id The worker's index.
+ * @return The chunk index, or -1 if no chunk is left anywhere.
+ */
+static int cs173_pool_take(cs173_pool_t *pool, int id) {
+	cs173_pool_range_t *own = &pool->ranges[id], *victim = NULL;
+	int chunk = -1, i = 0, mid = 0, end = 0;
+
+	pthread_mutex_lock(&own->lock);
+	if (own->next < own->end) chunk = own->next++;
+	pthread_mutex_unlock(&own->lock);
+	if (chunk >= 0) return chunk;
+
+	for (i = 1; i < pool->threads && chunk < 0; i++) {
+		victim = &pool->ranges[(id + i) % pool->threads];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->end - victim->next > 1) {
+			mid = victim->next + (victim->end - victim->next) / 2;
+			end = victim->end;
+			victim->end = mid;
+			chunk = mid;
+		} else if (victim->end - victim->next == 1) {
+			chunk = victim->next++;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	// Keep the rest of a stolen half as our own range, where others may steal it back.
+	if (chunk >= 0 && end > chunk + 1) {
+		pthread_mutex_lock(&own->lock);
+		own->next = chunk + 1;
+		own->end = end;
+		pthread_mutex_unlock(&own->lock);
+	}
+
+	return chunk;
+}
+
+/**
+ * Works on the current job until no chunk is left.
+ *
+ * @param pool The pool.
+ * @param id The worker's index.
+ */
+static void cs173_pool_work(cs173_pool_t *pool, int id) {
+	int chunk = 0, start = 0, end = 0;
+
+	while ((chunk = cs173_pool_take(pool, id)) >= 0) {
+		start = chunk * pool->chunk;
+		end = (pool->count - start < pool->chunk) ? pool->count : start + pool->chunk;
+		pool->job(pool->arg, start, end);
+	}
+}
+
+/**
+ * Body of the pool's worker threads: sleep until a job is posted, work on it, repeat.
+ *
+ * @param arg The cs173_pool_worker_t of the thread.
+ */
+static void *cs173_pool_main(void *arg) {
+	cs173_pool_worker_t *worker = (cs173_pool_worker_t *)arg;
+	cs173_pool_t *pool = worker->pool;
+	unsigned long seen = 0;
+
+	// Jobs are numbered from 1, so one posted before this thread got going is not missed.
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->generation == seen && !pool->shutdown)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->shutdown) break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		cs173_pool_work(pool, worker->id);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->active == 0) pthread_cond_signal(&pool->finished);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/**
+ * Starts a pool. The calling thread of cs173_pool_run counts as one worker, so threads - 1
+ * threads are started.
+ *
+ * @param threads The number of workers, at least 2.
+ * @return The pool, or NULL if it could not be set up.
+ */
+cs173_pool_t *cs173_pool_create(int threads) {
+	cs173_pool_t *pool = calloc(1, sizeof(cs173_pool_t));
+	int i = 0;
+
+	if (pool == NULL) return NULL;
+	if (threads > CS173_MAX_QUERY_THREADS) threads = CS173_MAX_QUERY_THREADS;
+	pool->threads = threads;
+	pool->workers = calloc(threads, sizeof(cs173_pool_worker_t));
+	pool->ranges = calloc(threads, sizeof(cs173_pool_range_t));
+	if (pool->workers == NULL || pool->ranges == NULL) {
+		free(pool->workers);
+		free(pool->ranges);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->finished, NULL);
+	for (i = 0; i < threads; i++) pthread_mutex_init(&pool->ranges[i].lock, NULL);
+
+	for (i = 1; i < threads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		if (pthread_create(&pool->workers[i].thread, NULL, cs173_pool_main, &pool->workers[i]) != 0) break;
+		pool->started = i;
+	}
+
+	// Shares of workers that could not be started are left for the others to steal.
+	if (pool->started == 0) {
+		cs173_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * Runs a job over count items, split into chunks of chunk items, on all workers including the
+ * calling thread. Only one job runs at a time; a caller that finds the pool busy gets FAIL
+ * right away and should do the work itself.
+ *
+ * @param pool The pool.
+ * @param job The job, called once per chunk with the chunk's item range.
+ * @param arg The argument passed to the job.
+ * @param count The number of items.
+ * @param chunk The number of items per chunk.
+ * @return SUCCESS once every chunk is done, or FAIL if the pool was busy.
+ */
+int cs173_pool_run(cs173_pool_t *pool, cs173_pool_job_t job, void *arg, int count, int chunk) {
+	int chunks = (count + chunk - 1) / chunk;
+	int i = 0;
+
+	if (pthread_mutex_trylock(&pool->run_lock) != 0) return FAIL;
+
+	// Even, contiguous shares to start with; stealing evens out the rest.
+	for (i = 0; i < pool->threads; i++) {
+		pool->ranges[i].next = (int)((long)chunks * i / pool->threads);
+		pool->ranges[i].end = (int)((long)chunks * (i + 1) / pool->threads);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->arg = arg;
+	pool->count = count;
+	pool->chunk = chunk;
+	pool->active = pool->started;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	cs173_pool_work(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->active > 0)
+		pthread_cond_wait(&pool->finished, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_unlock(&pool->run_lock);
+	return SUCCESS;
+}
+
+/**
+ * Stops the workers and frees the pool. No job may be running.
+ *
+ * @param pool The pool.
+ */
+void cs173_pool_destroy(cs173_pool_t *pool) {
+	int i = 0;
+
+	if (pool == NULL) return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 1; i <= pool->started; i++) pthread_join(pool->workers[i].thread, NULL);
+
+	for (i = 0; i < pool->threads; i++) pthread_mutex_destroy(&pool->ranges[i].lock);
+	pthread_mutex_destroy(&pool->run_lock);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->finished);
+	free(pool->workers);
+	free(pool->ranges);
+	free(pool);
+}
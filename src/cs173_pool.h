@@ -0,0 +1,35 @@
+/**
+ * @file cs173_pool.h
+ * @brief Persistent worker pool used internally to split large queries.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * A fixed set of worker threads, created once when a model is opened, that run one job at a
+ * time over a range of chunks. Each worker starts on its own even share of the chunks and,
+ * once that is done, steals half of what remains of another worker's share, so chunks that
+ * cost more (GTL points, points read from disk) do not leave the other workers idle.
+ *
+ */
+
+#ifndef CS173_POOL_H
+#define CS173_POOL_H
+
+/** Upper bound on the workers of a query pool */
+#define CS173_MAX_QUERY_THREADS 64
+
+/** A job run by the pool: processes items [start, end) of its argument. */
+typedef void (*cs173_pool_job_t)(void *arg, int start, int end);
+
+/** A worker pool. Opaque. */
+typedef struct cs173_pool_t cs173_pool_t;
+
+/** Starts a pool of the given number of workers, counting the calling thread. */
+cs173_pool_t *cs173_pool_create(int threads);
+/** Runs a job over count items in chunks, returning when all are done; FAIL if the pool is busy. */
+int cs173_pool_run(cs173_pool_t *pool, cs173_pool_job_t job, void *arg, int count, int chunk);
+/** Stops the workers and frees the pool. */
+void cs173_pool_destroy(cs173_pool_t *pool);
+
+#endif
@@ -0,0 +1,271 @@
+/**
+ * @file cs173_simd.c
+ * @brief SIMD batch query kernels for the CS173 library.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * AVX2 (4 lanes) and AVX-512 (8 lanes) versions of the interior query: rotate into the model
+ * frame, find the grid cell and fractions, gather the eight corners of vp, vs and rho, and blend
+ * them. The kernels are compiled with per-function target attributes and picked at runtime, so
+ * the library runs on any x86-64 CPU; elsewhere no kernel is offered and cs173_query stays
+ * scalar. The cell fractions are the exact remainders fmod gives, and the linear steps are nested
+ * as in cs173_interp_trilinear; the Makefile builds this file with -ffp-contract=off so they are
+ * not fused either. Results therefore match the scalar path bit for bit, which the
+ * tests/cs173_kernels check verifies.
+ *
+ */
+
+#include "cs173.h"
+#include "cs173_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CS173_HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/** 2^52: adding it to a non-negative integral double below 2^52 leaves the integer in the low mantissa bits. */
+#define CS173_INT_MAGIC 4503599627370496.0
+
+#ifdef CS173_HAVE_X86_KERNELS
+
+/**
+ * Writes the lanes a kernel served back to the caller's properties and derives Qp and Qs as
+ * cs173_query does.
+ *
+ * @param out The vp, vs and rho of each lane.
+ * @param mask Bit set for each lane served.
+ * @param width Number of lanes.
+ * @param data The properties of the first lane's point.
+ * @param done Flags of the first lane's point.
+ * @return The number of lanes served.
+ */
+static int cs173_batch_store(double out[3][8], int mask, int width, cs173_properties_t *data, unsigned char *done) {
+	int lane = 0, served = 0;
+
+	for (lane = 0; lane < width; lane++) {
+		if (!(mask & (1 << lane))) continue;
+		data[lane].vp = out[0][lane];
+		data[lane].vs = out[1][lane];
+		data[lane].rho = out[2][lane];
+
+		// Calculate Qp and Qs.
+		if (data[lane].vs < 1500)
+			data[lane].qs = data[lane].vs * 0.02;
+		else
+			data[lane].qs = data[lane].vs * 0.10;
+
+		data[lane].qp = data[lane].qs * 1.5;
+		done[lane] = 1;
+		served++;
+	}
+
+	return served;
+}
+
+/** Linearly interpolates from a to b, four lanes at a time. */
+__attribute__((target("avx2,fma")))
+static inline __m256d cs173_lerp_avx2(__m256d t, __m256d a, __m256d b) {
+	return _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(1.0), t), a), _mm256_mul_pd(t, b));
+}
+
+/**
+ * Returns the fraction of the way x is through its cell of the given size, as
+ * fmod(x, size) / size. |x| / size may round up or down to the next integer, so the quotient is
+ * corrected by the sign of the remainder it leaves; the fused |x| - q * size is then exact.
+ * Like fmod's, the result takes the sign of x, which matters for the tiny negative x whose
+ * cell index rounds to 0.
+ */
+__attribute__((target("avx2,fma")))
+static inline __m256d cs173_fraction_avx2(__m256d x, __m256d size) {
+	const __m256d one = _mm256_set1_pd(1.0), sign = _mm256_set1_pd(-0.0);
+	__m256d a = _mm256_andnot_pd(sign, x), q = _mm256_floor_pd(_mm256_div_pd(a, size));
+	__m256d r = _mm256_fnmadd_pd(q, size, a);
+
+	q = _mm256_sub_pd(q, _mm256_and_pd(_mm256_cmp_pd(r, _mm256_setzero_pd(), _CMP_LT_OQ), one));
+	q = _mm256_add_pd(q, _mm256_and_pd(_mm256_cmp_pd(r, size, _CMP_GE_OQ), one));
+	r = _mm256_or_pd(_mm256_fnmadd_pd(q, size, a), _mm256_and_pd(sign, x));
+	return _mm256_div_pd(r, size);
+}
+
+/**
+ * AVX2 batch kernel, four points per step. See cs173_batch_kernel_t.
+ */
+__attribute__((target("avx2,fma")))
+static int cs173_batch_avx2(const cs173_batch_params_t *p, const cs173_point_t *points, const double *utm_e,
+                            const double *utm_n, cs173_properties_t *data, int count, int fields, unsigned char *done) {
+	const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0), magic = _mm256_set1_pd(CS173_INT_MAGIC);
+	const __m256d cosr = _mm256_set1_pd(p->cos_rotation), sinr = _mm256_set1_pd(p->sin_rotation);
+	const __m256d xi = _mm256_set1_pd(p->x_interval), yi = _mm256_set1_pd(p->y_interval);
+	const __m256d di = _mm256_set1_pd(p->depth_interval);
+	__m256d depth, e, n, pe, pn, fx, fy, fz, ok, xp, yp, zp, loc, v[8], top, bottom;
+	__m128 gmask;
+	__m256i idx;
+	double out[3][8];
+	int i = 0, c = 0, f = 0, mask = 0, served = 0;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		depth = _mm256_set_pd(points[i + 3].depth, points[i + 2].depth, points[i + 1].depth, points[i].depth);
+
+		// Rotate into the model frame.
+		e = _mm256_sub_pd(_mm256_loadu_pd(utm_e + i), _mm256_set1_pd(p->corner_e));
+		n = _mm256_sub_pd(_mm256_loadu_pd(utm_n + i), _mm256_set1_pd(p->corner_n));
+		pe = _mm256_sub_pd(_mm256_mul_pd(cosr, e), _mm256_mul_pd(sinr, n));
+		pn = _mm256_add_pd(_mm256_mul_pd(sinr, e), _mm256_mul_pd(cosr, n));
+
+		// Grid cell, and which lanes are inside the model below the GTL.
+		fx = _mm256_floor_pd(_mm256_mul_pd(_mm256_div_pd(pe, _mm256_set1_pd(p->width_m)), _mm256_set1_pd(p->nx1)));
+		fy = _mm256_floor_pd(_mm256_mul_pd(_mm256_div_pd(pn, _mm256_set1_pd(p->height_m)), _mm256_set1_pd(p->ny1)));
+		fz = _mm256_floor_pd(_mm256_sub_pd(_mm256_set1_pd(p->z_top), _mm256_floor_pd(_mm256_div_pd(depth, di))));
+		ok = _mm256_cmp_pd(depth, zero, _CMP_GE_OQ);
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(depth, _mm256_set1_pd(p->gtl_depth), _CMP_GE_OQ));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(fx, zero, _CMP_GE_OQ));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(fx, _mm256_set1_pd(p->nx1 - 1), _CMP_LE_OQ));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(fy, zero, _CMP_GE_OQ));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(fy, _mm256_set1_pd(p->ny1 - 1), _CMP_LE_OQ));
+		ok = _mm256_and_pd(ok, _mm256_cmp_pd(fz, one, _CMP_GE_OQ));
+		mask = _mm256_movemask_pd(ok);
+		if (mask == 0) continue;
+
+		xp = cs173_fraction_avx2(pe, xi);
+		yp = cs173_fraction_avx2(pn, yi);
+		zp = cs173_fraction_avx2(depth, di);
+
+		// Sample index of the origin corner, converted to 64-bit integers.
+		loc = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_set1_pd(p->origin), _mm256_mul_pd(fx, _mm256_set1_pd(p->dx))),
+		                                  _mm256_mul_pd(fy, _mm256_set1_pd(p->dy))), _mm256_mul_pd(fz, _mm256_set1_pd(p->dz)));
+		idx = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(loc, magic)), _mm256_castpd_si256(magic));
+		gmask = _mm_castsi128_ps(_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(ok),
+		                                                _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0))));
+
+		for (f = 0; f < 3; f++) {
+			for (c = 0; c < 8; c++) {
+				if (!(fields & (1 << f)) || p->field[f] == NULL)
+					v[c] = _mm256_set1_pd(-1);
+				else
+					v[c] = _mm256_cvtps_pd(_mm256_mask_i64gather_ps(_mm_setzero_ps(), p->field[f],
+					                       _mm256_add_epi64(idx, _mm256_set1_epi64x(p->delta[c])), gmask, 4));
+			}
+			top = cs173_lerp_avx2(yp, cs173_lerp_avx2(xp, v[0], v[1]), cs173_lerp_avx2(xp, v[2], v[3]));
+			bottom = cs173_lerp_avx2(yp, cs173_lerp_avx2(xp, v[4], v[5]), cs173_lerp_avx2(xp, v[6], v[7]));
+			_mm256_storeu_pd(out[f], cs173_lerp_avx2(zp, top, bottom));
+		}
+
+		served += cs173_batch_store(out, mask, 4, &data[i], &done[i]);
+	}
+
+	return served;
+}
+
+/** Linearly interpolates from a to b, eight lanes at a time. */
+__attribute__((target("avx512f")))
+static inline __m512d cs173_lerp_avx512(__m512d t, __m512d a, __m512d b) {
+	return _mm512_add_pd(_mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(1.0), t), a), _mm512_mul_pd(t, b));
+}
+
+/** Rounds each lane down. */
+__attribute__((target("avx512f")))
+static inline __m512d cs173_floor_avx512(__m512d x) {
+	return _mm512_roundscale_pd(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+
+/** Returns fmod(x, size) / size, as cs173_fraction_avx2 does. */
+__attribute__((target("avx512f")))
+static inline __m512d cs173_fraction_avx512(__m512d x, __m512d size) {
+	const __m512i sign = _mm512_set1_epi64((long long)0x8000000000000000ULL);
+	__m512d a = _mm512_castsi512_pd(_mm512_andnot_epi64(sign, _mm512_castpd_si512(x)));
+	__m512d q = cs173_floor_avx512(_mm512_div_pd(a, size)), r = _mm512_fnmadd_pd(q, size, a);
+
+	q = _mm512_mask_sub_pd(q, _mm512_cmp_pd_mask(r, _mm512_setzero_pd(), _CMP_LT_OQ), q, _mm512_set1_pd(1.0));
+	q = _mm512_mask_add_pd(q, _mm512_cmp_pd_mask(r, size, _CMP_GE_OQ), q, _mm512_set1_pd(1.0));
+	r = _mm512_castsi512_pd(_mm512_or_epi64(_mm512_castpd_si512(_mm512_fnmadd_pd(q, size, a)),
+	                                        _mm512_and_epi64(sign, _mm512_castpd_si512(x))));
+	return _mm512_div_pd(r, size);
+}
+
+/**
+ * AVX-512 batch kernel, eight points per step. See cs173_batch_kernel_t.
+ */
+__attribute__((target("avx512f")))
+static int cs173_batch_avx512(const cs173_batch_params_t *p, const cs173_point_t *points, const double *utm_e,
+                              const double *utm_n, cs173_properties_t *data, int count, int fields, unsigned char *done) {
+	const __m512d zero = _mm512_setzero_pd(), one = _mm512_set1_pd(1.0), magic = _mm512_set1_pd(CS173_INT_MAGIC);
+	const __m512d cosr = _mm512_set1_pd(p->cos_rotation), sinr = _mm512_set1_pd(p->sin_rotation);
+	const __m512d xi = _mm512_set1_pd(p->x_interval), yi = _mm512_set1_pd(p->y_interval);
+	const __m512d di = _mm512_set1_pd(p->depth_interval);
+	__m512d depth, e, n, pe, pn, fx, fy, fz, xp, yp, zp, loc, v[8], top, bottom;
+	__mmask8 ok;
+	__m512i idx;
+	double out[3][8];
+	int i = 0, c = 0, f = 0, served = 0;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		depth = _mm512_set_pd(points[i + 7].depth, points[i + 6].depth, points[i + 5].depth, points[i + 4].depth,
+		                      points[i + 3].depth, points[i + 2].depth, points[i + 1].depth, points[i].depth);
+
+		// Rotate into the model frame.
+		e = _mm512_sub_pd(_mm512_loadu_pd(utm_e + i), _mm512_set1_pd(p->corner_e));
+		n = _mm512_sub_pd(_mm512_loadu_pd(utm_n + i), _mm512_set1_pd(p->corner_n));
+		pe = _mm512_sub_pd(_mm512_mul_pd(cosr, e), _mm512_mul_pd(sinr, n));
+		pn = _mm512_add_pd(_mm512_mul_pd(sinr, e), _mm512_mul_pd(cosr, n));
+
+		// Grid cell, and which lanes are inside the model below the GTL.
+		fx = cs173_floor_avx512(_mm512_mul_pd(_mm512_div_pd(pe, _mm512_set1_pd(p->width_m)), _mm512_set1_pd(p->nx1)));
+		fy = cs173_floor_avx512(_mm512_mul_pd(_mm512_div_pd(pn, _mm512_set1_pd(p->height_m)), _mm512_set1_pd(p->ny1)));
+		fz = cs173_floor_avx512(_mm512_sub_pd(_mm512_set1_pd(p->z_top), cs173_floor_avx512(_mm512_div_pd(depth, di))));
+		ok = _mm512_cmp_pd_mask(depth, zero, _CMP_GE_OQ);
+		ok &= _mm512_cmp_pd_mask(depth, _mm512_set1_pd(p->gtl_depth), _CMP_GE_OQ);
+		ok &= _mm512_cmp_pd_mask(fx, zero, _CMP_GE_OQ);
+		ok &= _mm512_cmp_pd_mask(fx, _mm512_set1_pd(p->nx1 - 1), _CMP_LE_OQ);
+		ok &= _mm512_cmp_pd_mask(fy, zero, _CMP_GE_OQ);
+		ok &= _mm512_cmp_pd_mask(fy, _mm512_set1_pd(p->ny1 - 1), _CMP_LE_OQ);
+		ok &= _mm512_cmp_pd_mask(fz, one, _CMP_GE_OQ);
+		if (ok == 0) continue;
+
+		xp = cs173_fraction_avx512(pe, xi);
+		yp = cs173_fraction_avx512(pn, yi);
+		zp = cs173_fraction_avx512(depth, di);
+
+		// Sample index of the origin corner, converted to 64-bit integers.
+		loc = _mm512_add_pd(_mm512_add_pd(_mm512_add_pd(_mm512_set1_pd(p->origin), _mm512_mul_pd(fx, _mm512_set1_pd(p->dx))),
+		                                  _mm512_mul_pd(fy, _mm512_set1_pd(p->dy))), _mm512_mul_pd(fz, _mm512_set1_pd(p->dz)));
+		idx = _mm512_sub_epi64(_mm512_castpd_si512(_mm512_add_pd(loc, magic)), _mm512_castpd_si512(magic));
+
+		for (f = 0; f < 3; f++) {
+			for (c = 0; c < 8; c++) {
+				if (!(fields & (1 << f)) || p->field[f] == NULL)
+					v[c] = _mm512_set1_pd(-1);
+				else
+					v[c] = _mm512_cvtps_pd(_mm512_mask_i64gather_ps(_mm256_setzero_ps(), ok,
+					                       _mm512_add_epi64(idx, _mm512_set1_epi64(p->delta[c])), p->field[f], 4));
+			}
+			top = cs173_lerp_avx512(yp, cs173_lerp_avx512(xp, v[0], v[1]), cs173_lerp_avx512(xp, v[2], v[3]));
+			bottom = cs173_lerp_avx512(yp, cs173_lerp_avx512(xp, v[4], v[5]), cs173_lerp_avx512(xp, v[6], v[7]));
+			_mm512_storeu_pd(out[f], cs173_lerp_avx512(zp, top, bottom));
+		}
+
+		served += cs173_batch_store(out, ok, 8, &data[i], &done[i]);
+	}
+
+	return served;
+}
+
+#endif
+
+/**
+ * Returns the widest batch kernel that both the simd setting and the CPU allow.
+ *
+ * @param mode One of the CS173_SIMD_* settings.
+ * @return The kernel, or NULL if cs173_query should stay scalar.
+ */
+cs173_batch_kernel_t cs173_select_batch_kernel(int mode) {
+#ifdef CS173_HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if ((mode == CS173_SIMD_AUTO || mode == CS173_SIMD_AVX512) && __builtin_cpu_supports("avx512f"))
+		return cs173_batch_avx512;
+	if (mode != CS173_SIMD_OFF && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return cs173_batch_avx2;
+#endif
+	return NULL;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file cs173_simd.h
+ * @brief Batch query kernels used internally by cs173_query.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * The batch kernels take a group of points that cs173_query has already projected to UTM and
+ * serve, SIMD-width lanes at a time, every point that lands inside the model below the GTL:
+ * rotation into the model frame, grid index and fraction, gathers of the eight corners and the
+ * trilinear blend. Points they do not serve (above the surface, outside the box, below the
+ * model, in the GTL, or in a storage the kernels cannot gather from) are left for the scalar
+ * path in cs173_query.
+ *
+ */
+
+#ifndef CS173_SIMD_H
+#define CS173_SIMD_H
+
+/** Use the widest kernel the CPU supports */
+#define CS173_SIMD_AUTO 0
+/** Never use the batch kernels */
+#define CS173_SIMD_OFF 1
+/** Use the AVX2 kernel at most */
+#define CS173_SIMD_AVX2 2
+/** Use the AVX-512 kernel at most */
+#define CS173_SIMD_AVX512 3
+
+/** The model constants the batch kernels need, gathered once at init. */
+typedef struct cs173_batch_params_t {
+	/** Bottom-left corner easting the points are taken relative to */
+	double corner_e;
+	/** Bottom-left corner northing the points are taken relative to */
+	double corner_n;
+	/** Cosine of the box rotation */
+	double cos_rotation;
+	/** Sine of the box rotation */
+	double sin_rotation;
+	/** Width of the box in meters */
+	double width_m;
+	/** Height of the box in meters */
+	double height_m;
+	/** nx - 1 */
+	double nx1;
+	/** ny - 1 */
+	double ny1;
+	/** Spacing between grid points in x */
+	double x_interval;
+	/** Spacing between grid points in y */
+	double y_interval;
+	/** Z spacing of the data */
+	double depth_interval;
+	/** Grid z index of the surface, depth / depth_interval - 1 */
+	double z_top;
+	/** Points shallower than this are left to the GTL, -1 if the GTL is off */
+	double gtl_depth;
+	/** Sample index of grid point (0, 0, 0), in floats */
+	double origin;
+	/** Step between neighbouring grid points in x, in floats */
+	double dx;
+	/** Step between neighbouring grid points in y, in floats */
+	double dy;
+	/** Step between neighbouring grid points in z, in floats */
+	double dz;
+	/** Offset of each stencil corner from the origin corner, in floats */
+	long long delta[8];
+	/** Where vp, vs and rho start; null if a field is missing or not in memory */
+	const float *field[3];
+} cs173_batch_params_t;
+
+/**
+ * Signature of the batch kernels. Only the vp, vs and rho bits of fields are gathered, the rest
+ * come out as -1. Returns the number of points served and flags them in done.
+ */
+typedef int (*cs173_batch_kernel_t)(const cs173_batch_params_t *params, const cs173_point_t *points, const double *utm_e,
+                                    const double *utm_n, cs173_properties_t *data, int count, int fields,
+                                    unsigned char *done);
+
+/** Returns the widest batch kernel allowed by mode that the CPU supports, or NULL for none. */
+cs173_batch_kernel_t cs173_select_batch_kernel(int mode);
+
+#endif
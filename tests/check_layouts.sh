@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Converts a small synthetic model to every layout and checks that each answers queries
+# like the planar files it came from: bit for bit, or within the error cs173_convert reports
+# for the quantized layout. Each layout is checked with its fields in memory and on disk.
+# The model is 40 x 36 x 30, so its edge bricks are partial. It is written twice, with
+# fast-Y and with fast-X top-down files, and both are checked against the fast-Y files.
+#
+
+dir=`mktemp -d ${TMPDIR:-/tmp}/cs173_layouts.XXXXXX` || exit 1
+trap 'rm -rf "$dir"' 0
+
+./cs173_bench -g -d "$dir" -x 40 -y 36 -z 30 > /dev/null || exit 1
+./cs173_bench -g -d "$dir/fastx" -x 40 -y 36 -z 30 -a fast-X > /dev/null || exit 1
+mv "$dir/fastx/model/cs173" "$dir/model/fastx" || exit 1
+
+# The reference is read from the fast-Y planar files, in memory, so through the SIMD kernels
+# where the CPU has them; the kernels match the scalar path exactly.
+mkdir -p "$dir/model/fastx_file/data" || exit 1
+sed -e "s|^model_dir = .*|model_dir = ../../fastx/data/cs173|" \
+    -e 's/^storage = .*/storage = file/' "$dir/model/fastx/data/config" > "$dir/model/fastx_file/data/config"
+
+status=0
+for label in fastx fastx_file; do
+	./cs173_layouts -d "$dir" -r cs173 -l $label || status=1
+done
+
+for source in cs173 fastx; do
+	planar="$dir/model/$source/data"
+	for format in interleaved bricked compressed quantized; do
+		name=${source}_$format
+		data="$dir/model/$name/data"
+		mkdir -p "$data/cs173" "$dir/model/${name}_file/data" || exit 1
+		cp "$planar"/cs173/*.dat "$data/cs173/" || exit 1
+		sed -e 's/^storage = .*/storage = memory/' "$planar/config" > "$data/config"
+		if [ "$format" = quantized ]; then
+			echo "precision = quantized" >> "$data/config"
+		fi
+
+		../src/cs173_convert -d "$data" -f $format > "$dir/$name.log" || { cat "$dir/$name.log"; exit 1; }
+		rm -f "$data"/cs173/vp.dat "$data"/cs173/vs.dat "$data"/cs173/density.dat
+
+		sed -e "s|^model_dir = .*|model_dir = ../../$name/data/cs173|" \
+		    -e 's/^storage = .*/storage = file/' "$data/config" > "$dir/model/${name}_file/data/config"
+
+		bounds=""
+		if [ "$format" = quantized ]; then
+			bounds=`awk '$1 == "vp" { vp = $5 } $1 == "vs" { vs = $5 } $1 == "density" { rho = $5 }
+			             END { if (vp != "" && vs != "" && rho != "") print "-e " vp "," vs "," rho }' "$dir/$name.log"`
+			if [ -z "$bounds" ]; then
+				echo "cs173_convert did not report the quantization error bounds."
+				cat "$dir/$name.log"
+				exit 1
+			fi
+		fi
+
+		for label in $name ${name}_file; do
+			./cs173_layouts -d "$dir" -r cs173 -l $label $bounds || status=1
+		done
+	done
+done
+
+exit $status
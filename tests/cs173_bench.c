@@ -0,0 +1,482 @@
+/**
+ * @file cs173_bench.c
+ * @brief Generates a synthetic CS173 model and measures query throughput against it.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Writes a small stand-in for the model, with the layout cs173_open expects, so query
+ * performance can be measured offline and compared from one change to the next:
+ *
+ *   cs173_bench -g -d <dir> [-x nx] [-y ny] [-z nz] [-a fast-Y|fast-X]
+ *
+ * and times cs173_query_h on it, or on any installed model, under several access patterns:
+ *
+ *   cs173_bench -d <dir> [-l label] [-n points] [-b batch]
+ *
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cs173.h"
+#include "cs173_gtl.h"
+
+/** Label of the generated model, which keeps its fields in memory. */
+#define BENCH_MEMORY_LABEL "cs173"
+/** Label of the generated model's disk-backed twin, which shares its field files. */
+#define BENCH_DISK_LABEL "cs173_disk"
+/** Meters between neighbouring samples of the generated model, in x and y. */
+#define BENCH_SPACING 500.0
+/** Meters between neighbouring samples of the generated model, in depth. */
+#define BENCH_DEPTH_SPACING 100.0
+/** Meters between neighbouring samples of the generated Vs30 map. */
+#define BENCH_VS30_SPACING 1000.0
+/** Seed of the benchmark's query points, so runs are comparable. */
+#define BENCH_SEED 173
+
+/** The access patterns measured. */
+static const char *patterns[] = { "random", "mesh", "column", "surface" };
+/** Number of access patterns measured. */
+#define BENCH_PATTERNS 4
+
+/**
+ * Prints the usage and exits.
+ */
+static void usage() {
+	printf("\n./cs173_bench -g -d [dir] [-x nx] [-y ny] [-z nz] [-a fast-Y|fast-X]\n");
+	printf("./cs173_bench -d [dir] [-l label] [-n points] [-b batch]\n\n");
+	printf("-g - generate a synthetic model under dir rather than measuring one.\n");
+	printf("-d - directory holding model/<label>/data/config, as passed to cs173_init.\n");
+	printf("-x, -y, -z - samples of the generated model in each direction (200, 200, 50).\n");
+	printf("-a - seek_axis of the generated model's files (fast-Y, as the real model's).\n");
+	printf("-l - model label to measure; may be repeated. Defaults to the generated\n");
+	printf("     %s (in memory) and %s (read from disk).\n", BENCH_MEMORY_LABEL, BENCH_DISK_LABEL);
+	printf("-n - points queried per access pattern (100000).\n");
+	printf("-b - points per cs173_query_h call, over which latency is measured (64).\n\n");
+	exit(1);
+}
+
+/**
+ * Returns a monotonic time in seconds.
+ */
+static double bench_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Returns a uniform random number in [0, 1).
+ *
+ * @param seed The generator state.
+ */
+static double bench_uniform(unsigned int *seed) {
+	return rand_r(seed) / (RAND_MAX + 1.0);
+}
+
+/**
+ * Sorts doubles in ascending order, for qsort.
+ */
+static int bench_compare(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Writes the configuration of a generated model.
+ *
+ * @param file The config file.
+ * @param model_dir Directory of the field files, relative to the config file's directory.
+ * @param storage The storage mode the model is read with.
+ * @param nx Samples in x.
+ * @param ny Samples in y.
+ * @param nz Samples in z.
+ * @param axis The seek_axis of the field files, fast-Y or fast-X.
+ * @return SUCCESS or FAIL.
+ */
+static int write_config(char *file, char *model_dir, char *storage, int nx, int ny, int nz, char *axis) {
+	double width = (nx - 1) * BENCH_SPACING, height = (ny - 1) * BENCH_SPACING;
+	double e = 400000.0, n = 3700000.0;
+	FILE *fp = fopen(file, "w");
+
+	if (fp == NULL) {
+		fprintf(stderr, "Could not write %s.\n", file);
+		return FAIL;
+	}
+
+	fprintf(fp, "# Synthetic model written by cs173_bench\n");
+	fprintf(fp, "utm_zone = 11\nmodel_dir = %s\ngtl = on\n", model_dir);
+	fprintf(fp, "nx = %d\nny = %d\nnz = %d\n", nx, ny, nz);
+	fprintf(fp, "depth = %f\ndepth_interval = %f\n", nz * BENCH_DEPTH_SPACING, BENCH_DEPTH_SPACING);
+	fprintf(fp, "p5 = -0.0024189659303912917\np4 = 0.015600987888334450\np3 = 0.051962399479341816\n");
+	fprintf(fp, "p2 = -0.51231936640441489\np1 = 1.2550758337054457\np0 = 1.2948318548300342\n");
+	fprintf(fp, "density = vs\n");
+	fprintf(fp, "bottom_left_corner_e = %f\nbottom_left_corner_n = %f\n", e, n);
+	fprintf(fp, "top_left_corner_e = %f\ntop_left_corner_n = %f\n", e, n + height);
+	fprintf(fp, "bottom_right_corner_e = %f\nbottom_right_corner_n = %f\n", e + width, n);
+	fprintf(fp, "top_right_corner_e = %f\ntop_right_corner_n = %f\n", e + width, n + height);
+	fprintf(fp, "seek_axis = %s\nseek_direction = top-down\n", axis);
+	fprintf(fp, "storage = %s\nvs30_raster = off\nvs30_cache = off\n", storage);
+
+	return (fclose(fp) == 0) ? SUCCESS : FAIL;
+}
+
+/**
+ * Writes one field of a generated model: a velocity gradient with depth under gentle lateral
+ * variation, so neighbouring samples differ as they do in the real model.
+ *
+ * @param file The field file.
+ * @param config The model configuration, for its size and file order.
+ * @param field 0 for vp, 1 for vs, 2 for density.
+ * @return SUCCESS or FAIL.
+ */
+static int write_field(char *file, cs173_configuration_t *config, int field) {
+	size_t size = (size_t)config->nx * config->ny * config->nz * sizeof(float);
+	cs173_strides_t strides;
+	float *out = MAP_FAILED;
+	double vp = 0;
+	int x = 0, y = 0, z = 0, fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd >= 0 && ftruncate(fd, size) == 0)
+		out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fd >= 0) close(fd);
+	if (out == MAP_FAILED) {
+		fprintf(stderr, "Could not write %s.\n", file);
+		return FAIL;
+	}
+
+	cs173_resolve_strides(config, &strides);
+	for (z = 0; z < config->nz; z++) {
+		for (y = 0; y < config->ny; y++) {
+			for (x = 0; x < config->nx; x++) {
+				vp = 1800 + 5000 * (1 - exp(-z * BENCH_DEPTH_SPACING / 8000)) + 250 * sin(x * 0.13) * cos(y * 0.11);
+				out[strides.origin + x * strides.dx + y * strides.dy + z * strides.dz] =
+					(field == 0) ? vp : (field == 1) ? vp / 1.75 : 1000 + 0.3 * vp;
+			}
+		}
+	}
+
+	if (munmap(out, size) != 0) return FAIL;
+	return SUCCESS;
+}
+
+/**
+ * Writes a stand-in for UCVM's Vs30 map e-tree, covering the generated model with a smooth
+ * Vs30 surface, with the metadata cs173_read_vs30_map expects.
+ *
+ * @param file The e-tree file.
+ * @param config The model configuration, for the area to cover.
+ * @return SUCCESS or FAIL.
+ */
+static int write_vs30_map(char *file, cs173_configuration_t *config) {
+	char utm_definition[64], aeqd_definition[128], appmeta[512];
+	projPJ latlon = pj_init_plus("+proj=latlong +datum=WGS84"), utm = NULL, aeqd = NULL;
+	double center_e = (config->bottom_left_corner_e + config->top_right_corner_e) / 2;
+	double center_n = (config->bottom_left_corner_n + config->top_right_corner_n) / 2;
+	double extent = 0, origin_e = 0, origin_n = 0;
+	cs173_vs30_mpayload_t payload;
+	etree_addr_t addr;
+	etree_t *ep = NULL;
+	int level = 0, samples = 0, x = 0, y = 0, ret = SUCCESS;
+
+	// The map is centered on the model, square, and twice as wide as the model's diagonal,
+	// in a power of two of samples as e-tree octants come.
+	extent = 2 * sqrt(pow(config->top_right_corner_e - config->bottom_left_corner_e, 2) +
+	                  pow(config->top_right_corner_n - config->bottom_left_corner_n, 2));
+	level = ceil(log(extent / BENCH_VS30_SPACING) / log(2.0));
+	samples = 1 << level;
+	extent = samples * BENCH_VS30_SPACING;
+
+	sprintf(utm_definition, "+proj=utm +zone=%d +ellps=WGS84", config->utm_zone);
+	utm = pj_init_plus(utm_definition);
+	if (latlon == NULL || utm == NULL) ret = FAIL;
+	if (ret == SUCCESS) {
+		pj_transform(utm, latlon, 1, 1, &center_e, &center_n, NULL);
+		sprintf(aeqd_definition, "+proj=aeqd +lat_0=%f +lon_0=%f +x_0=0.0 +y_0=0.0 +datum=WGS84 +units=m",
+		        center_n * RAD_TO_DEG, center_e * RAD_TO_DEG);
+		if ((aeqd = pj_init_plus(aeqd_definition)) == NULL) ret = FAIL;
+	}
+	if (ret != SUCCESS) {
+		fprintf(stderr, "Could not set up the projections of the Vs30 map.\n");
+		if (utm != NULL) pj_free(utm);
+		if (latlon != NULL) pj_free(latlon);
+		return FAIL;
+	}
+	origin_e = -extent / 2;
+	origin_n = -extent / 2;
+	pj_transform(aeqd, latlon, 1, 1, &origin_e, &origin_n, NULL);
+
+	snprintf(appmeta, sizeof(appmeta), "vs30|Synthetic Vs30 map written by cs173_bench for benchmarking"
+	         "|cs173_bench|2026-01-01|%f|float surf; float vs30;|%s|%f,%f,0.0|0.0|%f,%f,1.0|%u,%u,1",
+	         BENCH_VS30_SPACING, aeqd_definition, origin_e * RAD_TO_DEG, origin_n * RAD_TO_DEG, extent, extent,
+	         (unsigned int)samples << (ETREE_MAXLEVEL - level), (unsigned int)samples << (ETREE_MAXLEVEL - level));
+
+	ep = etree_open(file, O_RDWR | O_CREAT | O_TRUNC, 64, sizeof(cs173_vs30_mpayload_t), 3);
+	if (ep == NULL || etree_registerschema(ep, "float surf; float vs30;") != 0 ||
+	    etree_setappmeta(ep, appmeta) != 0) {
+		fprintf(stderr, "Could not write %s.\n", file);
+		ret = FAIL;
+	}
+
+	addr.level = level;
+	addr.type = ETREE_LEAF;
+	addr.z = 0;
+	addr.t = 0;
+	for (y = 0; ret == SUCCESS && y < samples; y++) {
+		for (x = 0; ret == SUCCESS && x < samples; x++) {
+			addr.x = (etree_tick_t)x << (ETREE_MAXLEVEL - level);
+			addr.y = (etree_tick_t)y << (ETREE_MAXLEVEL - level);
+			payload.surf = 0;
+			payload.vs30 = 450 + 200 * sin(x * 0.05) * cos(y * 0.07);
+			if (etree_insert(ep, addr, &payload) != 0) {
+				fprintf(stderr, "Could not write %s.\n", file);
+				ret = FAIL;
+			}
+		}
+	}
+
+	if (ep != NULL && etree_close(ep) != 0) ret = FAIL;
+	if (ret != SUCCESS) unlink(file);
+	pj_free(aeqd);
+	pj_free(utm);
+	pj_free(latlon);
+
+	return ret;
+}
+
+/**
+ * Generates a synthetic model under dir: the fields and configuration under the in-memory
+ * label, a configuration under the disk-backed label reading the same fields, and the Vs30 map.
+ *
+ * @param dir The directory to pass to cs173_open.
+ * @param nx Samples in x.
+ * @param ny Samples in y.
+ * @param nz Samples in z.
+ * @param axis The seek_axis of the field files, fast-Y or fast-X.
+ * @return SUCCESS or FAIL.
+ */
+static int generate(char *dir, int nx, int ny, int nz, char *axis) {
+	const char *names[3] = { "vp", "vs", "density" };
+	cs173_configuration_t *config = calloc(1, sizeof(cs173_configuration_t));
+	char path[512], file[512];
+	int f = 0, ret = SUCCESS;
+
+	if (config == NULL) return FAIL;
+
+	sprintf(path, "%s/model", dir);
+	mkdir(dir, 0755);
+	mkdir(path, 0755);
+	sprintf(path, "%s/model/ucvm", dir);
+	mkdir(path, 0755);
+	sprintf(path, "%s/model/%s", dir, BENCH_MEMORY_LABEL);
+	mkdir(path, 0755);
+	sprintf(path, "%s/model/%s/data", dir, BENCH_MEMORY_LABEL);
+	mkdir(path, 0755);
+	sprintf(path, "%s/model/%s/data/cs173", dir, BENCH_MEMORY_LABEL);
+	mkdir(path, 0755);
+	sprintf(path, "%s/model/%s", dir, BENCH_DISK_LABEL);
+	mkdir(path, 0755);
+	sprintf(path, "%s/model/%s/data", dir, BENCH_DISK_LABEL);
+	mkdir(path, 0755);
+
+	sprintf(file, "%s/model/%s/data/config", dir, BENCH_MEMORY_LABEL);
+	if (write_config(file, "cs173", "memory", nx, ny, nz, axis) != SUCCESS ||
+	    cs173_read_configuration(file, config) != SUCCESS) ret = FAIL;
+	sprintf(file, "%s/model/%s/data/config", dir, BENCH_DISK_LABEL);
+	if (ret == SUCCESS && write_config(file, "../../" BENCH_MEMORY_LABEL "/data/cs173", "file", nx, ny, nz, axis) != SUCCESS)
+		ret = FAIL;
+
+	for (f = 0; ret == SUCCESS && f < 3; f++) {
+		sprintf(file, "%s/model/%s/data/cs173/%s.dat", dir, BENCH_MEMORY_LABEL, names[f]);
+		ret = write_field(file, config, f);
+	}
+
+	sprintf(file, "%s/model/ucvm/ucvm.e", dir);
+	if (ret == SUCCESS) ret = write_vs30_map(file, config);
+
+	free(config);
+	return ret;
+}
+
+/**
+ * Lays out the points of one access pattern over a model's box.
+ *
+ * random: anywhere in the model. mesh: a regular mesh, x fastest, then y, then depth.
+ * column: random sites, each down every model layer. surface: random sites within the GTL.
+ *
+ * @param config The model configuration.
+ * @param pattern Index into patterns.
+ * @param points The points to fill.
+ * @param n The number of points.
+ * @return SUCCESS or FAIL.
+ */
+static int layout(cs173_configuration_t *config, int pattern, cs173_point_t *points, int n) {
+	char utm_definition[64];
+	projPJ latlon = pj_init_plus("+proj=latlong +datum=WGS84"), utm = NULL;
+	double u = 0, v = 0, depth = 0;
+	unsigned int seed = BENCH_SEED + pattern;
+	int i = 0, mx = 1, mz = 1, j = 0, ret = SUCCESS;
+
+	sprintf(utm_definition, "+proj=utm +zone=%d +ellps=WGS84", config->utm_zone);
+	utm = pj_init_plus(utm_definition);
+	if (latlon == NULL || utm == NULL) ret = FAIL;
+
+	if (pattern == 1) {
+		mz = (config->nz < 16) ? config->nz : 16;
+		mx = (int)sqrt((double)n / mz);
+		if (mx < 2) mx = 2;
+	}
+
+	for (i = 0; ret == SUCCESS && i < n; i++) {
+		switch (pattern) {
+		case 0:
+			u = bench_uniform(&seed);
+			v = bench_uniform(&seed);
+			depth = bench_uniform(&seed) * config->depth;
+			break;
+		case 1:
+			j = i % (mx * mx * mz);
+			u = (j % mx) / (mx - 1.0);
+			v = (j / mx % mx) / (mx - 1.0);
+			depth = (mz > 1) ? (j / (mx * mx)) * config->depth / (mz - 1) : 0;
+			break;
+		case 2:
+			if (i % config->nz == 0) {
+				u = bench_uniform(&seed);
+				v = bench_uniform(&seed);
+			}
+			depth = (i % config->nz + 0.5) * config->depth / config->nz;
+			break;
+		default:
+			u = bench_uniform(&seed);
+			v = bench_uniform(&seed);
+			depth = bench_uniform(&seed) * config->depth_interval;
+			break;
+		}
+		points[i].longitude = config->bottom_left_corner_e +
+		                      u * (config->bottom_right_corner_e - config->bottom_left_corner_e) +
+		                      v * (config->top_left_corner_e - config->bottom_left_corner_e);
+		points[i].latitude = config->bottom_left_corner_n +
+		                     u * (config->bottom_right_corner_n - config->bottom_left_corner_n) +
+		                     v * (config->top_left_corner_n - config->bottom_left_corner_n);
+		points[i].depth = depth;
+		pj_transform(utm, latlon, 1, 1, &points[i].longitude, &points[i].latitude, NULL);
+		points[i].longitude *= RAD_TO_DEG;
+		points[i].latitude *= RAD_TO_DEG;
+	}
+
+	if (utm != NULL) pj_free(utm);
+	if (latlon != NULL) pj_free(latlon);
+	return ret;
+}
+
+/**
+ * Times every access pattern against one model, printing a row per pattern.
+ *
+ * @param dir The directory to pass to cs173_open.
+ * @param label The model label.
+ * @param n Points queried per pattern.
+ * @param batch Points per cs173_query_h call.
+ * @return SUCCESS or FAIL.
+ */
+static int measure(char *dir, char *label, int n, int batch) {
+	cs173_configuration_t *config = calloc(1, sizeof(cs173_configuration_t));
+	cs173_point_t *points = malloc((size_t)n * sizeof(cs173_point_t));
+	cs173_properties_t *data = malloc((size_t)n * sizeof(cs173_properties_t));
+	int calls = (n + batch - 1) / batch;
+	double *latency = malloc(calls * sizeof(double));
+	cs173_model_handle *handle = NULL;
+	double start = 0, open_time = 0, total = 0;
+	char file[512];
+	int pattern = 0, call = 0, count = 0, ret = SUCCESS;
+
+	sprintf(file, "%s/model/%s/data/config", dir, label);
+	if (config == NULL || points == NULL || data == NULL || latency == NULL ||
+	    cs173_read_configuration(file, config) != SUCCESS) ret = FAIL;
+
+	// Opening includes the first queries, which read the fields in or open them.
+	start = bench_now();
+	if (ret == SUCCESS && (handle = cs173_open(dir, label)) == NULL) ret = FAIL;
+	if (ret == SUCCESS && (ret = layout(config, 3, points, 1)) == SUCCESS) {
+		points[1] = points[0];
+		points[1].depth = config->depth / 2;
+		ret = cs173_query_h(handle, points, data, 2);
+	}
+	open_time = bench_now() - start;
+	if (ret != SUCCESS) fprintf(stderr, "Could not open %s under %s.\n", label, dir);
+	else printf("%-12s %-8s %12.3f s to open and load\n", label, "", open_time);
+
+	for (pattern = 0; ret == SUCCESS && pattern < BENCH_PATTERNS; pattern++) {
+		if ((ret = layout(config, pattern, points, n)) != SUCCESS) break;
+		total = 0;
+		for (call = 0; ret == SUCCESS && call < calls; call++) {
+			count = (n - call * batch < batch) ? n - call * batch : batch;
+			start = bench_now();
+			ret = cs173_query_h(handle, points + (size_t)call * batch, data + (size_t)call * batch, count);
+			latency[call] = bench_now() - start;
+			total += latency[call];
+		}
+		qsort(latency, calls, sizeof(double), bench_compare);
+		printf("%-12s %-8s %12.0f %10.1f %10.1f %10.1f %10.1f\n", label, patterns[pattern], n / total,
+		       latency[calls / 2] * 1e6, latency[calls * 9 / 10] * 1e6, latency[calls * 99 / 100] * 1e6,
+		       latency[calls - 1] * 1e6);
+	}
+
+	if (handle != NULL) cs173_close(handle);
+	free(config);
+	free(points);
+	free(data);
+	free(latency);
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	char *dir = NULL, *labels[16], *axis = "fast-Y";
+	char config[512];
+	int nx = 200, ny = 200, nz = 50, n = 100000, batch = 64;
+	int opt = 0, make = 0, numlabels = 0, i = 0;
+	struct stat st;
+
+	while ((opt = getopt(argc, argv, "gd:x:y:z:a:l:n:b:")) != -1) {
+		switch (opt) {
+		case 'g': make = 1; break;
+		case 'd': dir = optarg; break;
+		case 'x': nx = atoi(optarg); break;
+		case 'y': ny = atoi(optarg); break;
+		case 'z': nz = atoi(optarg); break;
+		case 'a': axis = optarg; break;
+		case 'l': if (numlabels < 16) labels[numlabels++] = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		case 'b': batch = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (dir == NULL || nx < 2 || ny < 2 || nz < 2 || n < 1 || batch < 1) usage();
+	if (strcmp(axis, "fast-Y") != 0 && strcmp(axis, "fast-X") != 0) usage();
+
+	if (make) {
+		if (generate(dir, nx, ny, nz, axis) != SUCCESS) return 1;
+		printf("Generated a %d x %d x %d model under %s.\n", nx, ny, nz, dir);
+		return 0;
+	}
+
+	if (numlabels == 0) {
+		labels[numlabels++] = BENCH_MEMORY_LABEL;
+		sprintf(config, "%s/model/%s/data/config", dir, BENCH_DISK_LABEL);
+		if (stat(config, &st) == 0) labels[numlabels++] = BENCH_DISK_LABEL;
+	}
+
+	printf("%-12s %-8s %12s %10s %10s %10s %10s\n", "model", "pattern", "points/s", "p50 us", "p90 us",
+	       "p99 us", "max us");
+	printf("%-12s %-8s %12s  (latency of one call of %d points)\n", "", "", "", batch);
+	for (i = 0; i < numlabels; i++)
+		if (measure(dir, labels[i], n, batch) != SUCCESS) return 1;
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+/**
+ * @file cs173_kernels.c
+ * @brief Checks the SIMD batch kernels against the scalar query arithmetic.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Runs each batch kernel the CPU supports over a small model held in memory, at random points
+ * and at points on and one step either side of its grid planes, where the cell fractions are
+ * hardest to get right. Each point a kernel serves must come out bit-identical to what
+ * cs173_query computes for it without the kernels: the cell from the scaled position, the
+ * fractions from fmod, and the eight corners blended by cs173_interp_trilinear. Returns 0 if
+ * every kernel agrees, 1 if one does not, and 77, which make check reports as a skip, if the
+ * CPU has no kernel.
+ *
+ */
+
+#include "cs173.h"
+#include "cs173_interp.h"
+#include "cs173_simd.h"
+
+/** Samples of the model in x, y and z; not powers of two, nor the spacings below. */
+#define KERNELS_NX 23
+#define KERNELS_NY 19
+#define KERNELS_NZ 17
+/** Grid spacings in meters, none of them exact in binary. */
+#define KERNELS_X_INTERVAL 137.1
+#define KERNELS_Y_INTERVAL 251.3
+#define KERNELS_DEPTH_INTERVAL 97.3
+/** Points checked per kernel; a multiple of every kernel's width. */
+#define KERNELS_POINTS 65536
+/** Seed of the points, so runs are comparable. */
+#define KERNELS_SEED 173
+
+/**
+ * Returns a coordinate along one axis: anywhere in the model, or on a grid plane, or one
+ * representable step either side of it.
+ *
+ * @param seed The generator state.
+ * @param interval The grid spacing along the axis.
+ * @param cells The number of cells along the axis.
+ */
+static double coordinate(unsigned int *seed, double interval, int cells) {
+	double plane = (rand_r(seed) % (cells + 1)) * interval;
+
+	switch (rand_r(seed) % 4) {
+	case 0: return (cells * interval) * rand_r(seed) / (RAND_MAX + 1.0);
+	case 1: return plane;
+	case 2: return nextafter(plane, -HUGE_VAL);
+	default: return nextafter(plane, HUGE_VAL);
+	}
+}
+
+/**
+ * Computes what the scalar query path returns for a point inside the model below the GTL.
+ *
+ * @param p The kernel parameters, which describe the model.
+ * @param e The point's easting relative to the model corner; the model is not rotated.
+ * @param n The point's northing relative to the model corner.
+ * @param depth The point's depth.
+ * @param data Set to the interpolated vp, vs and rho.
+ * @return 1 if the scalar path interpolates the point, 0 if it leaves it to the GTL or
+ * finds it outside the model.
+ */
+static int scalar(const cs173_batch_params_t *p, double e, double n, double depth, cs173_properties_t *data) {
+	cs173_properties_t corners[8];
+	long location = 0;
+	int x = floor(e / p->width_m * p->nx1), y = floor(n / p->height_m * p->ny1);
+	int z = p->z_top - floor(depth / p->depth_interval), c = 0;
+
+	if (depth < 0 || depth < p->gtl_depth || x < 0 || y < 0 || x > p->nx1 - 1 || y > p->ny1 - 1 || z < 1) return 0;
+
+	location = p->origin + x * p->dx + y * p->dy + z * p->dz;
+	for (c = 0; c < 8; c++) {
+		corners[c].vp = p->field[0][location + p->delta[c]];
+		corners[c].vs = p->field[1][location + p->delta[c]];
+		corners[c].rho = p->field[2][location + p->delta[c]];
+	}
+	cs173_interp_trilinear(fmod(e, p->x_interval) / p->x_interval, fmod(n, p->y_interval) / p->y_interval,
+	                       fmod(depth, p->depth_interval) / p->depth_interval, corners, data, CS173_FIELD_VOXEL);
+	return 1;
+}
+
+/**
+ * Runs one kernel over the points and compares what it serves with the scalar path.
+ *
+ * @param name The kernel's name, for the report.
+ * @param kernel The kernel.
+ * @param p The kernel parameters.
+ * @param points The points, with their depths.
+ * @param utm_e The points' eastings.
+ * @param utm_n The points' northings.
+ * @return The number of points that disagree.
+ */
+static int check(const char *name, cs173_batch_kernel_t kernel, const cs173_batch_params_t *p, cs173_point_t *points,
+                 double *utm_e, double *utm_n) {
+	static cs173_properties_t data[KERNELS_POINTS];
+	static unsigned char done[KERNELS_POINTS];
+	cs173_properties_t expected;
+	int i = 0, served = 0, bad = 0;
+
+	memset(done, 0, sizeof(done));
+	served = kernel(p, points, utm_e, utm_n, data, KERNELS_POINTS, CS173_FIELD_VOXEL, done);
+
+	for (i = 0; i < KERNELS_POINTS; i++) {
+		if (!done[i]) continue;
+		if (!scalar(p, utm_e[i], utm_n[i], points[i].depth, &expected) ||
+		    memcmp(&expected.vp, &data[i].vp, sizeof(double)) != 0 ||
+		    memcmp(&expected.vs, &data[i].vs, sizeof(double)) != 0 ||
+		    memcmp(&expected.rho, &data[i].rho, sizeof(double)) != 0) {
+			if (bad < 5)
+				printf("  point (%.17g, %.17g, %.17g): vp is %.17g, not %.17g\n", utm_e[i], utm_n[i],
+				       points[i].depth, data[i].vp, expected.vp);
+			bad++;
+		}
+	}
+
+	printf("%s: %d of %d points served differ from the scalar path.\n", name, bad, served);
+	return (served == 0) ? 1 : bad;
+}
+
+int main() {
+	static cs173_point_t points[KERNELS_POINTS];
+	static double utm_e[KERNELS_POINTS], utm_n[KERNELS_POINTS];
+	cs173_configuration_t config;
+	cs173_strides_t strides;
+	cs173_batch_params_t p;
+	cs173_batch_kernel_t avx512 = cs173_select_batch_kernel(CS173_SIMD_AVX512);
+	cs173_batch_kernel_t avx2 = cs173_select_batch_kernel(CS173_SIMD_AVX2);
+	size_t size = (size_t)KERNELS_NX * KERNELS_NY * KERNELS_NZ;
+	float *fields[3] = { malloc(size * sizeof(float)), malloc(size * sizeof(float)), malloc(size * sizeof(float)) };
+	unsigned int seed = KERNELS_SEED;
+	size_t s = 0;
+	int i = 0, f = 0, bad = 0;
+
+	if (avx512 == NULL && avx2 == NULL) {
+		printf("No batch kernel runs on this CPU.\n");
+		return 77;
+	}
+	if (fields[0] == NULL || fields[1] == NULL || fields[2] == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.nx = KERNELS_NX;
+	config.ny = KERNELS_NY;
+	config.nz = KERNELS_NZ;
+	sprintf(config.seek_axis, "fast-Y");
+	sprintf(config.seek_direction, "top-down");
+	cs173_resolve_strides(&config, &strides);
+
+	// The parameters as cs173_query sets them up, for an unrotated model with the GTL on.
+	memset(&p, 0, sizeof(p));
+	p.cos_rotation = 1;
+	p.width_m = (KERNELS_NX - 1) * KERNELS_X_INTERVAL;
+	p.height_m = (KERNELS_NY - 1) * KERNELS_Y_INTERVAL;
+	p.nx1 = KERNELS_NX - 1;
+	p.ny1 = KERNELS_NY - 1;
+	p.x_interval = p.width_m / p.nx1;
+	p.y_interval = p.height_m / p.ny1;
+	p.depth_interval = KERNELS_DEPTH_INTERVAL;
+	p.z_top = KERNELS_NZ * KERNELS_DEPTH_INTERVAL / KERNELS_DEPTH_INTERVAL - 1;
+	p.gtl_depth = KERNELS_DEPTH_INTERVAL;
+	p.origin = strides.origin;
+	p.dx = strides.dx;
+	p.dy = strides.dy;
+	p.dz = strides.dz;
+	for (i = 0; i < 8; i++) p.delta[i] = (i & 1) * strides.dx + ((i >> 1) & 1) * strides.dy - (i >> 2) * strides.dz;
+	for (f = 0; f < 3; f++) {
+		for (s = 0; s < size; s++) fields[f][s] = 1000 * (f + 1) + 3000.0 * rand_r(&seed) / (RAND_MAX + 1.0);
+		p.field[f] = fields[f];
+	}
+
+	for (i = 0; i < KERNELS_POINTS; i++) {
+		utm_e[i] = coordinate(&seed, p.x_interval, KERNELS_NX - 1);
+		utm_n[i] = coordinate(&seed, p.y_interval, KERNELS_NY - 1);
+		points[i].depth = coordinate(&seed, KERNELS_DEPTH_INTERVAL, KERNELS_NZ - 1);
+	}
+
+	if (avx512 != NULL && avx512 != avx2) bad += check("avx512", avx512, &p, points, utm_e, utm_n);
+	if (avx2 != NULL) bad += check("avx2", avx2, &p, points, utm_e, utm_n);
+
+	for (f = 0; f < 3; f++) free(fields[f]);
+	return (bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+/**
+ * @file cs173_layouts.c
+ * @brief Checks that a model converted to another layout answers queries like the original.
+ * @author - SCEC <>
+ * @version 1.0
+ *
+ * @section DESCRIPTION
+ *
+ * Queries the same points of two labels of one model, a reference read from the planar files
+ * and one converted by cs173_convert, and compares what they return:
+ *
+ *   cs173_layouts -d <dir> -r <reference label> -l <label> [-e vp,vs,rho]
+ *
+ * Without -e every property of every point must be bit-identical, as for the interleaved,
+ * bricked and compressed layouts. With -e the label is lossy, as the quantized layout is:
+ * below the GTL its vp, vs and rho may each differ by up to the bound given, the one
+ * cs173_convert reports for the field, and every point must still be inside or outside the
+ * model in both. Returns 0 if the labels agree.
+ *
+ */
+
+#include <getopt.h>
+#include "cs173.h"
+
+/** Points compared. */
+#define LAYOUTS_POINTS 200000
+/** Seed of the points, so runs are comparable. */
+#define LAYOUTS_SEED 173
+
+/**
+ * Prints the usage and exits.
+ */
+static void usage() {
+	printf("\n./cs173_layouts -d [dir] -r [reference label] -l [label] [-e vp,vs,rho]\n\n");
+	printf("-d - directory holding model/<label>/data/config, as passed to cs173_init.\n");
+	printf("-r - label of the model read from the planar files.\n");
+	printf("-l - label of the same model in another layout.\n");
+	printf("-e - most each of vp, vs and rho may differ below the GTL, for a lossy layout.\n");
+	printf("     Without it the two must agree exactly.\n\n");
+	exit(1);
+}
+
+/**
+ * Lays out points at random over a model's box and a little beyond it on every side, so
+ * some fall outside the model, above its surface and below its bottom.
+ *
+ * @param config The model configuration.
+ * @param points The points to fill.
+ * @param n The number of points.
+ * @return SUCCESS or FAIL.
+ */
+static int layout(cs173_configuration_t *config, cs173_point_t *points, int n) {
+	char utm_definition[64];
+	projPJ latlon = pj_init_plus("+proj=latlong +datum=WGS84"), utm = NULL;
+	unsigned int seed = LAYOUTS_SEED;
+	double u = 0, v = 0;
+	int i = 0, ret = SUCCESS;
+
+	sprintf(utm_definition, "+proj=utm +zone=%d +ellps=WGS84", config->utm_zone);
+	utm = pj_init_plus(utm_definition);
+	if (latlon == NULL || utm == NULL) ret = FAIL;
+
+	for (i = 0; ret == SUCCESS && i < n; i++) {
+		u = -0.05 + 1.1 * rand_r(&seed) / (RAND_MAX + 1.0);
+		v = -0.05 + 1.1 * rand_r(&seed) / (RAND_MAX + 1.0);
+		points[i].longitude = config->bottom_left_corner_e +
+		                      u * (config->bottom_right_corner_e - config->bottom_left_corner_e) +
+		                      v * (config->top_left_corner_e - config->bottom_left_corner_e);
+		points[i].latitude = config->bottom_left_corner_n +
+		                     u * (config->bottom_right_corner_n - config->bottom_left_corner_n) +
+		                     v * (config->top_left_corner_n - config->bottom_left_corner_n);
+		points[i].depth = -config->depth_interval + 1.1 * config->depth * rand_r(&seed) / (RAND_MAX + 1.0);
+		pj_transform(utm, latlon, 1, 1, &points[i].longitude, &points[i].latitude, NULL);
+		points[i].longitude *= RAD_TO_DEG;
+		points[i].latitude *= RAD_TO_DEG;
+	}
+
+	if (utm != NULL) pj_free(utm);
+	if (latlon != NULL) pj_free(latlon);
+	return ret;
+}
+
+/**
+ * Compares the properties two labels returned at the same points, printing the first few
+ * that disagree.
+ *
+ * @param config The model configuration.
+ * @param points The points queried.
+ * @param reference What the reference label returned.
+ * @param data What the label checked returned.
+ * @param n The number of points.
+ * @param bound The most vp, vs and rho may differ by below the GTL, or NULL if they may not.
+ * @return The number of points that disagree.
+ */
+static int compare(cs173_configuration_t *config, cs173_point_t *points, cs173_properties_t *reference,
+                   cs173_properties_t *data, int n, double *bound) {
+	const char *names[5] = { "vp", "vs", "rho", "qp", "qs" };
+	double *r = NULL, *d = NULL;
+	int i = 0, f = 0, bad = 0, wrong = 0;
+
+	for (i = 0; i < n; i++) {
+		r = &reference[i].vp;
+		d = &data[i].vp;
+		wrong = -1;
+		for (f = 0; f < 5 && wrong < 0; f++) {
+			if ((r[f] == -1) != (d[f] == -1))
+				wrong = f;
+			else if (bound == NULL && memcmp(&r[f], &d[f], sizeof(double)) != 0)
+				wrong = f;
+			else if (bound != NULL && f < 3 && points[i].depth >= config->depth_interval &&
+			         fabs(r[f] - d[f]) > bound[f] * (1 + 1e-6) + 1e-9)
+				wrong = f;
+		}
+		if (wrong < 0) continue;
+		if (bad < 5)
+			printf("  point %d (%f, %f, %f): %s is %.17g, not %.17g\n", i, points[i].longitude, points[i].latitude,
+			       points[i].depth, names[wrong], d[wrong], r[wrong]);
+		bad++;
+	}
+
+	return bad;
+}
+
+/**
+ * Queries the same points of a reference model and a converted one, and checks they agree.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @return 0 if the labels agree, 1 if not or if either could not be queried.
+ */
+int main(int argc, char **argv) {
+	cs173_configuration_t *config = calloc(1, sizeof(cs173_configuration_t));
+	cs173_model_handle *reference = NULL, *handle = NULL;
+	cs173_point_t *points = malloc(LAYOUTS_POINTS * sizeof(cs173_point_t));
+	cs173_properties_t *expected = malloc(LAYOUTS_POINTS * sizeof(cs173_properties_t));
+	cs173_properties_t *data = malloc(LAYOUTS_POINTS * sizeof(cs173_properties_t));
+	char *dir = NULL, *reference_label = NULL, *label = NULL, file[512];
+	double bound[3], *bounds = NULL;
+	int opt = 0, bad = 0, ret = SUCCESS;
+
+	while ((opt = getopt(argc, argv, "d:r:l:e:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'r':
+			reference_label = optarg;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'e':
+			if (sscanf(optarg, "%lf,%lf,%lf", &bound[0], &bound[1], &bound[2]) != 3) usage();
+			bounds = bound;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (dir == NULL || reference_label == NULL || label == NULL) usage();
+	if (config == NULL || points == NULL || expected == NULL || data == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	sprintf(file, "%s/model/%s/data/config", dir, reference_label);
+	if (cs173_read_configuration(file, config) != SUCCESS || layout(config, points, LAYOUTS_POINTS) != SUCCESS) {
+		fprintf(stderr, "Could not read %s.\n", file);
+		ret = FAIL;
+	}
+	if (ret == SUCCESS && ((reference = cs173_open(dir, reference_label)) == NULL ||
+	                       (handle = cs173_open(dir, label)) == NULL)) {
+		fprintf(stderr, "Could not open the models under %s.\n", dir);
+		ret = FAIL;
+	}
+	if (ret == SUCCESS && (cs173_query_h(reference, points, expected, LAYOUTS_POINTS) != SUCCESS ||
+	                       cs173_query_h(handle, points, data, LAYOUTS_POINTS) != SUCCESS)) {
+		fprintf(stderr, "Could not query the models under %s.\n", dir);
+		ret = FAIL;
+	}
+
+	if (ret == SUCCESS) {
+		bad = compare(config, points, expected, data, LAYOUTS_POINTS, bounds);
+		printf("%s: %d of %d points differ from %s%s.\n", label, bad, LAYOUTS_POINTS, reference_label,
+		       bounds != NULL ? " by more than the bound" : "");
+	}
+
+	cs173_close(handle);
+	cs173_close(reference);
+	free(data);
+	free(expected);
+	free(points);
+	free(config);
+	return (ret == SUCCESS && bad == 0) ? 0 : 1;
+}